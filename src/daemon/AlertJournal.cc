@@ -0,0 +1,485 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "AlertJournal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Logger.h"
+
+
+
+static const char JOURNAL_MAGIC[8] = { 'P', 'C', 'A', 'L', 'E', 'R', 'T', 'S' };
+
+
+
+AlertJournal::AlertJournal(const char *path)
+{
+        static_assert(sizeof(Record) == 128, "journal records have a fixed size");
+        static_assert(sizeof(Header) <= HEADER_SIZE, "the journal's header has to fit into its page");
+
+        _fd = -1;
+        _map = nullptr;
+        _mapSize = 0;
+        _header = nullptr;
+        _records = nullptr;
+
+        // without a file the alerts are kept for as long as the daemon runs
+        if (!path || !open(path))
+        {
+                LOG_WARNING("Alerts are journaled in memory only.");
+                map(HEADER_SIZE + INITIAL_CAPACITY * sizeof(Record));
+                initialize();
+        }
+}
+
+
+AlertJournal::~AlertJournal()
+{
+        if (_map)
+        {
+                if (_fd >= 0)
+                        msync(_map, _mapSize, MS_SYNC);
+                munmap(_map, _mapSize);
+        }
+        if (_fd >= 0)
+                close(_fd);
+}
+
+
+uint64_t AlertJournal::append(const Record &record)
+{
+        // make room (acknowledged alerts are removed first, then the journal grows up to its maximum size)
+        compact();
+        if ((_header->head > 0) && (_header->head + _header->count == _header->capacity))
+        {
+                memmove(_records, _records + _header->head, _header->count * sizeof(Record));
+                _header->head = 0;
+        }
+        if ((_header->count == _header->capacity) && (_header->capacity < MAX_CAPACITY))
+        {
+                uint32_t capacity = _header->capacity * 2;
+                if (map(HEADER_SIZE + capacity * sizeof(Record)))
+                {
+                        _header->capacity = capacity;
+                        LOG_VERBOSE("Grew the alert journal to %u alerts.", capacity);
+                }
+        }
+
+        // a full journal merges the alert into a pending one which no device has picked up yet, preferably one
+        // from the same app (the newest text is shown, the messages are counted)
+        if (_header->count == _header->capacity)
+        {
+                Record *pending = findPending(record.appName);
+                if (pending)
+                {
+                        uint32_t count = static_cast<uint32_t>(pending->count) + record.count;
+                        pending->id = record.id;
+                        pending->replacesId = record.replacesId;
+                        pending->count = static_cast<uint16_t>((count < 65535) ? count : 65535);
+                        pending->closed = 0;
+                        memcpy(pending->appName, record.appName, sizeof(pending->appName));
+                        memcpy(pending->summary, record.summary, sizeof(pending->summary));
+                        sync();
+                        LOG_VERBOSE("The alert journal is full, merged the alert from %s into a pending one.", record.appName);
+                        return pending->sequence;
+                }
+
+                // every alert has reached a device already, so the device which is furthest behind has to skip one
+                skipOldest();
+        }
+
+        // the record is written before it's counted, so a crash can't leave a half written one behind
+        Record &appended = recordAt(_header->count);
+        appended = record;
+        appended.sequence = _header->nextSequence;
+        appended.deliveredTo = 0;
+        appended.sentTo = 0;
+        appended.closed = 0;
+        _header->count++;
+        _header->nextSequence++;
+        sync();
+        return appended.sequence;
+}
+
+
+void AlertJournal::assignId(uint64_t sequence, uint32_t id)
+{
+        // the notification server returns the ID after the alert has been journaled
+        Record *record = find(sequence);
+        if (!record || (id == 0))
+                return;
+        record->id = id;
+        sync();
+}
+
+
+int AlertJournal::markClosed(uint32_t id)
+{
+        // guard
+        if (id == 0)
+                return 0;
+
+        // an updated notification keeps its ID, so every record of it is closed
+        int closed = 0;
+        for (uint32_t i = 0; i < _header->count; i++)
+        {
+                Record &record = recordAt(i);
+                if ((record.id != id) || record.closed)
+                        continue;
+                record.closed = 1;
+                closed++;
+        }
+        if (closed == 0)
+                return 0;
+
+        // the devices' cursors may move past them now
+        for (uint32_t i = 0; i < _header->devicesCount; i++)
+                advanceCursor(static_cast<int>(i));
+        compact();
+        sync();
+        return closed;
+}
+
+
+int AlertJournal::deviceSlot(const char *address)
+{
+        // guard
+        if (!address)
+                return -1;
+
+        // look for the device
+        for (uint32_t i = 0; i < _header->devicesCount; i++)
+        {
+                if (strncmp(_header->devices[i].address, address, sizeof(_header->devices[i].address) - 1) == 0)
+                        return static_cast<int>(i);
+        }
+
+        // a new device gets all alerts which are still in the journal
+        if (_header->devicesCount >= MAX_DEVICES)
+        {
+                LOG_WARNING("The alert journal can't track more than %d devices.", MAX_DEVICES);
+                return -1;
+        }
+        Device &device = _header->devices[_header->devicesCount];
+        memset(&device, 0, sizeof(device));
+        strncpy(device.address, address, sizeof(device.address) - 1);
+        device.cursor = (_header->count > 0) ? (recordAt(0).sequence - 1) : (_header->nextSequence - 1);
+        _header->devicesCount++;
+        sync();
+        return static_cast<int>(_header->devicesCount - 1);
+}
+
+
+uint64_t AlertJournal::cursor(int slot) const
+{
+        if ((slot < 0) || (slot >= static_cast<int>(_header->devicesCount)))
+                return 0;
+        return _header->devices[slot].cursor;
+}
+
+
+int AlertJournal::collectUndelivered(int slot, std::vector<Record> &records)
+{
+        // guard
+        records.clear();
+        if ((slot < 0) || (slot >= static_cast<int>(_header->devicesCount)))
+                return 0;
+
+        // replay from the cursor, skipping what's delivered or being written already
+        uint8_t bit = static_cast<uint8_t>(1 << slot);
+        for (uint64_t sequence = _header->devices[slot].cursor + 1; sequence < _header->nextSequence; sequence++)
+        {
+                Record *record = find(sequence);
+                if (!record || record->closed || (record->deliveredTo & bit) || (record->sentTo & bit))
+                        continue;
+                record->sentTo |= bit;
+                records.push_back(*record);
+        }
+        return static_cast<int>(records.size());
+}
+
+
+void AlertJournal::markDelivered(int slot, const std::vector<uint64_t> &sequences)
+{
+        // guard
+        if ((slot < 0) || (slot >= static_cast<int>(_header->devicesCount)))
+                return;
+
+        // mark the records
+        uint8_t bit = static_cast<uint8_t>(1 << slot);
+        for (uint64_t sequence : sequences)
+        {
+                Record *record = find(sequence);
+                if (!record)
+                        continue;
+                record->deliveredTo |= bit;
+                record->sentTo &= static_cast<uint8_t>(~bit);
+        }
+
+        // the alerts which every device has got aren't needed anymore
+        advanceCursor(slot);
+        compact();
+        sync();
+}
+
+
+void AlertJournal::markFailed(int slot, const std::vector<uint64_t> &sequences)
+{
+        // guard
+        if ((slot < 0) || (slot >= static_cast<int>(_header->devicesCount)))
+                return;
+
+        // they're replayed with the device's next run
+        uint8_t bit = static_cast<uint8_t>(1 << slot);
+        for (uint64_t sequence : sequences)
+        {
+                Record *record = find(sequence);
+                if (record)
+                        record->sentTo &= static_cast<uint8_t>(~bit);
+        }
+}
+
+
+bool AlertJournal::open(const char *path)
+{
+        // only one daemon may use the journal
+        _fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (_fd < 0)
+        {
+                LOG_WARNING("Couldn't open the alert journal %s: %s", path, strerror(errno));
+                return false;
+        }
+        struct stat status;
+        if ((flock(_fd, LOCK_EX | LOCK_NB) != 0) || (fstat(_fd, &status) != 0))
+        {
+                LOG_WARNING("Couldn't lock the alert journal %s: %s", path, strerror(errno));
+                close(_fd);
+                _fd = -1;
+                return false;
+        }
+
+        // load the journal, an unknown or damaged one is started over
+        size_t fileSize = static_cast<size_t>(status.st_size);
+        if ((fileSize >= static_cast<size_t>(HEADER_SIZE)) && map(fileSize) && validate(fileSize))
+        {
+                // nothing is being written after a restart, and the old timestamps don't mean anything anymore
+                for (uint32_t i = 0; i < _header->count; i++)
+                {
+                        recordAt(i).sentTo = 0;
+                        recordAt(i).receivedAt = 0;
+                        recordAt(i).queuedAt = 0;
+                }
+                compact();
+                LOG_INFO("Loaded %u undelivered alerts from the journal %s.", _header->count, path);
+                return true;
+        }
+        if (fileSize > 0)
+                LOG_WARNING("Discarding the invalid alert journal %s.", path);
+        if (!map(HEADER_SIZE + INITIAL_CAPACITY * sizeof(Record)))
+        {
+                close(_fd);
+                _fd = -1;
+                return false;
+        }
+        initialize();
+        LOG_DEBUG("Created the alert journal %s.", path);
+        return true;
+}
+
+
+bool AlertJournal::map(size_t size)
+{
+        // the new mapping is set up before the old one is dropped, so a failure leaves the journal as it was
+        // (a file is resized and mapped again, memory is copied over)
+        void *map = MAP_FAILED;
+        if (_fd >= 0)
+        {
+                if (ftruncate(_fd, static_cast<off_t>(size)) == 0)
+                        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        }
+        else
+                map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+        {
+                LOG_ERROR("Couldn't map %d bytes for the alert journal: %s", static_cast<int>(size), strerror(errno));
+                return false;
+        }
+        if (_map)
+        {
+                if (_fd < 0)
+                        memcpy(map, _map, (_mapSize < size) ? _mapSize : size);
+                munmap(_map, _mapSize);
+        }
+
+        // done
+        _map = map;
+        _mapSize = size;
+        _header = static_cast<Header *>(_map);
+        _records = reinterpret_cast<Record *>(static_cast<uint8_t *>(_map) + HEADER_SIZE);
+        return true;
+}
+
+
+void AlertJournal::initialize()
+{
+        memset(_map, 0, _mapSize);
+        memcpy(_header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        _header->version = VERSION;
+        _header->recordSize = sizeof(Record);
+        _header->capacity = static_cast<uint32_t>((_mapSize - HEADER_SIZE) / sizeof(Record));
+        _header->head = 0;
+        _header->count = 0;
+        _header->nextSequence = 1;
+        _header->devicesCount = 0;
+        sync();
+}
+
+
+bool AlertJournal::validate(size_t fileSize) const
+{
+        // check the header
+        if ((memcmp(_header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) || (_header->version != VERSION) || (_header->recordSize != sizeof(Record)))
+                return false;
+        if ((_header->capacity == 0) || (_header->capacity > MAX_CAPACITY) || (HEADER_SIZE + _header->capacity * sizeof(Record) != fileSize))
+                return false;
+        if ((_header->head > _header->capacity) || (_header->count > _header->capacity - _header->head) || (_header->devicesCount > MAX_DEVICES))
+                return false;
+
+        // the records' sequence numbers have to be consecutive
+        const Record *records = _records + _header->head;
+        for (uint32_t i = 0; i < _header->count; i++)
+        {
+                if (records[i].sequence != records[0].sequence + i)
+                        return false;
+        }
+        if ((_header->count > 0) && (records[_header->count - 1].sequence >= _header->nextSequence))
+                return false;
+        return true;
+}
+
+
+AlertJournal::Record *AlertJournal::find(uint64_t sequence)
+{
+        // the sequence numbers are consecutive, so the record's index is known
+        if (_header->count == 0)
+                return nullptr;
+        uint64_t first = recordAt(0).sequence;
+        if ((sequence < first) || (sequence >= first + _header->count))
+                return nullptr;
+        return &recordAt(static_cast<uint32_t>(sequence - first));
+}
+
+
+AlertJournal::Record *AlertJournal::findPending(const char *appName)
+{
+        // the newest alerts are the likeliest ones not to have been picked up
+        Record *other = nullptr;
+        for (uint32_t i = _header->count; i > 0; i--)
+        {
+                Record &record = recordAt(i - 1);
+                if ((record.deliveredTo != 0) || (record.sentTo != 0))
+                        continue;
+                if (strncmp(record.appName, appName, APP_NAME_SIZE) == 0)
+                        return &record;
+                if (!other)
+                        other = &record;
+        }
+        return other;
+}
+
+
+void AlertJournal::skipOldest()
+{
+        // the devices which haven't got the oldest alert move past it
+        Record &oldest = recordAt(0);
+        uint64_t skipped = oldest.sequence;
+        for (uint32_t i = 0; i < _header->devicesCount; i++)
+        {
+                if (_header->devices[i].cursor >= skipped)
+                        continue;
+                LOG_WARNING("The alert journal is full, device %s skips the alert from %s.", _header->devices[i].address, oldest.appName);
+                _header->devices[i].cursor = skipped;
+                advanceCursor(static_cast<int>(i));
+        }
+        compact();
+        if ((_header->head > 0) && (_header->head + _header->count == _header->capacity))
+        {
+                memmove(_records, _records + _header->head, _header->count * sizeof(Record));
+                _header->head = 0;
+        }
+}
+
+
+void AlertJournal::advanceCursor(int slot)
+{
+        uint8_t bit = static_cast<uint8_t>(1 << slot);
+        Device &device = _header->devices[slot];
+        for (;;)
+        {
+                Record *record = find(device.cursor + 1);
+                if (!record || !(record->closed || (record->deliveredTo & bit)))
+                        break;
+                device.cursor++;
+        }
+}
+
+
+void AlertJournal::compact()
+{
+        // the records up to the lowest cursor have been delivered to every device
+        if ((_header->devicesCount == 0) || (_header->count == 0))
+                return;
+        uint64_t lowest = _header->devices[0].cursor;
+        for (uint32_t i = 1; i < _header->devicesCount; i++)
+        {
+                if (_header->devices[i].cursor < lowest)
+                        lowest = _header->devices[i].cursor;
+        }
+        uint64_t first = recordAt(0).sequence;
+        if (lowest < first)
+                return;
+        uint32_t removed = static_cast<uint32_t>((lowest - first + 1 < _header->count) ? (lowest - first + 1) : _header->count);
+
+        // the records stay where they are until the end of the file is reached
+        _header->head += removed;
+        _header->count -= removed;
+        if (_header->count == 0)
+                _header->head = 0;
+}
+
+
+void AlertJournal::sync()
+{
+        // the kernel writes the pages back anyway, this just doesn't let them linger
+        if (_fd >= 0)
+                msync(_map, _mapSize, MS_ASYNC);
+}
@@ -0,0 +1,126 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef ALERTJOURNAL_H
+#define ALERTJOURNAL_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+
+
+// append-only journal of the outbound alerts in a memory mapped file, every device has a slot with a
+// delivery cursor (all alerts up to it have been acknowledged) and a bit in every record, so alerts survive
+// restarts and are neither lost nor sent twice; it isn't thread-safe, the owner has to guard it
+class AlertJournal
+{
+public:
+
+        static const int MAX_DEVICES = 8;
+        static const int APP_NAME_SIZE = 40;
+        static const int SUMMARY_SIZE = 48;
+
+        struct Record
+        {
+        public:
+                uint64_t sequence;     // counts up without gaps, assigned when appended
+                int64_t receivedAt;    // monotonic microseconds, 0 if recorded by an earlier run of the daemon
+                int64_t queuedAt;
+                uint32_t id;           // of the desktop notification, 0 until the notification server has returned it
+                uint32_t replacesId;
+                uint16_t count;        // messages the alert stands for
+                uint8_t deliveredTo;   // one bit per device slot, set once the device has acknowledged the alert
+                uint8_t sentTo;        // one bit per device slot, set while the alert is being written
+                uint8_t closed;        // closed on the desktop, so it's skipped like a delivered one
+                uint8_t reserved[3];
+                char appName[APP_NAME_SIZE];
+                char summary[SUMMARY_SIZE];
+        };
+
+
+        AlertJournal(const char *path);
+        ~AlertJournal();
+
+        bool isDurable() const { return (_fd >= 0); }
+        int recordsCount() const { return static_cast<int>(_header->count); }
+
+        uint64_t append(const Record &record);
+        void assignId(uint64_t sequence, uint32_t id);
+        int markClosed(uint32_t id);
+        int deviceSlot(const char *address);
+        uint64_t cursor(int slot) const;
+        int collectUndelivered(int slot, std::vector<Record> &records);
+        void markDelivered(int slot, const std::vector<uint64_t> &sequences);
+        void markFailed(int slot, const std::vector<uint64_t> &sequences);
+
+private:
+
+        static const uint32_t VERSION = 1;
+        static const int HEADER_SIZE = 4096;
+        static const int INITIAL_CAPACITY = 256;   // records, the journal grows up to the maximum
+        static const int MAX_CAPACITY = 8192;      // records, so the file never exceeds 4 KiB + 1 MiB
+
+        struct Device
+        {
+        public:
+                char address[18];
+                uint8_t reserved[6];
+                uint64_t cursor;
+        };
+
+        struct Header
+        {
+        public:
+                char magic[8];
+                uint32_t version;
+                uint32_t recordSize;
+                uint32_t capacity;
+                uint32_t head;           // index of the oldest record, compacting just moves it forward
+                uint32_t count;
+                uint32_t devicesCount;
+                uint64_t nextSequence;
+                Device devices[MAX_DEVICES];
+        };
+
+        int _fd;             // -1 if the journal is kept in memory only
+        void *_map;
+        size_t _mapSize;
+        Header *_header;
+        Record *_records;
+
+        bool open(const char *path);
+        bool map(size_t size);
+        void initialize();
+        bool validate(size_t fileSize) const;
+        Record &recordAt(uint32_t index) { return _records[_header->head + index]; }
+        Record *find(uint64_t sequence);
+        Record *findPending(const char *appName);
+        void skipOldest();
+        void advanceCursor(int slot);
+        void compact();
+        void sync();
+};
+
+#endif // ALERTJOURNAL_H
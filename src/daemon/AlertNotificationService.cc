@@ -32,17 +32,37 @@
 
 
 
-#define UUID_SERVICE_ALERT_NOTIFICATION                    "00001811-0000-1000-8000-00805f9b34fb"
-#define UUID_CHARACTERISTIC_ALERT_NOTIFICATION_NEW_ALERT   "00002a46-0000-1000-8000-00805f9b34fb"
-#define UUID_CHARACTERISTIC_ALERT_NOTIFICATION_CONTROL     "00002a44-0000-1000-8000-00805f9b34fb"
-#define UUID_CHARACTERISTIC_ALERT_NOTIFICATION_EVENT       "00020001-78fc-48fe-8e23-433b3a1942d0"
+static constexpr Uuid UUID_SERVICE_ALERT_NOTIFICATION                   = Uuid::parse("00001811-0000-1000-8000-00805f9b34fb");
+static constexpr Uuid UUID_CHARACTERISTIC_ALERT_NOTIFICATION_NEW_ALERT  = Uuid::parse("00002a46-0000-1000-8000-00805f9b34fb");
+static constexpr Uuid UUID_CHARACTERISTIC_ALERT_NOTIFICATION_CONTROL    = Uuid::parse("00002a44-0000-1000-8000-00805f9b34fb");
+static constexpr Uuid UUID_CHARACTERISTIC_ALERT_NOTIFICATION_EVENT      = Uuid::parse("00020001-78fc-48fe-8e23-433b3a1942d0");
 
 
 
-AlertNotificationService::AlertNotificationService(NotificationEventSink *eventSink)
+// the latency percentiles are logged after every this many acknowledged alerts (and on shutdown)
+#define LATENCY_REPORT_INTERVAL   32
+
+// responses to a call alert, reported by InfiniTime through the event characteristic
+#define EVENT_HANG_UP_CALL        0
+#define EVENT_ANSWER_CALL         1
+#define EVENT_MUTE_CALL           2
+
+
+
+AlertNotificationService::AlertNotificationService(NotificationEventSink *eventSink, const char *journalPath, int coalescingWindow)
         : GattService()
 {
         _eventSink = eventSink;
+        _coalescingWindow = coalescingWindow;
+        _journal = new AlertJournal(journalPath);
+        _journaled = 0;
+}
+
+
+AlertNotificationService::~AlertNotificationService()
+{
+        _totalLatency.log("Desktop to wrist latency");
+        delete _journal;
 }
 
 
@@ -52,26 +72,77 @@ bool AlertNotificationService::run(ManagedDevice *device)
         if (!device)
                 return false;
 
-        // send all pending alerts
+        // the watch reports the user's responses through the event characteristic (the subscription is
+        // kept by the device and renewed after reconnects, so it's only set up once)
+        if (!device->isSubscribed(UUID_CHARACTERISTIC_ALERT_NOTIFICATION_EVENT))
+        {
+                device->subscribeCharacteristic(UUID_CHARACTERISTIC_ALERT_NOTIFICATION_EVENT, [device](const uint8_t *data, int length)
+                {
+                        eventReceived(device, data, length);
+                });
+        }
+
+        // pick up the alerts which haven't been delivered to the device yet, the ones which are being written
+        // are left out (after a reconnect, everything since the device's cursor is replayed at once)
+        journalNotifications();
+        std::vector<AlertJournal::Record> records;
+        int slot = -1;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                slot = _journal->deviceSlot(device->address());
+                if (slot < 0)
+                        return false;
+                if (_journal->collectUndelivered(slot, records) == 0)
+                        return true;
+        }
+
+        // a burst from an app becomes a single alert (the scheduler holds the runs back for the coalescing window)
+        std::vector<AlertGroup> groups;
+        coalesce(records, groups);
+        if (groups.size() < records.size())
+                LOG_DEBUG("Coalesced %d notifications into %d alerts for device %s.", static_cast<int>(records.size()), static_cast<int>(groups.size()), device->address());
+
+        // send them (they're pipelined, the results arrive asynchronously)
         bool allSucceeded = true;
-        for (int i = 0; i < _eventSink->pendingNotificationsCount(); i++)
+        for (const AlertGroup &group : groups)
         {
+                // the alert shows the newest text, its latency counts from the oldest notification
+                AlertJournal::Record alert = *group.newest;
+                alert.receivedAt = group.oldest->receivedAt;
+                alert.queuedAt = group.oldest->queuedAt;
+                int count = (group.count > 0) ? group.count : 1;
+
                 // create an alert
-                const NotificationEventSink::Notification *notification = _eventSink->pendingNotification(i);
                 uint8_t buffer[64];
                 buffer[0] = 1;    // category: e-mail
-                buffer[1] = 1;    // number of new alerts (messages)
+                buffer[1] = static_cast<uint8_t>((count < 255) ? count : 255);   // number of new alerts (messages)
                 buffer[2] = 34;   // E-mail icon
-                strncpy(reinterpret_cast<char *>(buffer + 3), notification->summary.c_str(), 32);
+                strncpy(reinterpret_cast<char *>(buffer + 3), alert.summary, 32);
                 buffer[35] = 0;
 
-                // send it
-                bool success = device->writeCharacteristic(UUID_CHARACTERISTIC_ALERT_NOTIFICATION_NEW_ALERT, buffer, 36);
-                if (success)
-                        LOG_INFO("Sent notification to device %s: %s", device->address(), notification->summary.c_str());
-                else
+                // send it, the journal records are marked as delivered once the device has acknowledged it
+                // (failed ones are replayed with the device's next run)
+                int64_t writeStartedAt = LatencyStats::now();
+                std::vector<uint64_t> sequences = group.sequences;
+                bool sent = device->writeCharacteristicAsync(UUID_CHARACTERISTIC_ALERT_NOTIFICATION_NEW_ALERT, buffer, 36, [this, device, slot, alert, sequences, writeStartedAt](bool success)
+                {
+                        {
+                                std::lock_guard<std::mutex> lock(_mutex);
+                                if (success)
+                                        _journal->markDelivered(slot, sequences);
+                                else
+                                        _journal->markFailed(slot, sequences);
+                        }
+                        if (success)
+                                alertAcknowledged(device, alert, writeStartedAt);
+                        else
+                                LOG_WARNING("Could not send notification to device %s.", device->address());
+                });
+                if (!sent)
                 {
                         LOG_WARNING("Could not send notification to device %s.", device->address());
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _journal->markFailed(slot, sequences);
                         allSucceeded = false;
                 }
         }
@@ -79,3 +150,157 @@ bool AlertNotificationService::run(ManagedDevice *device)
         // done
         return allSucceeded;
 }
+
+
+void AlertNotificationService::journalNotifications()
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // take the new notifications over from the sink
+        std::vector<NotificationEventSink::Notification> notifications;
+        if (_eventSink->copyNotificationsAfter(_journaled, notifications) == 0)
+                return;
+        for (const NotificationEventSink::Notification &notification : notifications)
+        {
+                AlertJournal::Record record;
+                memset(&record, 0, sizeof(record));
+                record.receivedAt = notification.receivedAt;
+                record.queuedAt = notification.queuedAt;
+                record.replacesId = notification.replacesId();
+                record.count = static_cast<uint16_t>((notification.count < 65535) ? notification.count : 65535);
+                strncpy(record.appName, notification.appName(), AlertJournal::APP_NAME_SIZE - 1);
+                strncpy(record.summary, notification.summary(), AlertJournal::SUMMARY_SIZE - 1);
+                _unanswered[notification.sequence] = _journal->append(record);
+        }
+
+        // the IDs of calls which have never been answered aren't waited for forever
+        while (static_cast<int>(_unanswered.size()) > MAX_UNANSWERED)
+                _unanswered.erase(_unanswered.begin());
+
+        // the journal keeps them from now on
+        _journaled = notifications.back().sequence;
+        _eventSink->discardNotificationsUpTo(_journaled);
+}
+
+
+void AlertNotificationService::assignId(uint64_t sequence, int id)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // the returned ID goes into the notification's journal record, so updates and closing can find it
+        std::map<uint64_t, uint64_t>::iterator it = _unanswered.find(sequence);
+        if (it == _unanswered.end())
+                return;
+        _journal->assignId(it->second, static_cast<uint32_t>(id));
+        _unanswered.erase(it);
+}
+
+
+void AlertNotificationService::closeNotification(int id)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // a notification which has been closed on the desktop isn't sent to the devices which haven't got it yet
+        int closed = _journal->markClosed(static_cast<uint32_t>(id));
+        if (closed > 0)
+                LOG_VERBOSE("Skipping %d alerts of closed notification %d.", closed, id);
+}
+
+
+void AlertNotificationService::coalesce(const std::vector<AlertJournal::Record> &records, std::vector<AlertGroup> &groups)
+{
+        groups.clear();
+        for (const AlertJournal::Record &record : records)
+        {
+                // an update joins the group of the notification it replaces, new ones are grouped by app
+                AlertGroup *group = nullptr;
+                for (AlertGroup &candidate : groups)
+                {
+                        bool matches = false;
+                        if (record.replacesId != 0)
+                        {
+                                for (uint32_t id : candidate.ids)
+                                        matches = matches || (id == record.replacesId);
+                                matches = matches || (candidate.replacesId == record.replacesId);
+                        }
+                        else
+                                matches = (candidate.replacesId == 0) && (strcmp(candidate.appName, record.appName) == 0);
+                        if (matches)
+                        {
+                                group = &candidate;
+                                break;
+                        }
+                }
+                if (!group)
+                {
+                        groups.push_back(AlertGroup());
+                        group = &groups.back();
+                        group->appName = record.appName;
+                        group->replacesId = record.replacesId;
+                        group->count = 0;
+                        group->oldest = &record;
+                }
+
+                // merge it
+                if (record.id != 0)
+                        group->ids.push_back(record.id);
+                group->sequences.push_back(record.sequence);
+                if (record.replacesId == 0)
+                        group->count += record.count;
+                group->newest = &record;
+        }
+}
+
+
+void AlertNotificationService::eventReceived(ManagedDevice *device, const uint8_t *data, int length)
+{
+        // guard
+        if (length < 1)
+                return;
+
+        // the event tells how the user has responded to the alert on the watch
+        switch (data[0])
+        {
+        case EVENT_HANG_UP_CALL:
+                LOG_INFO("The call has been hung up on device %s.", device->address());
+                break;
+        case EVENT_ANSWER_CALL:
+                LOG_INFO("The call has been answered on device %s.", device->address());
+                break;
+        case EVENT_MUTE_CALL:
+                LOG_INFO("The call has been muted on device %s.", device->address());
+                break;
+        default:
+                LOG_DEBUG("Unknown alert event %d from device %s.", data[0], device->address());
+                break;
+        }
+}
+
+
+void AlertNotificationService::alertAcknowledged(ManagedDevice *device, const AlertJournal::Record &alert, int64_t writeStartedAt)
+{
+        // alerts replayed from an earlier run of the daemon don't have any meaningful timestamps
+        LOG_INFO("Sent notification to device %s: %s", device->address(), alert.summary);
+        if (alert.receivedAt == 0)
+                return;
+
+        // record how long each stage took
+        int64_t now = LatencyStats::now();
+        int64_t dispatch = writeStartedAt - alert.queuedAt;
+        int64_t write = now - writeStartedAt;
+        int64_t total = now - alert.receivedAt;
+        _dispatchLatency.add(dispatch);
+        _writeLatency.add(write);
+        _totalLatency.add(total);
+        LOG_VERBOSE("Notification latency: parse %lld us, dispatch %lld us, write %lld us, total %lld us.",
+                    static_cast<long long>(alert.queuedAt - alert.receivedAt), static_cast<long long>(dispatch),
+                    static_cast<long long>(write), static_cast<long long>(total));
+
+        // report the percentiles now and then
+        if ((_totalLatency.total() % LATENCY_REPORT_INTERVAL) == 0)
+        {
+                _dispatchLatency.log("Alert dispatch latency");
+                _writeLatency.log("Alert write latency");
+                _totalLatency.log("Desktop to wrist latency");
+        }
+}
@@ -25,7 +25,14 @@
 #define ALERTNOTIFICATIONSERVICE_H
 
 
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <mutex>
+
 #include "GattService.h"
+#include "LatencyStats.h"
+#include "AlertJournal.h"
 
 class NotificationEventSink;
 
@@ -35,13 +42,50 @@ class AlertNotificationService : public GattService
 {
 public:
 
-        AlertNotificationService(NotificationEventSink *eventSink);
+        AlertNotificationService(NotificationEventSink *eventSink, const char *journalPath, int coalescingWindow = DEFAULT_COALESCING_WINDOW);
+        ~AlertNotificationService() override;
 
+        const char *name() const override { return "AlertNotificationService"; }
+        int triggers() const override { return TriggerNotificationQueued | TriggerDeviceReady; }
+        int coalescingWindow() const override { return _coalescingWindow; }
+        BluezAdapter::CallPriority priority() const override { return BluezAdapter::PriorityInteractive; }
         bool run(ManagedDevice *device) override;
 
+        void journalNotifications();
+        void assignId(uint64_t sequence, int id);
+        void closeNotification(int id);
+
 private:
 
+        static const int DEFAULT_COALESCING_WINDOW = 1000;   // ms
+        static const int MAX_UNANSWERED = 256;               // journaled notifications still waiting for their IDs
+
+        // notifications which are sent as one alert
+        struct AlertGroup
+        {
+        public:
+                const char *appName;
+                uint32_t replacesId;               // 0 for new notifications, else the ID of an updated one which has been sent before
+                std::vector<uint32_t> ids;         // of the notifications in the group
+                std::vector<uint64_t> sequences;   // of the journal records
+                int count;                         // new messages, updates aren't counted
+                const AlertJournal::Record *oldest;
+                const AlertJournal::Record *newest;
+        };
+
         NotificationEventSink *_eventSink;
+        int _coalescingWindow;
+        std::mutex _mutex;                             // guards the journal, the devices run the service in parallel
+        AlertJournal *_journal;                        // alerts which haven't been delivered to every device yet
+        uint64_t _journaled;                           // sequence number of the last notification taken over from the sink
+        std::map<uint64_t, uint64_t> _unanswered;      // journal records of the notifications without IDs, keyed by the sink's sequence numbers
+        LatencyStats _dispatchLatency;                 // from queueing a notification to starting the write
+        LatencyStats _writeLatency;                    // from starting the write to the device's acknowledgement
+        LatencyStats _totalLatency;                    // from the Notify call to the device's acknowledgement
+
+        static void coalesce(const std::vector<AlertJournal::Record> &records, std::vector<AlertGroup> &groups);
+        static void eventReceived(ManagedDevice *device, const uint8_t *data, int length);
+        void alertAcknowledged(ManagedDevice *device, const AlertJournal::Record &alert, int64_t writeStartedAt);
 };
 
 #endif // ALERTNOTIFICATIONSERVICE_H
@@ -31,11 +31,15 @@
 
 
 
-#define UUID_SERVICE_CURRENT_TIME          "00001805-0000-1000-8000-00805f9b34fb"
-#define UUID_CHARACTERISTIC_CURRENT_TIME   "00002a2b-0000-1000-8000-00805f9b34fb"
+static constexpr Uuid UUID_SERVICE_CURRENT_TIME         = Uuid::parse("00001805-0000-1000-8000-00805f9b34fb");
+static constexpr Uuid UUID_CHARACTERISTIC_CURRENT_TIME  = Uuid::parse("00002a2b-0000-1000-8000-00805f9b34fb");
 
 #define MAX_BUFFER_SIZE   32
 
+// the watch's clock drifts slowly, setting the host's clock triggers a run anyway
+#define SYNC_PERIOD       (15 * 60 * 1000)
+#define SYNC_JITTER       (30 * 1000)
+
 
 
 CurrentTimeService::CurrentTimeService()
@@ -44,12 +48,37 @@ CurrentTimeService::CurrentTimeService()
 }
 
 
+int CurrentTimeService::period() const
+{
+        return SYNC_PERIOD;
+}
+
+
+int CurrentTimeService::jitter() const
+{
+        return SYNC_JITTER;
+}
+
+
 bool CurrentTimeService::run(ManagedDevice *device)
 {
         // guard
         if (!device)
                 return false;
 
+        // request the device's current time, the rest is done once it has been received
+        bool requested = device->readCharacteristicAsync(UUID_CHARACTERISTIC_CURRENT_TIME, [this, device](bool success, const uint8_t *data, int length)
+        {
+                updateTime(device, success ? data : nullptr, length);
+        });
+        if (!requested)
+                LOG_WARNING("Could not read the current time from device %s.", device->address());
+        return requested;
+}
+
+
+void CurrentTimeService::updateTime(ManagedDevice *device, const uint8_t *data, int length)
+{
         // get the device's current time
         int devYear = 0;
         int devMonth = 0;
@@ -57,18 +86,16 @@ bool CurrentTimeService::run(ManagedDevice *device)
         int devHour = 0;
         int devMinute = 0;
         int devSecond = 0;
-        uint8_t buffer[MAX_BUFFER_SIZE];
-        int readBytes = device->readCharacteristic(UUID_CHARACTERISTIC_CURRENT_TIME, buffer, MAX_BUFFER_SIZE);
-        if (readBytes < 7)
+        if (!data || (length < 7))
                 LOG_WARNING("Could not read enough bytes from device %s.", device->address());
         else
         {
-                devYear = static_cast<int>(buffer[0]) + (static_cast<int>(buffer[1]) << 8);
-                devMonth = static_cast<int>(buffer[2]);
-                devDay = static_cast<int>(buffer[3]);
-                devHour = static_cast<int>(buffer[4]);
-                devMinute = static_cast<int>(buffer[5]);
-                devSecond = static_cast<int>(buffer[6]);
+                devYear = static_cast<int>(data[0]) + (static_cast<int>(data[1]) << 8);
+                devMonth = static_cast<int>(data[2]);
+                devDay = static_cast<int>(data[3]);
+                devHour = static_cast<int>(data[4]);
+                devMinute = static_cast<int>(data[5]);
+                devSecond = static_cast<int>(data[6]);
                 LOG_VERBOSE("Current time on device %s: %04d-%02d-%02d %02d:%02d:%02d",
                             device->address(),
                             devYear,
@@ -83,7 +110,8 @@ bool CurrentTimeService::run(ManagedDevice *device)
         // get current local time
         time_t rawTime;
         time(&rawTime);
-        struct tm *timeInfo = localtime(&rawTime);
+        struct tm localTime;
+        struct tm *timeInfo = localtime_r(&rawTime, &localTime);
         double localTimestamp = getComparableTimestamp(timeInfo->tm_year + 1900, timeInfo->tm_mon + 1, timeInfo->tm_mday, timeInfo->tm_hour, timeInfo->tm_min, timeInfo->tm_sec);
 
         // set the device's time if it deviates more than one second
@@ -92,6 +120,7 @@ bool CurrentTimeService::run(ManagedDevice *device)
                 delta *= -1.0;
         if (delta > 1.0)
         {
+                uint8_t buffer[MAX_BUFFER_SIZE];
                 buffer[0] = static_cast<uint8_t>((timeInfo->tm_year + 1900) & 0xff);
                 buffer[1] = static_cast<uint8_t>((timeInfo->tm_year + 1900) >> 8);
                 buffer[2] = static_cast<uint8_t>(timeInfo->tm_mon + 1);
@@ -101,24 +130,26 @@ bool CurrentTimeService::run(ManagedDevice *device)
                 buffer[6] = static_cast<uint8_t>(timeInfo->tm_sec);
                 buffer[7] = static_cast<uint8_t>(0);   // fractions of seconds
                 buffer[8] = static_cast<uint8_t>(0);   // reason for change
-                bool success = device->writeCharacteristic(UUID_CHARACTERISTIC_CURRENT_TIME, buffer, 9);
-                if (success)
+                struct tm newTime = *timeInfo;
+                bool sent = device->writeCharacteristicAsync(UUID_CHARACTERISTIC_CURRENT_TIME, buffer, 9, [device, newTime](bool success)
                 {
-                        LOG_INFO("Updated time on device %s: %04d-%02d-%02d %02d:%02d:%02d",
-                                 device->address(),
-                                 timeInfo->tm_year + 1900,
-                                 timeInfo->tm_mon + 1,
-                                 timeInfo->tm_mday,
-                                 timeInfo->tm_hour,
-                                 timeInfo->tm_min,
-                                 timeInfo->tm_sec);
-                }
-                else
+                        if (success)
+                        {
+                                LOG_INFO("Updated time on device %s: %04d-%02d-%02d %02d:%02d:%02d",
+                                         device->address(),
+                                         newTime.tm_year + 1900,
+                                         newTime.tm_mon + 1,
+                                         newTime.tm_mday,
+                                         newTime.tm_hour,
+                                         newTime.tm_min,
+                                         newTime.tm_sec);
+                        }
+                        else
+                                LOG_WARNING("Could not update time on device %s.", device->address());
+                });
+                if (!sent)
                         LOG_WARNING("Could not update time on device %s.", device->address());
-                return success;
         }
-        else
-                return true;
 }
 
 
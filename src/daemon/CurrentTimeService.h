@@ -25,6 +25,8 @@
 #define CURRENTTIMESERVICE_H
 
 
+#include <stdint.h>
+
 #include "GattService.h"
 
 
@@ -35,10 +37,15 @@ public:
 
         CurrentTimeService();
 
+        const char *name() const override { return "CurrentTimeService"; }
+        int period() const override;
+        int jitter() const override;
+        int triggers() const override { return TriggerDeviceReady | TriggerClockChanged; }
         bool run(ManagedDevice *device) override;
 
 protected:
 
+        void updateTime(ManagedDevice *device, const uint8_t *data, int length);
         double getComparableTimestamp(int year, int month, int day, int hour, int minute, int second) const;
 };
 
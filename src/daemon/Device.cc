@@ -32,18 +32,14 @@
 
 Device::Device(const char *address, const char *name)
 {
-        // address is mandatory
-        if (!address)
+        // address is mandatory, it's parsed once and kept in its packed form as well
+        _mac = MacAddress::parse(address);
+        if (!_mac.isValid())
         {
-                LOG_DEBUG("address has not been provided!");
-                _address = new char[32];
-                strcpy(_address, "00:00:00:00:00:00");
-        }
-        else
-        {
-                _address = new char[strlen(address) + 1];
-                strcpy(_address, address);
+                LOG_DEBUG("address has not been provided or is invalid!");
+                _mac = MacAddress(0);
         }
+        _mac.format(_address);
 
         // name is optional
         if (name)
@@ -58,7 +54,6 @@ Device::Device(const char *address, const char *name)
 
 Device::~Device()
 {
-        delete[] _address;
         if (_name)
                 delete[] _name;
 }
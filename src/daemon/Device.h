@@ -25,6 +25,10 @@
 #define DEVICE_H
 
 
+#include "MacAddress.h"
+
+
+
 class Device
 {
 public:
@@ -33,11 +37,13 @@ public:
         virtual ~Device();
 
         const char *address() const { return static_cast<const char *>(_address); }
+        const MacAddress &mac() const { return _mac; }
         const char *name() const { return static_cast<const char *>(_name); }
 
 protected:
 
-        char *_address;
+        char _address[MAC_ADDRESS_LENGTH + 1];   // normalized to upper case
+        MacAddress _mac;
         char *_name;
 };
 
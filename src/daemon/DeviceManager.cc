@@ -26,49 +26,178 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "Logger.h"
 #include "BluezAdapter.h"
+#include "DBusEventWatcher.h"
+#include "DBusConnectionFactory.h"
+#include "EventLoop.h"
 #include "Device.h"
 #include "ManagedDevice.h"
-#include "GattService.h"
+#include "Executor.h"
 
 
 
-#define DEVICES_CAPACITY_INITIAL   64
-#define DEVICES_CAPACITY_GROWTH    32
+#define SERVICE_CALLS_TIMEOUT      10000
 
+// InfiniTime advertises its DFU service, which is used to tell PineTimes apart from other devices
+static constexpr Uuid DISCOVERY_SERVICE_UUID = Uuid::parse("00001530-1212-efde-1523-785feabcd123");
+#define DISCOVERY_RSSI_THRESHOLD   -90
 
 
-DeviceManager::DeviceManager(BluezAdapter *bluezAdapter)
+
+DeviceManager::DeviceManager(DBusConnectionFactory *systemBus, EventLoop *loop)
 {
-        _bluezAdapter = bluezAdapter;
-        _managedDevicesCount = 0;
-        _managedDevicesCapacity = DEVICES_CAPACITY_INITIAL;
-        _managedDevices = new ManagedDevice*[DEVICES_CAPACITY_INITIAL];
+        _systemBus = systemBus;
+        _loop = loop;
+        _renewing = false;
+        _adaptersMissing = false;
+
+        // the loop is woken up when the strands have run out of work
+        _executor = new Executor();
+        _executor->setIdleHandler([loop]() { loop->wakeup(); });
+
+        // removed controllers are reported while the signals are dispatched, they're released afterwards
+        _removalTimer = _loop->addTimer(-1, 0, [this]() { releaseRemovedAdapters(); });
+        attachAdapters();
 }
 
 
 DeviceManager::~DeviceManager()
 {
+        _loop->removeTimer(_removalTimer);
+        for (AdapterSlot &slot : _adapters)
+        {
+                if (slot.scanning)
+                        stopScan(slot);
+        }
         clearManagedDevices();
-        delete[] _managedDevices;
+        delete _executor;
+        for (AdapterSlot &slot : _adapters)
+                deleteAdapter(slot);
+        _adapters.clear();
+        for (AdapterSlot &slot : _removedAdapters)
+                deleteAdapter(slot);
+        _removedAdapters.clear();
+}
+
+
+int DeviceManager::attachAdapters()
+{
+        // look for Bluetooth controllers
+        std::vector<std::string> hcis;
+        DBusConnection *connection = _systemBus->acquire("bluez");
+        BluezAdapter::findAdapters(connection, hcis);
+        _systemBus->release(connection);
+
+        // every controller gets an adapter with a connection of its own, so a slow controller can't block the others
+        int attached = 0;
+        for (const std::string &hci : hcis)
+        {
+                bool known = false;
+                for (const AdapterSlot &slot : _adapters)
+                {
+                        if (hci == slot.adapter->hci())
+                        {
+                                known = true;
+                                break;
+                        }
+                }
+                if (known)
+                        continue;
+
+                // a controller which has been plugged in again gets its previous adapter back
+                bool revived = false;
+                for (size_t i = 0; i < _removedAdapters.size(); i++)
+                {
+                        AdapterSlot slot = _removedAdapters[i];
+                        if (hci != slot.adapter->hci())
+                                continue;
+                        _removedAdapters.erase(_removedAdapters.begin() + i);
+                        slot.devicesCount = 0;
+                        slot.wasScanning = false;
+                        slot.scanning = false;
+                        slot.removed = false;
+                        slot.adapter->clearAddressFilter();
+                        slot.adapter->setDeviceListener(this);
+                        _adapters.push_back(slot);
+                        revived = true;
+                        break;
+                }
+                if (revived)
+                {
+                        attached++;
+                        LOG_INFO("Attached Bluetooth adapter %s again.", hci.c_str());
+                        continue;
+                }
+
+                AdapterSlot slot;
+                slot.connection = _systemBus->acquire(hci.c_str());
+                if (!slot.connection)
+                        continue;
+                slot.adapter = new BluezAdapter(hci.c_str(), slot.connection);
+                slot.watcher = new DBusEventWatcher(slot.connection);
+                slot.devicesCount = 0;
+                slot.wasScanning = false;
+                slot.scanning = false;
+                slot.removed = false;
+                slot.adapter->setDeviceListener(this);
+                slot.adapter->attach(_loop);
+                slot.watcher->registerSink(slot.adapter);
+                _adapters.push_back(slot);
+                attached++;
+                LOG_INFO("Attached Bluetooth adapter %s.", hci.c_str());
+        }
+        // this is called on every maintenance pass, so a missing controller is only reported once
+        if (_adapters.empty() && !_adaptersMissing)
+                LOG_WARNING("No Bluetooth adapter found.");
+        _adaptersMissing = _adapters.empty();
+
+        // the devices which have been waiting for a controller are handled now
+        assignPendingDevices();
+        return attached;
 }
 
 
-bool DeviceManager::startScan()
+BluezAdapter *DeviceManager::adapterAt(int index) const
+{
+        if ((index >= 0) && (index < static_cast<int>(_adapters.size())))
+                return _adapters[index].adapter;
+        return nullptr;
+}
+
+
+bool DeviceManager::anyAdapterPowered()
+{
+        for (AdapterSlot &slot : _adapters)
+        {
+                if (slot.adapter->powered())
+                        return true;
+        }
+        return false;
+}
+
+
+bool DeviceManager::startScan(AdapterSlot &slot)
 {
         // start scanning for BLE devices
-        _wasScanning = _bluezAdapter->isDiscovering();
-        if (_wasScanning)
-                LOG_VERBOSE("Device scan is already ongoing.");
+        slot.wasScanning = slot.adapter->isDiscovering();
+        if (slot.wasScanning)
+                LOG_VERBOSE("Device scan on %s is already ongoing.", slot.adapter->hci());
         else
         {
-                if (_bluezAdapter->startDiscovery())
-                        LOG_VERBOSE("Started device scan.");
+                // only LE devices advertising the watch's service are of interest
+                BluezAdapter::DiscoveryFilter filter;
+                filter.uuids.push_back(DISCOVERY_SERVICE_UUID);
+                filter.rssiThreshold = DISCOVERY_RSSI_THRESHOLD;
+                if (!slot.adapter->setDiscoveryFilter(filter))
+                        LOG_WARNING("Could not set discovery filter on %s, scanning for all devices.", slot.adapter->hci());
+                if (slot.adapter->startDiscovery())
+                        LOG_VERBOSE("Started device scan on %s.", slot.adapter->hci());
                 else
                 {
-                        LOG_ERROR("Could not start scanning for devices.");
+                        LOG_ERROR("Could not start scanning for devices on %s.", slot.adapter->hci());
                         return false;
                 }
         }
@@ -76,28 +205,28 @@ bool DeviceManager::startScan()
 }
 
 
-bool DeviceManager::stopScan()
+bool DeviceManager::stopScan(AdapterSlot &slot)
 {
         // scanning's done
-        if (!_wasScanning)
+        if (!slot.wasScanning)
         {
-                if (_bluezAdapter->stopDiscovery())
-                        LOG_VERBOSE("Stopped device scan.");
+                if (slot.adapter->stopDiscovery())
+                        LOG_VERBOSE("Stopped device scan on %s.", slot.adapter->hci());
                 else
                 {
-                        LOG_ERROR("Could not stop scanning for devices.");
+                        LOG_ERROR("Could not stop scanning for devices on %s.", slot.adapter->hci());
                         return false;
                 }
         }
 
         // show discovered devices
-        for (int i = 0; i < _bluezAdapter->discoveredDevicesCount(); i++)
+        for (int i = 0; i < slot.adapter->discoveredDevicesCount(); i++)
         {
-                const BluezAdapter::DeviceInfo *device = _bluezAdapter->discoveredDeviceAt(i);
+                const BluezAdapter::DeviceInfo *device = slot.adapter->discoveredDeviceAt(i);
                 if (device->name())
-                        LOG_VERBOSE("Device %s (%s) is currently registered with Bluez.", device->address(), device->name());
+                        LOG_VERBOSE("Device %s (%s) is currently registered with Bluez on %s.", device->address(), device->name(), slot.adapter->hci());
                 else
-                        LOG_VERBOSE("Device %s is currently registered with Bluez.", device->address());
+                        LOG_VERBOSE("Device %s is currently registered with Bluez on %s.", device->address(), slot.adapter->hci());
         }
 
         // done
@@ -105,81 +234,178 @@ bool DeviceManager::stopScan()
 }
 
 
+bool DeviceManager::scanNeeded(const AdapterSlot &slot)
+{
+        // an adapter has to scan while one of its devices isn't connected
+        if (!slot.adapter->powered())
+                return false;
+        for (ManagedDevice *device : _managedDevices)
+        {
+                if ((device->bluezAdapter() == slot.adapter) && !device->isConnected())
+                        return true;
+        }
+        return false;
+}
+
+
+void DeviceManager::updateScan()
+{
+        // the adapters scan independently of each other (a scan which has been stopped behind our back,
+        // e.g. by a restart of Bluez, is started again)
+        for (AdapterSlot &slot : _adapters)
+        {
+                bool needed = scanNeeded(slot);
+                if (needed && (!slot.scanning || !slot.adapter->isDiscovering()))
+                        slot.scanning = startScan(slot);
+                else if (!needed && slot.scanning)
+                        slot.scanning = !stopScan(slot);
+        }
+}
+
+
 void DeviceManager::connectDiscoveredManagedDevices()
 {
-        for (int i = 0; i < _managedDevicesCount; i++)
+        // devices which are advertising right now are connected immediately (the lookups are hashed, so this is linear)
+        for (AdapterSlot &slot : _adapters)
+                slot.adapter->updateDiscoveredDevicesList();
+        for (ManagedDevice *device : _managedDevices)
+        {
+                BluezAdapter *adapter = device->bluezAdapter();
+                if (!adapter)
+                        continue;
+                const BluezAdapter::DeviceInfo *info = adapter->discoveredDevice(device->mac());
+                bool advertising = (info && info->rssiValid());
+                if (advertising && !device->isConnecting() && !device->isConnected())
+                        device->connectAsync();
+        }
+}
+
+
+void DeviceManager::deviceAdvertised(BluezAdapter *adapter, const char *address, int rssi)
+{
+        // connect managed devices as soon as they show up on their adapter
+        ManagedDevice *device = managedDeviceByAddress(address);
+        if (!device || (device->bluezAdapter() != adapter) || device->isConnecting())
+                return;
+        if (!device->isConnected())
+        {
+                LOG_VERBOSE("Device %s is advertising on %s (RSSI %d dBm).", address, adapter->hci(), rssi);
+                device->connectAsync();
+        }
+}
+
+
+void DeviceManager::deviceConnectionChanged(BluezAdapter *adapter, const char *address, bool connected)
+{
+        ManagedDevice *device = managedDeviceByAddress(address);
+        if (!device || (device->bluezAdapter() != adapter))
+                return;
+        if (connected)
+                LOG_VERBOSE("Device %s is connected.", address);
+        else
+                LOG_INFO("Device %s has been disconnected.", address);
+}
+
+
+void DeviceManager::deviceServicesResolved(BluezAdapter *adapter, const char *address)
+{
+        ManagedDevice *device = managedDeviceByAddress(address);
+        if (!device || (device->bluezAdapter() != adapter))
+                return;
+        LOG_VERBOSE("Services of device %s have been resolved.", address);
+        if (_readyHandler)
+                _readyHandler(device);
+}
+
+
+void DeviceManager::adapterRemoved(BluezAdapter *adapter)
+{
+        // the adapter is still dispatching the signal, so it's released afterwards
+        for (AdapterSlot &slot : _adapters)
         {
-                ManagedDevice *device = _managedDevices[i];
-                bool discovered = false;
-                for (int j = 0; j < _bluezAdapter->discoveredDevicesCount(); j++)
+                if (slot.adapter == adapter)
                 {
-                        if (strcasecmp(_bluezAdapter->discoveredDeviceAt(j)->address(), device->address()) == 0)
-                        {
-                                discovered = true;
-                                break;
-                        }
+                        slot.removed = true;
+                        _loop->rearmTimer(_removalTimer, 0, 0);
+                        return;
                 }
-                if (discovered && !device->isConnected())
-                        device->connect();
         }
 }
 
 
 void DeviceManager::clearManagedDevices()
 {
-        for (int i = 0; i < _managedDevicesCount; i++)
+        // outstanding calls may refer to the devices
+        waitForPendingCalls(SERVICE_CALLS_TIMEOUT);
+
+        for (ManagedDevice *device : _managedDevices)
         {
-                if (_managedDevices[i]->isConnected())
-                        _managedDevices[i]->disconnect();
-                delete _managedDevices[i];
-                _managedDevices[i] = nullptr;
+                if (device->isConnected())
+                        device->disconnect();
+                delete device;
+        }
+        _managedDevices.clear();
+        _managedIndex.clear();
+        _pendingDevices.clear();
+        for (AdapterSlot &slot : _adapters)
+        {
+                slot.devicesCount = 0;
+                slot.adapter->clearAddressFilter();
         }
-        _managedDevicesCount = 0;
 }
 
 
 bool DeviceManager::addManagedDevice(const char *address)
 {
-        // make sure that device hasn't been added before
-        for (int i = 0; i < _managedDevicesCount; i++)
+        // the address is only parsed once
+        MacAddress mac = MacAddress::parse(address);
+        if (!mac.isValid())
         {
-                if (strcasecmp(_managedDevices[i]->address(), address) == 0)
-                {
-                        LOG_WARNING("The device %s has already been added.", address);
-                        return false;
-                }
+                LOG_ERROR("The device address %s is invalid.", address ? address : "(null)");
+                return false;
         }
 
-        // make sure there's enough capacity to store the device
-        if (_managedDevicesCount == _managedDevicesCapacity)
+        // make sure that device hasn't been added before
+        if (_managedIndex.contains(mac))
         {
-                _managedDevicesCapacity += DEVICES_CAPACITY_GROWTH;
-                ManagedDevice **newList = new ManagedDevice*[_managedDevicesCapacity];
-                for (int i = 0; i < _managedDevicesCount; i++)
-                        newList[i] = _managedDevices[i];
-                delete[] _managedDevices;
-                _managedDevices = newList;
-                LOG_DEBUG("Managed devices list capacity grew to %d.", _managedDevicesCapacity);
+                LOG_WARNING("The device %s has already been added.", address);
+                return false;
         }
 
         // add the device
-        ManagedDevice *device = new ManagedDevice(_bluezAdapter, address);
-        _managedDevices[_managedDevicesCount] = device;
-        _managedDevicesCount++;
-        LOG_INFO("Added managed device: %s", address);
+        ManagedDevice *device = new ManagedDevice(nullptr, address, _executor);
+        _managedIndex.insert(mac, static_cast<int>(_managedDevices.size()));
+        _managedDevices.push_back(device);
+        LOG_INFO("Added managed device %s.", address);
+
+        // the device is handled by the least busy adapter, or waits until a controller shows up
+        AdapterSlot *slot = assignAdapter(address);
+        if (slot)
+                assignDevice(device, *slot);
+        else
+        {
+                LOG_WARNING("There's no Bluetooth adapter to handle device %s yet.", address);
+                _pendingDevices.push_back(device);
+        }
         return true;
 }
 
 
 ManagedDevice *DeviceManager::managedDeviceByIndex(int index) const
 {
-        if ((index >= 0) && (index < _managedDevicesCount))
+        if ((index >= 0) && (index < managedDevicesCount()))
                 return _managedDevices[index];
         return nullptr;
 }
 
 
 ManagedDevice *DeviceManager::managedDeviceByAddress(const char *address) const
+{
+        return managedDeviceByAddress(MacAddress::parse(address));
+}
+
+
+ManagedDevice *DeviceManager::managedDeviceByAddress(const MacAddress &address) const
 {
         int index = indexOfManagedDevice(address);
         if (index >= 0)
@@ -190,32 +416,163 @@ ManagedDevice *DeviceManager::managedDeviceByAddress(const char *address) const
 
 int DeviceManager::indexOfManagedDevice(const char *address) const
 {
-        for (int i = 0; i < _managedDevicesCount; i++)
+        return indexOfManagedDevice(MacAddress::parse(address));
+}
+
+
+int DeviceManager::indexOfManagedDevice(const MacAddress &address) const
+{
+        const int *index = _managedIndex.find(address);
+        return index ? *index : -1;
+}
+
+
+bool DeviceManager::renewSubscriptions(RenewalHandler handler)
+{
+        // a renewal which is still running isn't overlapped by another one
+        if (_renewing)
+                return false;
+        if (_managedDevices.empty())
         {
-                if (strcasecmp(_managedDevices[i]->address(), address) == 0)
-                        return i;
+                if (handler)
+                        handler(0);
+                return true;
         }
-        return -1;
+
+        // notification streams have to be set up again after a reconnect (acquiring them blocks, so it's done on the
+        // strands, behind the devices' more urgent work, and the last device to finish reports the result)
+        Renewal *renewal = new Renewal();
+        renewal->devices = static_cast<int>(_managedDevices.size());
+        renewal->renewed = 0;
+        renewal->handler = handler;
+        _renewing = true;
+        for (ManagedDevice *device : _managedDevices)
+        {
+                device->post([this, device, renewal]()
+                {
+                        if (device->isConnected())
+                                renewal->renewed += device->renewSubscriptions();
+                        if (--renewal->devices > 0)
+                                return;
+                        _renewing = false;
+                        if (renewal->handler)
+                                renewal->handler(renewal->renewed);
+                        delete renewal;
+                }, BluezAdapter::PriorityBackground);
+        }
+        return true;
 }
 
 
-bool DeviceManager::allManagedDevicesConnected()
+DeviceManager::AdapterSlot *DeviceManager::assignAdapter(const char *address)
 {
-        for (int i = 0; i < _managedDevicesCount; i++)
-                if (!_managedDevices[i]->isConnected())
-                        return false;
-        return true;
+        // an adapter which already knows the device (e.g. because it's bonded) is preferred,
+        // otherwise the device goes to the adapter with the fewest devices
+        AdapterSlot *best = nullptr;
+        bool bestKnows = false;
+        for (AdapterSlot &slot : _adapters)
+        {
+                bool knows = slot.adapter->knowsDevice(address);
+                if (!best || (knows && !bestKnows) || ((knows == bestKnows) && (slot.devicesCount < best->devicesCount)))
+                {
+                        best = &slot;
+                        bestKnows = knows;
+                }
+        }
+        return best;
 }
 
 
-void DeviceManager::runService(GattService *service)
+void DeviceManager::assignDevice(ManagedDevice *device, AdapterSlot &slot)
 {
-        if (!service)
+        device->setBluezAdapter(slot.adapter);
+        slot.devicesCount++;
+        slot.adapter->addAddressFilter(device->address());
+        LOG_INFO("Device %s is handled by adapter %s.", device->address(), slot.adapter->hci());
+}
+
+
+void DeviceManager::assignPendingDevices()
+{
+        // guard
+        if (_adapters.empty())
                 return;
 
-        for (int i = 0; i < _managedDevicesCount; i++)
+        for (ManagedDevice *device : _pendingDevices)
+                assignDevice(device, *assignAdapter(device->address()));
+        _pendingDevices.clear();
+}
+
+
+void DeviceManager::releaseRemovedAdapters()
+{
+        // the devices of a removed controller wait for another one (the adapter is kept until shutdown, since
+        // replies to its outstanding calls may still arrive, and it's reused if the controller comes back)
+        for (size_t i = 0; i < _adapters.size(); )
         {
-                if (_managedDevices[i]->isConnected())
-                        service->run(_managedDevices[i]);
+                AdapterSlot slot = _adapters[i];
+                if (!slot.removed)
+                {
+                        i++;
+                        continue;
+                }
+                _adapters.erase(_adapters.begin() + i);
+                slot.adapter->setDeviceListener(nullptr);
+                for (ManagedDevice *device : _managedDevices)
+                {
+                        if (device->bluezAdapter() == slot.adapter)
+                        {
+                                device->setBluezAdapter(nullptr);
+                                _pendingDevices.push_back(device);
+                        }
+                }
+                _removedAdapters.push_back(slot);
+                LOG_INFO("Detached Bluetooth adapter %s.", slot.adapter->hci());
+        }
+
+        // the remaining controllers take over
+        if (_adapters.empty() && !_pendingDevices.empty())
+                LOG_WARNING("No Bluetooth adapter left, %d devices are waiting for one.", pendingDevicesCount());
+        assignPendingDevices();
+}
+
+
+void DeviceManager::deleteAdapter(AdapterSlot &slot)
+{
+        slot.adapter->setDeviceListener(nullptr);
+        delete slot.watcher;
+        delete slot.adapter;
+        _systemBus->release(slot.connection);
+}
+
+
+bool DeviceManager::waitForPendingCalls(int timeout)
+{
+        // this runs the loop from within, so it's only done on shutdown (the loop dispatches the replies of all adapters,
+        // the strands may issue further calls while they handle them, and calls queued by the strands and strands
+        // running out of work wake the loop up)
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t deadline = static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000 + timeout;
+        while (true)
+        {
+                bool pending = !_executor->idle();
+                for (AdapterSlot &slot : _adapters)
+                {
+                        if (slot.adapter->pendingCallsCount() > 0)
+                                pending = true;
+                }
+                for (AdapterSlot &slot : _removedAdapters)
+                {
+                        if (slot.adapter->pendingCallsCount() > 0)
+                                pending = true;
+                }
+                if (!pending)
+                        return true;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                int64_t remaining = deadline - (static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000);
+                if (remaining <= 0)
+                        return false;
+                _loop->runOnce(static_cast<int>(remaining));
         }
 }
@@ -25,43 +25,105 @@
 #define DEVICEMANAGER_H
 
 
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include "BluezAdapter.h"
+#include "AddressTable.h"
+
 class Device;
 class ManagedDevice;
-class GattService;
-class BluezAdapter;
+class DBusEventWatcher;
+class DBusConnectionFactory;
+class EventLoop;
+class Executor;
 
 
 
-class DeviceManager
+class DeviceManager : public BluezAdapter::DeviceListener
 {
 public:
 
-        DeviceManager(BluezAdapter *bluezAdapter);
-        ~DeviceManager();
+        typedef std::function<void(ManagedDevice *device)> DeviceHandler;
+        typedef std::function<void(int renewed)> RenewalHandler;
+
 
-        bool startScan();
-        bool stopScan();
+        DeviceManager(DBusConnectionFactory *systemBus, EventLoop *loop);
+        ~DeviceManager() override;
+
+        int attachAdapters();
+        int adaptersCount() const { return static_cast<int>(_adapters.size()); }
+        BluezAdapter *adapterAt(int index) const;
+        bool anyAdapterPowered();
+
+        void updateScan();
         void connectDiscoveredManagedDevices();
 
+        void deviceAdvertised(BluezAdapter *adapter, const char *address, int rssi) override;
+        void deviceConnectionChanged(BluezAdapter *adapter, const char *address, bool connected) override;
+        void deviceServicesResolved(BluezAdapter *adapter, const char *address) override;
+        void adapterRemoved(BluezAdapter *adapter) override;
+        void setReadyHandler(DeviceHandler handler) { _readyHandler = handler; }
+
         void clearManagedDevices();
-        int managedDevicesCount() const { return _managedDevicesCount; }
+        int managedDevicesCount() const { return static_cast<int>(_managedDevices.size()); }
         bool addManagedDevice(const char *address);
+        int pendingDevicesCount() const { return static_cast<int>(_pendingDevices.size()); }
         ManagedDevice *managedDeviceByIndex(int index) const ;
         ManagedDevice *managedDeviceByAddress(const char *address) const;
+        ManagedDevice *managedDeviceByAddress(const MacAddress &address) const;
         int indexOfManagedDevice(const char *address) const;
+        int indexOfManagedDevice(const MacAddress &address) const;
         bool isManagedDevice(const char *address) const { return (indexOfManagedDevice(address) >= 0); };
-        bool allManagedDevicesConnected();
 
-        void runService(GattService *service);
+        bool renewSubscriptions(RenewalHandler handler = nullptr);
 
 
 private:
 
-        BluezAdapter *_bluezAdapter;
-        int _managedDevicesCount;
-        int _managedDevicesCapacity;
-        ManagedDevice **_managedDevices;
-        bool _wasScanning;
+        struct AdapterSlot
+        {
+        public:
+                BluezAdapter *adapter;
+                DBusConnection *connection;
+                DBusEventWatcher *watcher;
+                int devicesCount;
+                bool wasScanning;
+                bool scanning;
+                bool removed;
+        };
+
+        struct Renewal
+        {
+        public:
+                std::atomic<int> devices;    // devices which haven't renewed their subscriptions yet
+                std::atomic<int> renewed;
+                RenewalHandler handler;
+        };
+
+        DBusConnectionFactory *_systemBus;
+        EventLoop *_loop;
+        Executor *_executor;
+        std::vector<AdapterSlot> _adapters;
+        bool _adaptersMissing;                       // the lack of controllers has been reported already
+        std::vector<AdapterSlot> _removedAdapters;   // kept until shutdown, replies to their calls may still arrive
+        int _removalTimer;                           // releases removed adapters outside of the signal handlers
+        std::vector<ManagedDevice *> _managedDevices;
+        AddressTable<int> _managedIndex;   // index into the list of managed devices
+        std::vector<ManagedDevice *> _pendingDevices;   // managed devices waiting for an adapter
+        DeviceHandler _readyHandler;       // called when a device's services have been resolved
+        std::atomic<bool> _renewing;       // a renewal of the subscriptions is running on the strands
+
+        bool startScan(AdapterSlot &slot);
+        bool stopScan(AdapterSlot &slot);
+        bool scanNeeded(const AdapterSlot &slot);
+        AdapterSlot *assignAdapter(const char *address);
+        void assignDevice(ManagedDevice *device, AdapterSlot &slot);
+        void assignPendingDevices();
+        void releaseRemovedAdapters();
+        void deleteAdapter(AdapterSlot &slot);
+        bool waitForPendingCalls(int timeout);   // blocks, only used to drain the calls on shutdown
 };
 
 #endif // DEVICEMANAGER_H
@@ -0,0 +1,303 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "Executor.h"
+
+#include <stdlib.h>
+#include <chrono>
+
+#include "Logger.h"
+
+
+
+#define MAX_THREADS            8
+#define TASKS_PER_TURN         8
+#define MAX_BYPASSED_TASKS     8    // tasks of a lower value run before a waiting priority gets its turn
+
+
+
+// the worker which runs the current thread (-1 for other threads)
+static thread_local int currentWorker = -1;
+
+
+
+Executor::Strand::Strand(Executor *executor)
+{
+        _executor = executor;
+        for (int i = 0; i < PRIORITIES; i++)
+                _bypassed[i] = 0;
+        _scheduled = false;
+}
+
+
+Executor::Strand::~Strand()
+{
+        if (!idle())
+                LOG_WARNING("Destroying a strand with pending tasks.");
+}
+
+
+void Executor::Strand::post(Task task, int priority)
+{
+        // guards
+        if (!task)
+                return;
+        if (priority < 0)
+                priority = 0;
+        if (priority >= PRIORITIES)
+                priority = PRIORITIES - 1;
+
+        // a strand is handed to a worker when its first task arrives
+        bool schedule = false;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _tasks[priority].push_back(task);
+                if (!_scheduled)
+                {
+                        _scheduled = true;
+                        schedule = true;
+                }
+        }
+        if (schedule)
+                _executor->schedule(this, false);
+}
+
+
+bool Executor::Strand::idle()
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        return !_scheduled;
+}
+
+
+bool Executor::Strand::takeTask(Task &task)
+{
+        // the lowest value goes first, unless a higher one has been passed over too often
+        int next = -1;
+        for (int i = 0; i < PRIORITIES; i++)
+        {
+                if (_tasks[i].empty())
+                        continue;
+                if ((next < 0) || ((_bypassed[i] >= MAX_BYPASSED_TASKS) && (_bypassed[next] < MAX_BYPASSED_TASKS)))
+                        next = i;
+        }
+        if (next < 0)
+                return false;
+        task = _tasks[next].front();
+        _tasks[next].pop_front();
+
+        // the higher values which have to wait once more are counted
+        _bypassed[next] = 0;
+        for (int i = next + 1; i < PRIORITIES; i++)
+        {
+                if (!_tasks[i].empty())
+                        _bypassed[i]++;
+        }
+        return true;
+}
+
+
+bool Executor::Strand::hasTasks() const
+{
+        for (int i = 0; i < PRIORITIES; i++)
+        {
+                if (!_tasks[i].empty())
+                        return true;
+        }
+        return false;
+}
+
+
+
+Executor::Executor(int threadsCount)
+{
+        // initialize
+        _queuedStrands = 0;
+        _activeStrands = 0;
+        _stopping = false;
+        _nextWorker = 0;
+
+        // one worker per core by default
+        if (threadsCount <= 0)
+                threadsCount = static_cast<int>(std::thread::hardware_concurrency());
+        if (threadsCount <= 0)
+                threadsCount = 2;
+        if (threadsCount > MAX_THREADS)
+                threadsCount = MAX_THREADS;
+
+        // start the workers
+        for (int i = 0; i < threadsCount; i++)
+                _workers.push_back(new Worker());
+        for (int i = 0; i < threadsCount; i++)
+                _workers[i]->thread = std::thread(&Executor::workerLoop, this, i);
+        LOG_DEBUG("Started executor with %d threads.", threadsCount);
+}
+
+
+Executor::~Executor()
+{
+        // the workers finish the queued tasks before they stop
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+        }
+        _wakeup.notify_all();
+        for (Worker *worker : _workers)
+        {
+                worker->thread.join();
+                delete worker;
+        }
+        _workers.clear();
+}
+
+
+bool Executor::idle()
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        return (_activeStrands == 0);
+}
+
+
+bool Executor::waitUntilIdle(int timeout)
+{
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _idle.wait_for(lock, std::chrono::milliseconds(timeout), [this]() { return (_activeStrands == 0); });
+}
+
+
+void Executor::schedule(Strand *strand, bool rescheduled)
+{
+        // strands posted by a worker stay on it, the others are spread over the workers
+        int index = currentWorker;
+        if (index < 0)
+                index = static_cast<int>(_nextWorker++ % _workers.size());
+        {
+                std::lock_guard<std::mutex> lock(_workers[index]->mutex);
+                _workers[index]->strands.push_back(strand);
+        }
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _queuedStrands++;
+                if (!rescheduled)
+                        _activeStrands++;
+        }
+        _wakeup.notify_one();
+}
+
+
+Executor::Strand *Executor::takeStrand(int index)
+{
+        // a worker takes from the front of its own queue and steals from the back of the others'
+        int count = static_cast<int>(_workers.size());
+        for (int i = 0; i < count; i++)
+        {
+                Worker *worker = _workers[(index + i) % count];
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                if (worker->strands.empty())
+                        continue;
+                Strand *strand = nullptr;
+                if (i == 0)
+                {
+                        strand = worker->strands.front();
+                        worker->strands.pop_front();
+                }
+                else
+                {
+                        strand = worker->strands.back();
+                        worker->strands.pop_back();
+                }
+                return strand;
+        }
+        return nullptr;
+}
+
+
+void Executor::runStrand(Strand *strand)
+{
+        // only a few tasks are run per turn, so a busy strand can't starve the others
+        for (int i = 0; i < TASKS_PER_TURN; i++)
+        {
+                Task task;
+                {
+                        std::lock_guard<std::mutex> lock(strand->_mutex);
+                        if (!strand->takeTask(task))
+                                break;
+                }
+                task();
+        }
+
+        // a strand with more tasks goes to the back of the worker's queue
+        bool more = false;
+        {
+                std::lock_guard<std::mutex> lock(strand->_mutex);
+                more = strand->hasTasks();
+                if (!more)
+                        strand->_scheduled = false;
+        }
+        if (more)
+        {
+                schedule(strand, true);
+                return;
+        }
+        bool idle = false;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _activeStrands--;
+                if (_activeStrands == 0)
+                {
+                        idle = true;
+                        _idle.notify_all();
+                        if (_stopping)
+                                _wakeup.notify_all();
+                }
+        }
+        if (idle && _idleHandler)
+                _idleHandler();
+}
+
+
+void Executor::workerLoop(int index)
+{
+        currentWorker = index;
+        while (true)
+        {
+                // wait for a queued strand (each one is claimed by exactly one worker)
+                {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _wakeup.wait(lock, [this]() { return (_queuedStrands > 0) || (_stopping && (_activeStrands == 0)); });
+                        if (_queuedStrands == 0)
+                                break;
+                        _queuedStrands--;
+                }
+
+                // the claimed strand might sit in another worker's queue
+                Strand *strand = nullptr;
+                while (!strand)
+                {
+                        strand = takeStrand(index);
+                        if (!strand)
+                                std::this_thread::yield();
+                }
+                runStrand(strand);
+        }
+}
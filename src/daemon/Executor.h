@@ -0,0 +1,106 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+
+
+class Executor
+{
+public:
+
+        typedef std::function<void()> Task;
+
+
+        // tasks posted to the same strand run one after another, different strands run in parallel
+        // (the tasks of a lower priority value run first, tasks of the same priority in order)
+        class Strand
+        {
+        public:
+                static const int PRIORITIES = 3;
+
+                Strand(Executor *executor);
+                ~Strand();
+
+                void post(Task task, int priority = 0);
+                bool idle();
+
+        private:
+                friend class Executor;
+
+                Executor *_executor;
+                std::mutex _mutex;
+                std::deque<Task> _tasks[PRIORITIES];
+                int _bypassed[PRIORITIES];   // tasks of a lower value run ahead of the priority's next one
+                bool _scheduled;   // waiting in a worker's queue or running
+
+                bool takeTask(Task &task);
+                bool hasTasks() const;
+        };
+
+
+        Executor(int threadsCount = 0);
+        ~Executor();
+
+        int threadsCount() const { return static_cast<int>(_workers.size()); }
+        bool idle();
+        bool waitUntilIdle(int timeout);
+        void setIdleHandler(Task handler) { _idleHandler = handler; }
+
+private:
+
+        struct Worker
+        {
+        public:
+                std::mutex mutex;
+                std::deque<Strand *> strands;
+                std::thread thread;
+        };
+
+        std::vector<Worker *> _workers;
+        std::mutex _mutex;
+        std::condition_variable _wakeup;
+        std::condition_variable _idle;
+        int _queuedStrands;    // strands waiting in the workers' queues
+        int _activeStrands;    // strands waiting or running
+        bool _stopping;
+        std::atomic<unsigned int> _nextWorker;
+        Task _idleHandler;     // called by the worker which has run the last task (set it before posting)
+
+        void schedule(Strand *strand, bool rescheduled);
+        Strand *takeStrand(int index);
+        void runStrand(Strand *strand);
+        void workerLoop(int index);
+};
+
+#endif // EXECUTOR_H
@@ -25,6 +25,9 @@
 #define GATTSERVICE_H
 
 
+#include "BluezAdapter.h"
+
+
 class ManagedDevice;
 
 
@@ -33,9 +36,26 @@ class GattService
 {
 public:
 
+        // events which make a service run right away
+        enum Trigger
+        {
+                TriggerNone = 0,
+                TriggerDeviceReady = 1,          // the device's GATT services have been resolved
+                TriggerClockChanged = 2,         // the host's clock has been set
+                TriggerNotificationQueued = 4    // a desktop notification has been received
+        };
+
+
         GattService();
         virtual ~GattService();
 
+        virtual const char *name() const = 0;
+        virtual int period() const { return 0; }          // ms between two runs, 0 to run on triggers only
+        virtual int jitter() const { return 0; }          // ms the runs are spread by
+        virtual int triggers() const { return TriggerNone; }
+        virtual int coalescingWindow() const { return 0; }  // ms a triggered run is held back after the last one
+        virtual BluezAdapter::CallPriority priority() const { return BluezAdapter::PriorityStateSync; }   // class of its device work
+
         virtual bool run(ManagedDevice *device) = 0;
 };
 
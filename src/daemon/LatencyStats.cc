@@ -0,0 +1,107 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "LatencyStats.h"
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "Logger.h"
+
+
+
+LatencyStats::LatencyStats()
+{
+        _next = 0;
+        _total = 0;
+}
+
+
+void LatencyStats::add(int64_t latency)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _samples[_next] = latency;
+        _next = (_next + 1) % CAPACITY;
+        _total++;
+}
+
+
+int LatencyStats::count() const
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        return (_total < CAPACITY) ? static_cast<int>(_total) : CAPACITY;
+}
+
+
+int64_t LatencyStats::total() const
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _total;
+}
+
+
+int64_t LatencyStats::percentile(int percent) const
+{
+        // copy the samples, so the ring isn't locked while they're sorted
+        std::vector<int64_t> samples;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                int count = (_total < CAPACITY) ? static_cast<int>(_total) : CAPACITY;
+                samples.assign(_samples, _samples + count);
+        }
+
+        // guard
+        if (samples.empty())
+                return -1;
+        if (percent < 0)
+                percent = 0;
+        if (percent > 100)
+                percent = 100;
+
+        // nearest rank
+        int rank = static_cast<int>((static_cast<int64_t>(percent) * static_cast<int64_t>(samples.size()) + 99) / 100);
+        int index = (rank > 0) ? (rank - 1) : 0;
+        std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+        return samples[index];
+}
+
+
+void LatencyStats::log(const char *what) const
+{
+        int samples = count();
+        if (samples == 0)
+                return;
+        LOG_INFO("%s over the last %d samples: p50 %.1f ms, p99 %.1f ms.", what, samples,
+                 static_cast<double>(percentile(50)) / 1000.0, static_cast<double>(percentile(99)) / 1000.0);
+}
+
+
+int64_t LatencyStats::now()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000000 + static_cast<int64_t>(now.tv_nsec / 1000);
+}
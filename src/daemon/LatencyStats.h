@@ -0,0 +1,59 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef LATENCYSTATS_H
+#define LATENCYSTATS_H
+
+
+#include <stdint.h>
+#include <mutex>
+
+
+
+// keeps the most recent latency samples (in microseconds) and computes percentiles over them,
+// samples may be added from any thread
+class LatencyStats
+{
+public:
+
+        LatencyStats();
+
+        void add(int64_t latency);
+        int count() const;
+        int64_t total() const;
+        int64_t percentile(int percent) const;
+        void log(const char *what) const;
+
+        static int64_t now();
+
+private:
+
+        static const int CAPACITY = 256;
+
+        mutable std::mutex _mutex;
+        int64_t _samples[CAPACITY];   // ring buffer, the oldest sample is overwritten
+        int _next;
+        int64_t _total;               // number of samples ever added
+};
+
+#endif // LATENCYSTATS_H
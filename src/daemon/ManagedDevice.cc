@@ -28,23 +28,67 @@
 
 #include "Logger.h"
 #include "BluezAdapter.h"
+#include "GattNotificationStream.h"
 
 
 
-#define CONNECT_TIMEOUT      4000
-#define DISCONNECT_TIMEOUT   5000
+#define BULK_WRITE_THRESHOLD   256
 
 
 
-ManagedDevice::ManagedDevice(BluezAdapter *bluezAdapter, const char *address)
+ManagedDevice::ManagedDevice(BluezAdapter *bluezAdapter, const char *address, Executor *executor)
         : Device(address, nullptr)
 {
         _bluezAdapter = bluezAdapter;
+        _strand = executor ? new Executor::Strand(executor) : nullptr;
+        _connecting = false;
 }
 
 
 ManagedDevice::~ManagedDevice()
 {
+        for (Subscription &subscription : _subscriptions)
+                closeSubscription(subscription);
+        _subscriptions.clear();
+        delete _strand;
+}
+
+
+void ManagedDevice::setBluezAdapter(BluezAdapter *bluezAdapter)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // the streams belong to the previous adapter, the subscriptions are renewed on the new one
+        for (Subscription &subscription : _subscriptions)
+                closeSubscription(subscription);
+        _bluezAdapter = bluezAdapter;
+}
+
+
+void ManagedDevice::post(Executor::Task task, BluezAdapter::CallPriority priority)
+{
+        // guard
+        if (!task)
+                return;
+
+        // the calls started by the task are queued in its class as well
+        Executor::Task classified = [task, priority]()
+        {
+                BluezAdapter::CallPriority previous = BluezAdapter::callPriority();
+                BluezAdapter::setCallPriority(priority);
+                task();
+                BluezAdapter::setCallPriority(previous);
+        };
+        if (_strand)
+                _strand->post(classified, priority);
+        else
+                classified();
+}
+
+
+bool ManagedDevice::idle()
+{
+        return !_strand || _strand->idle();
 }
 
 
@@ -66,81 +110,317 @@ void ManagedDevice::setName(const char *value)
 
 bool ManagedDevice::isConnected()
 {
-        return _bluezAdapter->isDeviceConnected(_address);
+        BluezAdapter *adapter = _bluezAdapter;
+        return adapter && adapter->isDeviceConnected(_address);
 }
 
 
 bool ManagedDevice::connect()
 {
+        // guard
+        BluezAdapter *adapter = _bluezAdapter;
+        if (!adapter)
+                return false;
+
         LOG_INFO("Connecting to device %s...", _address);
-        int prevTimeout = _bluezAdapter->timeout();
-        _bluezAdapter->setTimeout(CONNECT_TIMEOUT);
-        bool result = _bluezAdapter->connectDevice(_address, true);
+        bool result = adapter->connectDevice(_address, true);
         if (result)
                 LOG_INFO("Connected to device %s.", _address);
         else
                 LOG_WARNING("Could not connect to device %s.", _address);
-        _bluezAdapter->setTimeout(prevTimeout);
         return result;
 }
 
 
+bool ManagedDevice::connectAsync()
+{
+        // guards (only one connection attempt at a time)
+        BluezAdapter *adapter = _bluezAdapter;
+        if (!adapter)
+                return false;
+        bool idle = false;
+        if (!_connecting.compare_exchange_strong(idle, true))
+                return true;
+
+        // start connecting (the flag is cleared by the callback, which may run before the call returns)
+        LOG_INFO("Connecting to device %s...", _address);
+        bool started = adapter->connectDeviceAsync(_address, [this](bool success)
+        {
+                _connecting = false;
+                if (success)
+                        LOG_INFO("Connected to device %s.", _address);
+                else
+                        LOG_WARNING("Could not connect to device %s.", _address);
+        });
+        if (!started)
+        {
+                _connecting = false;
+                LOG_WARNING("Could not connect to device %s.", _address);
+        }
+        return started;
+}
+
+
 bool ManagedDevice::disconnect()
 {
+        // guard
+        BluezAdapter *adapter = _bluezAdapter;
+        if (!adapter)
+                return false;
+
         LOG_INFO("Disconnecting device %s...", _address);
-        int prevTimeout = _bluezAdapter->timeout();
-        _bluezAdapter->setTimeout(DISCONNECT_TIMEOUT);
-        bool result = _bluezAdapter->disconnectDevice(_address);
+        bool result = adapter->disconnectDevice(_address);
         if (result)
                 LOG_INFO("Disconnected device %s.", _address);
         else
                 LOG_WARNING("Could not disconnected device %s.", _address);
-        _bluezAdapter->setTimeout(prevTimeout);
         return result;
 }
 
 
-int ManagedDevice::readCharacteristic(const char *charGuid, uint8_t *buffer, int bufferSize)
+int ManagedDevice::readCharacteristic(const Uuid &charUuid, uint8_t *buffer, int bufferSize)
 {
-        // get the characteristic's path
-        char *charPath = _bluezAdapter->findCharacteristicPath(_address, charGuid);
-        if (!charPath)
+        // get the characteristic's path (there's none while no adapter handles the device)
+        BluezAdapter *adapter = _bluezAdapter;
+        std::string charPath = adapter ? adapter->findCharacteristicPath(_address, charUuid) : std::string();
+        if (charPath.empty())
         {
-                LOG_WARNING("Could not find GATT characteristic %s on device %s.", charGuid, _address);
+                LOG_WARNING("Could not find GATT characteristic %s on device %s.", charUuid.toString().c_str(), _address);
                 return -1;
         }
 
         // read the data
-        int readBytes = _bluezAdapter->readCharacteristic(charPath, buffer, bufferSize);
-        delete[] charPath;
+        int readBytes = adapter->readCharacteristic(charPath.c_str(), buffer, bufferSize);
 
         // check result
         if (readBytes < 0)
-                LOG_ERROR("Error while reading from GATT characteristic %s on device %s.", charGuid, _address);
+                LOG_ERROR("Error while reading from GATT characteristic %s on device %s.", charUuid.toString().c_str(), _address);
         else
-                LOG_DEBUG("Read %d bytes from GATT characteristic %s on device %s.", readBytes, charGuid, _address);
+                LOG_DEBUG("Read %d bytes from GATT characteristic %s on device %s.", readBytes, charUuid.toString().c_str(), _address);
         return readBytes;
 }
 
 
-bool ManagedDevice::writeCharacteristic(const char *charGuid, uint8_t *buffer, int length)
+bool ManagedDevice::writeCharacteristic(const Uuid &charUuid, const uint8_t *buffer, int length)
 {
-        // get the characteristic's path
-        char *charPath = _bluezAdapter->findCharacteristicPath(_address, charGuid);
-        if (!charPath)
+        // get the characteristic's path (there's none while no adapter handles the device)
+        BluezAdapter *adapter = _bluezAdapter;
+        std::string charPath = adapter ? adapter->findCharacteristicPath(_address, charUuid) : std::string();
+        if (charPath.empty())
         {
-                LOG_WARNING("Could not find GATT characteristic %s on device %s.", charGuid, _address);
+                LOG_WARNING("Could not find GATT characteristic %s on device %s.", charUuid.toString().c_str(), _address);
                 return false;
         }
 
-        // write the data
-        bool result = _bluezAdapter->writeCharacteristic(charPath, buffer, length);
-        delete[] charPath;
+        // large transfers go without a response per packet if the characteristic allows it, preferably through
+        // a socket of our own, otherwise as credit controlled write commands (if the socket can't be acquired)
+        bool result = false;
+        int written = 0;
+        if ((length > BULK_WRITE_THRESHOLD) && adapter->supportsWriteStream(charPath.c_str()))
+        {
+                result = adapter->writeCharacteristicStream(charPath.c_str(), buffer, length, -1, &written);
+                if (!result && (written < 0))
+                        result = adapter->writeCharacteristicWithoutResponse(charPath.c_str(), buffer, length);
+        }
+        else
+                result = adapter->writeCharacteristic(charPath.c_str(), buffer, length);
 
-        // check result
-        if (!result)
-                LOG_ERROR("Error while writing to GATT characteristic %s on device %s.", charGuid, _address);
+        // check result (a stream may have delivered part of the data)
+        if (!result && (written > 0))
+                LOG_ERROR("Error while writing to GATT characteristic %s on device %s after %d of %d bytes.", charUuid.toString().c_str(), _address, written, length);
+        else if (!result)
+                LOG_ERROR("Error while writing to GATT characteristic %s on device %s.", charUuid.toString().c_str(), _address);
         else
-                LOG_DEBUG("Wrote %d bytes to GATT characteristic %s on device %s.", length, charGuid, _address);
+                LOG_DEBUG("Wrote %d bytes to GATT characteristic %s on device %s.", length, charUuid.toString().c_str(), _address);
+        return result;
+}
+
+
+bool ManagedDevice::readCharacteristicAsync(const Uuid &charUuid, ReadCallback callback)
+{
+        // get the characteristic's path (there's none while no adapter handles the device)
+        BluezAdapter *adapter = _bluezAdapter;
+        std::string charPath = adapter ? adapter->findCharacteristicPath(_address, charUuid) : std::string();
+        if (charPath.empty())
+        {
+                LOG_WARNING("Could not find GATT characteristic %s on device %s.", charUuid.toString().c_str(), _address);
+                return false;
+        }
+
+        // start reading the data (the callback keeps the caller's class)
+        std::string guid = charUuid.toString();
+        std::string address = _address;
+        BluezAdapter::CallPriority priority = BluezAdapter::callPriority();
+        return adapter->readCharacteristicAsync(charPath.c_str(), [this, callback, guid, address, priority](bool success, const uint8_t *data, int length)
+        {
+                if (!success)
+                        LOG_ERROR("Error while reading from GATT characteristic %s on device %s.", guid.c_str(), address.c_str());
+                else
+                        LOG_DEBUG("Read %d bytes from GATT characteristic %s on device %s.", length, guid.c_str(), address.c_str());
+                if (!callback)
+                        return;
+
+                // the reply is gone once this returns, so the data is copied for the device's strand
+                std::vector<uint8_t> value;
+                if (data && (length > 0))
+                        value.assign(data, data + length);
+                post([callback, success, value]()
+                {
+                        callback(success, value.data(), static_cast<int>(value.size()));
+                }, priority);
+        });
+}
+
+
+bool ManagedDevice::writeCharacteristicAsync(const Uuid &charUuid, const uint8_t *buffer, int length, ResultCallback callback)
+{
+        // get the characteristic's path (there's none while no adapter handles the device)
+        BluezAdapter *adapter = _bluezAdapter;
+        std::string charPath = adapter ? adapter->findCharacteristicPath(_address, charUuid) : std::string();
+        if (charPath.empty())
+        {
+                LOG_WARNING("Could not find GATT characteristic %s on device %s.", charUuid.toString().c_str(), _address);
+                return false;
+        }
+
+        // start writing the data (the callback keeps the caller's class)
+        std::string guid = charUuid.toString();
+        std::string address = _address;
+        BluezAdapter::CallPriority priority = BluezAdapter::callPriority();
+        return adapter->writeCharacteristicAsync(charPath.c_str(), buffer, length, [this, callback, guid, address, length, priority](bool success)
+        {
+                if (!success)
+                        LOG_ERROR("Error while writing to GATT characteristic %s on device %s.", guid.c_str(), address.c_str());
+                else
+                        LOG_DEBUG("Wrote %d bytes to GATT characteristic %s on device %s.", length, guid.c_str(), address.c_str());
+                if (callback)
+                        post([callback, success]() { callback(success); }, priority);
+        });
+}
+
+
+bool ManagedDevice::subscribeCharacteristic(const Uuid &charUuid, PacketHandler handler)
+{
+        // guard
+        if (charUuid.isNull())
+                return false;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // replace the handler of an existing subscription
+        for (Subscription &subscription : _subscriptions)
+        {
+                if (subscription.uuid == charUuid)
+                {
+                        subscription.handler = handler;
+                        if (subscription.stream)
+                                subscription.stream->setPacketHandler(packetForwarder(handler));
+                        return true;
+                }
+        }
+
+        // the subscription is kept even if it can't be opened now, it's renewed after the next connect
+        Subscription subscription;
+        subscription.uuid = charUuid;
+        subscription.handler = handler;
+        subscription.stream = nullptr;
+        bool result = isConnected() && openSubscription(subscription);
+        _subscriptions.push_back(subscription);
         return result;
 }
+
+
+bool ManagedDevice::isSubscribed(const Uuid &charUuid)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (const Subscription &subscription : _subscriptions)
+        {
+                if (subscription.uuid == charUuid)
+                        return true;
+        }
+        return false;
+}
+
+
+void ManagedDevice::unsubscribeCharacteristic(const Uuid &charUuid)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < _subscriptions.size(); i++)
+        {
+                if (_subscriptions[i].uuid == charUuid)
+                {
+                        closeSubscription(_subscriptions[i]);
+                        _subscriptions.erase(_subscriptions.begin() + i);
+                        return;
+                }
+        }
+}
+
+
+int ManagedDevice::renewSubscriptions()
+{
+        // streams are closed when the device disconnects
+        std::lock_guard<std::mutex> lock(_mutex);
+        int renewed = 0;
+        for (Subscription &subscription : _subscriptions)
+        {
+                if (subscription.stream && subscription.stream->isOpen())
+                        continue;
+                closeSubscription(subscription);
+                if (openSubscription(subscription))
+                        renewed++;
+        }
+        return renewed;
+}
+
+
+bool ManagedDevice::openSubscription(Subscription &subscription)
+{
+        // the characteristic may not have been resolved yet (or the device is waiting for an adapter), so that's no error
+        BluezAdapter *adapter = _bluezAdapter;
+        std::string charPath = adapter ? adapter->findCharacteristicPath(_address, subscription.uuid) : std::string();
+        if (charPath.empty())
+        {
+                LOG_DEBUG("GATT characteristic %s on device %s isn't available yet.", subscription.uuid.toString().c_str(), _address);
+                return false;
+        }
+
+        // start receiving notifications
+        subscription.stream = adapter->subscribeNotifications(charPath.c_str());
+        if (!subscription.stream)
+        {
+                LOG_ERROR("Could not subscribe to GATT characteristic %s on device %s.", subscription.uuid.toString().c_str(), _address);
+                return false;
+        }
+        subscription.stream->setPacketHandler(packetForwarder(subscription.handler));
+        LOG_VERBOSE("Subscribed to GATT characteristic %s on device %s.", subscription.uuid.toString().c_str(), _address);
+        return true;
+}
+
+
+void ManagedDevice::closeSubscription(Subscription &subscription)
+{
+        // a stream only exists while the adapter it belongs to handles the device
+        if (subscription.stream)
+        {
+                BluezAdapter *adapter = _bluezAdapter;
+                adapter->unsubscribeNotifications(subscription.stream);
+                subscription.stream = nullptr;
+        }
+}
+
+
+ManagedDevice::PacketHandler ManagedDevice::packetForwarder(PacketHandler handler)
+{
+        // packets are received by the dispatching thread and handled on the device's strand
+        if (!handler)
+                return handler;
+        return [this, handler](const uint8_t *data, int length)
+        {
+                std::vector<uint8_t> packet(data, data + length);
+                post([handler, packet]()
+                {
+                        handler(packet.data(), static_cast<int>(packet.size()));
+                });
+        };
+}
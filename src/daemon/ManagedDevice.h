@@ -26,11 +26,19 @@
 
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
 #include <mutex>
+#include <vector>
+#include <string>
+#include <functional>
 
 #include "Device.h"
+#include "Uuid.h"
+#include "Executor.h"
+#include "BluezAdapter.h"
 
-class BluezAdapter;
+class GattNotificationStream;
 
 
 
@@ -38,21 +46,56 @@ class ManagedDevice : public Device
 {
 public:
 
-        ManagedDevice(BluezAdapter *bluezAdapter, const char *address);
+        typedef std::function<void(bool success)> ResultCallback;
+        typedef std::function<void(bool success, const uint8_t *data, int length)> ReadCallback;
+        typedef std::function<void(const uint8_t *data, int length)> PacketHandler;
+
+
+        ManagedDevice(BluezAdapter *bluezAdapter, const char *address, Executor *executor = nullptr);
         ~ManagedDevice() override;
 
         void setName(const char *value);
+        BluezAdapter *bluezAdapter() const { return _bluezAdapter; }
+        void setBluezAdapter(BluezAdapter *bluezAdapter);
+        void post(Executor::Task task, BluezAdapter::CallPriority priority = BluezAdapter::PriorityStateSync);
+        bool idle();
 
         bool isConnected();
+        bool isConnecting() const { return _connecting; }
         bool connect();
+        bool connectAsync();
         bool disconnect();
 
-        int readCharacteristic(const char *charGuid, uint8_t *buffer, int bufferSize);
-        bool writeCharacteristic(const char *charGuid, uint8_t *buffer, int length);
+        int readCharacteristic(const Uuid &charUuid, uint8_t *buffer, int bufferSize);
+        bool writeCharacteristic(const Uuid &charUuid, const uint8_t *buffer, int length);
+
+        bool readCharacteristicAsync(const Uuid &charUuid, ReadCallback callback);
+        bool writeCharacteristicAsync(const Uuid &charUuid, const uint8_t *buffer, int length, ResultCallback callback);
+
+        bool subscribeCharacteristic(const Uuid &charUuid, PacketHandler handler);
+        bool isSubscribed(const Uuid &charUuid);
+        void unsubscribeCharacteristic(const Uuid &charUuid);
+        int renewSubscriptions();
 
 private:
 
-        BluezAdapter *_bluezAdapter;
+        struct Subscription
+        {
+        public:
+                Uuid uuid;
+                PacketHandler handler;
+                GattNotificationStream *stream;
+        };
+
+        std::atomic<BluezAdapter *> _bluezAdapter;   // nullptr while no controller handles the device
+        Executor::Strand *_strand;   // runs the device's work in order, nullptr to run it right away
+        std::atomic<bool> _connecting;
+        std::mutex _mutex;           // guards the subscriptions (must be taken before the adapter's lock)
+        std::vector<Subscription> _subscriptions;
+
+        bool openSubscription(Subscription &subscription);
+        void closeSubscription(Subscription &subscription);
+        PacketHandler packetForwarder(PacketHandler handler);
 };
 
 #endif // MANAGEDDEVICE_H
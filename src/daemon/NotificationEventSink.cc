@@ -28,18 +28,166 @@
 #include <dbus/dbus.h>
 
 #include "Logger.h"
+#include "DBusMarshal.h"
+#include "LatencyStats.h"
+
+
+
+// every app may send a burst of notifications, after that they're limited to a steady rate
+// (further ones are counted into the app's next one)
+#define APP_BURST    8
+#define APP_RATE     0.5   // notifications per second
+
+
+
+// a message may be read by several devices' threads at once, so the decoding is serialized
+static std::mutex decodeMutex;
+
+
+
+NotificationEventSink::Notification::Notification()
+{
+        sequence = 0;
+        count = 1;
+        receivedAt = 0;
+        queuedAt = 0;
+        _message = nullptr;
+        _decoded = false;
+}
+
+
+NotificationEventSink::Notification::Notification(DBusMessage *message)
+        : Notification()
+{
+        _message = message ? dbus_message_ref(message) : nullptr;
+}
+
+
+NotificationEventSink::Notification::Notification(const Notification &other)
+        : Notification()
+{
+        *this = other;
+}
+
+
+NotificationEventSink::Notification::~Notification()
+{
+        reset();
+}
+
+
+NotificationEventSink::Notification &NotificationEventSink::Notification::operator=(const Notification &other)
+{
+        // guard
+        if (this == &other)
+                return *this;
+
+        // the views point into the message, so they're shared along with the message's reference
+        if (other._message)
+                dbus_message_ref(other._message);
+        reset();
+        sequence = other.sequence;
+        count = other.count;
+        receivedAt = other.receivedAt;
+        queuedAt = other.queuedAt;
+        _message = other._message;
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        _decoded = other._decoded;
+        _appName = other._appName;
+        _appIcon = other._appIcon;
+        _summary = other._summary;
+        _body = other._body;
+        _expiryTimeout = other._expiryTimeout;
+        _replacesId = other._replacesId;
+        return *this;
+}
+
+
+void NotificationEventSink::Notification::reset()
+{
+        if (_message)
+                dbus_message_unref(_message);
+        _message = nullptr;
+        _decoded = false;
+}
+
+
+void NotificationEventSink::Notification::decode() const
+{
+        std::lock_guard<std::mutex> lock(decodeMutex);
+
+        // guard
+        if (_decoded)
+                return;
+        _decoded = true;
+        _appName = "";
+        _appIcon = "";
+        _summary = "";
+        _body = "";
+        _expiryTimeout = 0;
+        _replacesId = 0;
+        if (!_message)
+                return;
+
+        // the parameters have the signature "susssasa{sv}i", strings are returned as pointers into the message
+        DBusMessageIter paramsIter;
+        const char *text = nullptr;
+        dbus_message_iter_init(_message, &paramsIter);
+
+        // get the app's name
+        if (DBusMarshal::read(&paramsIter, &text))
+                _appName = text;
+
+        // get the ID of the notification which is replaced
+        dbus_message_iter_next(&paramsIter);
+        DBusMarshal::read(&paramsIter, &_replacesId);
+
+        // get the app's icon
+        dbus_message_iter_next(&paramsIter);
+        if (DBusMarshal::read(&paramsIter, &text))
+                _appIcon = text;
+
+        // get the summary
+        dbus_message_iter_next(&paramsIter);
+        if (DBusMarshal::read(&paramsIter, &text))
+                _summary = text;
+
+        // get the body
+        dbus_message_iter_next(&paramsIter);
+        if (DBusMarshal::read(&paramsIter, &text))
+                _body = text;
+
+        // skip the actions and hints (arrays are stepped over as a whole, so e.g. image data isn't touched)
+        dbus_message_iter_next(&paramsIter);
+        dbus_message_iter_next(&paramsIter);
+
+        // get the expiry timeout
+        dbus_message_iter_next(&paramsIter);
+        int32_t timeout = 0;
+        if (DBusMarshal::read(&paramsIter, &timeout))
+                _expiryTimeout = static_cast<int>(timeout);
+}
 
 
 
 NotificationEventSink::NotificationEventSink()
 {
-        _notifications.clear();
+        // the slots are allocated up front, so a notification storm can't make the daemon grow
+        // (a slot holds a reference to its message until it's reused)
+        _slots = new Notification[CAPACITY];
+        _head = 0;
+        _count = 0;
+        _lastSequence = 0;
+        _callsInFlight.reserve(MAX_CALLS_IN_FLIGHT);
+        _droppedCount = 0;
+        memset(_buckets, 0, sizeof(_buckets));
 }
 
 
 NotificationEventSink::~NotificationEventSink()
 {
         clearNotificationQueue();
+        delete[] _slots;
 }
 
 
@@ -70,155 +218,61 @@ void NotificationEventSink::inspectMessage(DBusMessage *message)
         // store Notify method call's parameters
         if (isMethodCall(message, "org.freedesktop.Notifications", "Notify"))
         {
-                // create a new notification object
-                Notification *notification = new Notification();
-                _notifications.push_back(notification);
-
-                // save the app's name
-                DBusMessageIter paramsIter;
-                dbus_message_iter_init(message, &paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_STRING)
-                {
-                        const char *appName = nullptr;
-                        dbus_message_iter_get_basic(&paramsIter, &appName);
-                        if (appName)
-                                notification->appName = appName;
-                }
-
-                // skip the "replace ID"
-                dbus_message_iter_next(&paramsIter);
-
-                // save the app's icon
-                dbus_message_iter_next(&paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_STRING)
-                {
-                        const char *appIcon = nullptr;
-                        dbus_message_iter_get_basic(&paramsIter, &appIcon);
-                        if (appIcon)
-                                notification->appIcon = appIcon;
-                }
-
-                // save the summary
-                dbus_message_iter_next(&paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_STRING)
-                {
-                        const char *summary = nullptr;
-                        dbus_message_iter_get_basic(&paramsIter, &summary);
-                        if (summary)
-                                notification->summary = summary;
-                }
-
-                // save the body
-                dbus_message_iter_next(&paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_STRING)
-                {
-                        const char *body = nullptr;
-                        dbus_message_iter_get_basic(&paramsIter, &body);
-                        if (body)
-                                notification->body = body;
-                }
-
-                // go through the actions
-                dbus_message_iter_next(&paramsIter);
-                DBusMessageIter actionsIter;
-                dbus_message_iter_recurse(&paramsIter, &actionsIter);
-                while (true)
-                {
-                        if (dbus_message_iter_get_arg_type(&actionsIter) == DBUS_TYPE_STRING)
-                        {
-                                const char *action = nullptr;
-                                dbus_message_iter_get_basic(&actionsIter, &action);
-                                if (action)
-                                        notification->actions.push_back(action);
-                        }
-                        if (dbus_message_iter_next(&actionsIter) == FALSE)
-                                break;
-                }
-
-                // go through the hints dictionary
-                dbus_message_iter_next(&paramsIter);
-                DBusMessageIter hintsIter;
-                dbus_message_iter_recurse(&paramsIter, &hintsIter);
-                while (true)
-                {
-                        if (dbus_message_iter_get_arg_type(&hintsIter) == DBUS_TYPE_DICT_ENTRY)
-                        {
-                                // get the key
-                                DBusMessageIter hintIter;
-                                dbus_message_iter_recurse(&hintsIter, &hintIter);
-                                const char *hintKey = nullptr;
-                                if (dbus_message_iter_get_arg_type(&hintIter) == DBUS_TYPE_STRING)
-                                        dbus_message_iter_get_basic(&hintIter, &hintKey);
-
-                                // get the value
-                                dbus_message_iter_next(&hintIter);
-                                const char *hintValue = nullptr;
-                                DBusMessageIter valueIter;
-                                dbus_message_iter_recurse(&hintIter, &valueIter);
-                                if (dbus_message_iter_get_arg_type(&valueIter) == DBUS_TYPE_STRING)
-                                        dbus_message_iter_get_basic(&valueIter, &hintValue);
-
-                                // store hint
-                                if (hintKey && hintValue)
-                                        notification->hints[hintKey] = hintValue;
-
-                        }
-                        if (dbus_message_iter_next(&hintsIter) == FALSE)
-                                break;
-                }
+                // the notification just references the message, its fields are decoded when they're read
+                Notification notification(message);
+                notification.receivedAt = LatencyStats::now();
 
-                // get the expiry timeout
-                dbus_message_iter_next(&paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_INT32)
+                // queue it right away, the ID from the method return isn't needed for sending it
+                LOG_DEBUG("Got a Notify method call from %s.", notification.appName());
+                uint64_t sequence = 0;
                 {
-                        dbus_int32_t timeout = 0;
-                        dbus_message_iter_get_basic(&paramsIter, &timeout);
-                        notification->expiryTimeout = static_cast<int>(timeout);
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        sequence = queueNotification(notification);
+                        if (sequence != 0)
+                                trackCall(message, sequence);
                 }
-
-                // done
-                LOG_DEBUG("Got a Notify method call from %s.", notification->appName.c_str());
+                if ((sequence != 0) && _queuedHandler)
+                        _queuedHandler();
                 return;
         }
 
-        // store the assigned notification ID
+        // pass the assigned notification ID on (the return is correlated with its call by the caller's serial,
+        // returns of other calls and of suppressed notifications aren't tracked)
         if (isMethodReturn(message, "org.freedesktop.Notifications", "Notify"))
         {
-                // save the notification's ID
-                DBusMessageIter paramsIter;
-                dbus_message_iter_init(message, &paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_UINT32)
+                const char *caller = dbus_message_get_destination(message);
+                if (!caller)
+                        return;
+                uint64_t sequence = 0;
                 {
-                        dbus_uint32_t id = 0;
-                        dbus_message_iter_get_basic(&paramsIter, &id);
-                        if (!_notifications.empty())
-                                _notifications.back()->id = static_cast<int>(id);
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        std::unordered_map<uint64_t, CallInFlight>::iterator call = _callsInFlight.find(callKey(caller, dbus_message_get_reply_serial(message)));
+                        if (call == _callsInFlight.end())
+                                return;
+                        sequence = call->second.sequence;
+                        _callsInFlight.erase(call);
                 }
 
+                // get the notification's ID
+                DBusMessageIter paramsIter;
+                dbus_message_iter_init(message, &paramsIter);
+                uint32_t id = 0;
+                if (DBusMarshal::read(&paramsIter, &id) && (id != 0) && _idHandler)
+                        _idHandler(sequence, static_cast<int>(id));
+
                 // done
                 LOG_DEBUG("Got a Notify method return.");
                 return;
         }
 
-        // remove the notification from the list if it has been closed
+        // pass the closed notification's ID on
         if (isSignal(message, "org.freedesktop.Notifications", "NotificationClosed"))
         {
-                // delete the notification with the received ID
                 DBusMessageIter paramsIter;
                 dbus_message_iter_init(message, &paramsIter);
-                if (dbus_message_iter_get_arg_type(&paramsIter) == DBUS_TYPE_UINT32)
-                {
-                        dbus_uint32_t id = 0;
-                        dbus_message_iter_get_basic(&paramsIter, &id);
-                        for (int i = 0; i < static_cast<int>(_notifications.size()); i++)
-                        {
-                                if (_notifications[i]->id == static_cast<int>(id))
-                                {
-                                        deleteNotificationAt(i);
-                                        break;
-                                }
-                        }
-                }
+                uint32_t id = 0;
+                if (DBusMarshal::read(&paramsIter, &id) && (id != 0) && _closedHandler)
+                        _closedHandler(static_cast<int>(id));
 
                 // done
                 LOG_DEBUG("Got a NotificationClosed signal.");
@@ -227,30 +281,158 @@ void NotificationEventSink::inspectMessage(DBusMessage *message)
 }
 
 
-const NotificationEventSink::Notification *NotificationEventSink::pendingNotification(int index) const
+int NotificationEventSink::copyNotificationsAfter(uint64_t sequence, std::vector<Notification> &notifications)
 {
-        // guard
-        if ((index < 0) || (index >= static_cast<int>(_notifications.size())))
-                return nullptr;
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // the ring is ordered by sequence number
+        notifications.clear();
+        for (int i = 0; i < _count; i++)
+        {
+                const Notification &notification = slotAt(i);
+                if (notification.sequence > sequence)
+                        notifications.push_back(notification);
+        }
+        return static_cast<int>(notifications.size());
+}
+
+
+void NotificationEventSink::discardNotificationsUpTo(uint64_t sequence)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
 
-        return static_cast<const Notification *>(_notifications[index]);
+        while ((_count > 0) && (slotAt(0).sequence <= sequence))
+                dropOldest();
 }
 
 
 void NotificationEventSink::clearNotificationQueue()
 {
-        for (Notification *notification : _notifications)
-                delete notification;
-        _notifications.clear();
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        while (_count > 0)
+                dropOldest();
+        _head = 0;
+        _callsInFlight.clear();
+}
+
+
+uint64_t NotificationEventSink::queueNotification(const Notification &notification)
+{
+        int64_t now = LatencyStats::now();
+
+        // an app which exceeds its rate has its notifications counted into its next one (replacements and
+        // bursts which are already queued are coalesced by the journal's owner)
+        AppBucket &bucket = bucketOf(notification.appName(), now);
+        if (bucket.tokens < 1.0)
+        {
+                bucket.suppressed++;
+                LOG_VERBOSE("Suppressed notification from %s, which exceeds its rate.", notification.appName());
+                return 0;
+        }
+        bucket.tokens -= 1.0;
+
+        // when all slots are taken, the oldest notification is dropped
+        if (_count == CAPACITY)
+        {
+                _droppedCount++;
+                LOG_WARNING("Dropped notification from %s, which hasn't been sent to any device (%d dropped so far).", slotAt(0).appName(), _droppedCount);
+                dropOldest();
+        }
+
+        // take the next slot
+        Notification &queued = slotAt(_count);
+        queued = notification;
+        queued.sequence = ++_lastSequence;
+        queued.count = 1 + bucket.suppressed;
+        queued.queuedAt = now;
+        bucket.suppressed = 0;
+        _count++;
+        return queued.sequence;
+}
+
+
+void NotificationEventSink::dropOldest()
+{
+        slotAt(0).reset();
+        _head = (_head + 1) % CAPACITY;
+        _count--;
 }
 
 
-void NotificationEventSink::deleteNotificationAt(int index)
+void NotificationEventSink::trackCall(DBusMessage *message, uint64_t sequence)
 {
         // guard
-        if ((index < 0) || (index >= static_cast<int>(_notifications.size())))
+        const char *caller = dbus_message_get_sender(message);
+        if (!caller)
                 return;
 
-        delete _notifications[index];
-        _notifications.erase(_notifications.begin() + index);
+        // calls whose returns haven't been seen are purged once they've timed out
+        int64_t now = LatencyStats::now();
+        if (static_cast<int>(_callsInFlight.size()) >= MAX_CALLS_IN_FLIGHT)
+        {
+                for (std::unordered_map<uint64_t, CallInFlight>::iterator it = _callsInFlight.begin(); it != _callsInFlight.end(); )
+                {
+                        if (now - it->second.calledAt > CALL_TIMEOUT)
+                                it = _callsInFlight.erase(it);
+                        else
+                                ++it;
+                }
+                if (static_cast<int>(_callsInFlight.size()) >= MAX_CALLS_IN_FLIGHT)
+                {
+                        LOG_WARNING("Lost track of %d Notify calls.", static_cast<int>(_callsInFlight.size()));
+                        _callsInFlight.clear();
+                }
+        }
+
+        // remember the call
+        CallInFlight &call = _callsInFlight[callKey(caller, dbus_message_get_serial(message))];
+        call.sequence = sequence;
+        call.calledAt = now;
+}
+
+
+uint64_t NotificationEventSink::callKey(const char *caller, uint32_t serial)
+{
+        // serials are counted per connection, so they're combined with the caller's unique name (FNV-1a)
+        uint64_t hash = 14695981039346656037ULL;
+        for (const char *c = caller; *c; c++)
+        {
+                hash ^= static_cast<uint8_t>(*c);
+                hash *= 1099511628211ULL;
+        }
+        return hash ^ (static_cast<uint64_t>(serial) * 0x9e3779b97f4a7c15ULL);
+}
+
+
+NotificationEventSink::AppBucket &NotificationEventSink::bucketOf(const char *appName, int64_t now)
+{
+        // look for the app's bucket, the least recently used one is taken over by a new app
+        AppBucket *bucket = nullptr;
+        for (int i = 0; i < APP_BUCKETS; i++)
+        {
+                if (strncmp(_buckets[i].appName, appName, APP_NAME_SIZE - 1) == 0)
+                {
+                        bucket = &_buckets[i];
+                        break;
+                }
+                if (!bucket || (_buckets[i].refilledAt < bucket->refilledAt))
+                        bucket = &_buckets[i];
+        }
+        if (strncmp(bucket->appName, appName, APP_NAME_SIZE - 1) != 0)
+        {
+                strncpy(bucket->appName, appName, APP_NAME_SIZE - 1);
+                bucket->appName[APP_NAME_SIZE - 1] = 0;
+                bucket->tokens = APP_BURST;
+                bucket->refilledAt = now;
+                bucket->suppressed = 0;
+                return *bucket;
+        }
+
+        // refill the tokens for the time which has passed
+        bucket->tokens += static_cast<double>(now - bucket->refilledAt) * APP_RATE / 1000000.0;
+        if (bucket->tokens > APP_BURST)
+                bucket->tokens = APP_BURST;
+        bucket->refilledAt = now;
+        return *bucket;
 }
@@ -27,9 +27,11 @@
 
 #include "DBusEventWatcher.h"
 
+#include <stdint.h>
 #include <vector>
-#include <map>
-#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
 
 
 
@@ -37,20 +39,51 @@ class NotificationEventSink : public DBusEventWatcher::EventSink
 {
 public:
 
+        // a notification keeps a reference to its Notify method call, the fields are views into the message,
+        // which are decoded when they're read first (the actions and hints are skipped, they're never touched)
         struct Notification
         {
         public:
-                int id;
-                std::string appName;
-                std::string appIcon;
-                std::string summary;
-                std::string body;
-                std::vector<std::string> actions;
-                std::map<std::string, std::string> hints;
-                int expiryTimeout;
+                Notification();
+                Notification(DBusMessage *message);
+                Notification(const Notification &other);
+                ~Notification();
+                Notification &operator=(const Notification &other);
+
+                uint64_t sequence;   // counts up for every queued notification, starting at 1
+                int count;           // number of notifications from the app this one stands for (suppressed ones included)
+                int64_t receivedAt;  // monotonic microseconds, when the Notify call was dispatched to the sink
+                int64_t queuedAt;    // monotonic microseconds, when it was queued
+
+                bool isEmpty() const { return (_message == nullptr); }
+                const char *appName() const { decode(); return _appName; }
+                const char *appIcon() const { decode(); return _appIcon; }
+                const char *summary() const { decode(); return _summary; }
+                const char *body() const { decode(); return _body; }
+                int expiryTimeout() const { decode(); return _expiryTimeout; }
+                uint32_t replacesId() const { decode(); return _replacesId; }
+
+                void reset();
+
+        private:
+                DBusMessage *_message;
+                mutable bool _decoded;
+                mutable const char *_appName;
+                mutable const char *_appIcon;
+                mutable const char *_summary;
+                mutable const char *_body;
+                mutable int _expiryTimeout;
+                mutable uint32_t _replacesId;
+
+                void decode() const;
         };
 
 
+        typedef std::function<void()> QueuedHandler;
+        typedef std::function<void(uint64_t sequence, int id)> IdHandler;
+        typedef std::function<void(int id)> ClosedHandler;
+
+
         NotificationEventSink();
         ~NotificationEventSink() override;
 
@@ -61,15 +94,62 @@ public:
 
         void inspectMessage(DBusMessage *message) override;
 
-        int pendingNotificationsCount() const { return static_cast<int>(_notifications.size()); }
-        const Notification *pendingNotification(int index) const;
+        // the notifications are only staged here, whoever takes them over learns about their IDs and closing
+        void setQueuedHandler(QueuedHandler handler) { _queuedHandler = handler; }
+        void setIdHandler(IdHandler handler) { _idHandler = handler; }
+        void setClosedHandler(ClosedHandler handler) { _closedHandler = handler; }
+
+        // the queue is filled by the dispatching thread and read by the services' threads
+        int pendingNotificationsCount() const { std::lock_guard<std::mutex> lock(_mutex); return _count; }
+        int copyNotificationsAfter(uint64_t sequence, std::vector<Notification> &notifications);
+        void discardNotificationsUpTo(uint64_t sequence);
         void clearNotificationQueue();
 
 private:
 
-        std::vector<Notification *> _notifications;
+        static const int CAPACITY = 64;       // notification slots
+        static const int APP_BUCKETS = 16;    // apps which are rate limited at the same time
+        static const int APP_NAME_SIZE = 64;
+
+        static const int MAX_CALLS_IN_FLIGHT = 256;   // Notify calls awaiting their return, before the stale ones are purged
+        static const int CALL_TIMEOUT = 25000000;      // microseconds, libdbus' default reply timeout
+
+        // Notify call which hasn't been answered yet
+        struct CallInFlight
+        {
+        public:
+                uint64_t sequence;     // notification which gets the returned ID
+                int64_t calledAt;      // monotonic microseconds
+        };
+
+        // token bucket which limits the rate of an app's notifications
+        struct AppBucket
+        {
+        public:
+                char appName[APP_NAME_SIZE];
+                double tokens;
+                int64_t refilledAt;    // monotonic microseconds
+                int suppressed;        // dropped notifications, counted into the app's next one
+        };
 
-        void deleteNotificationAt(int index);
+        mutable std::mutex _mutex;
+        Notification *_slots;                                       // ring buffer, allocated once
+        int _head;                                                  // oldest notification
+        int _count;
+        uint64_t _lastSequence;
+        std::unordered_map<uint64_t, CallInFlight> _callsInFlight;  // keyed by the callers' names and serials
+        AppBucket _buckets[APP_BUCKETS];
+        int _droppedCount;
+        QueuedHandler _queuedHandler;                               // called after a notification has been queued
+        IdHandler _idHandler;                                       // called when a queued notification's ID is returned
+        ClosedHandler _closedHandler;                               // called when a notification has been closed
+
+        Notification &slotAt(int index) { return _slots[(_head + index) % CAPACITY]; }
+        uint64_t queueNotification(const Notification &notification);
+        void dropOldest();
+        void trackCall(DBusMessage *message, uint64_t sequence);
+        static uint64_t callKey(const char *caller, uint32_t serial);
+        AppBucket &bucketOf(const char *appName, int64_t now);
 };
 
 #endif // NOTIFICATIONEVENTSINK_H
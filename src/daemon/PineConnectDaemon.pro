@@ -2,8 +2,8 @@ QT=
 QMAKE_LIBS=
 QMAKE_LIBS_THREAD=
 
-QMAKE_CXXFLAGS += -pg -Wpedantic
-QMAKE_LFLAGS += -pg
+QMAKE_CXXFLAGS += -pg -Wpedantic -pthread
+QMAKE_LFLAGS += -pg -pthread
 
 
 unix {
@@ -16,26 +16,50 @@ INCLUDEPATH += ../lib/logger ../lib/dbus
 
 
 SOURCES += \
+        ../lib/dbus/DBusConnectionFactory.cc \
         ../lib/dbus/DBusEventWatcher.cc \
+        ../lib/dbus/EventLoop.cc \
         ../lib/logger/Logger.cc \
         ../lib/dbus/BluezAdapter.cc \
+        ../lib/dbus/BluezObjectCache.cc \
+        ../lib/dbus/GattNotificationStream.cc \
+        ../lib/dbus/GattWriteStream.cc \
+        AlertJournal.cc \
         AlertNotificationService.cc \
         CurrentTimeService.cc \
         Device.cc \
         DeviceManager.cc \
+        Executor.cc \
+        TimerWheel.cc \
+        ServiceScheduler.cc \
+        LatencyStats.cc \
         GattService.cc \
         ManagedDevice.cc \
         NotificationEventSink.cc \
         main.cc
 
 HEADERS += \
+        ../lib/dbus/DBusConnectionFactory.h \
         ../lib/dbus/DBusEventWatcher.h \
+        ../lib/dbus/EventLoop.h \
         ../lib/logger/Logger.h \
         ../lib/dbus/BluezAdapter.h \
+        ../lib/dbus/BluezObjectCache.h \
+        ../lib/dbus/DBusMarshal.h \
+        ../lib/dbus/GattNotificationStream.h \
+        ../lib/dbus/GattWriteStream.h \
+        ../lib/dbus/Uuid.h \
+        ../lib/dbus/MacAddress.h \
+        ../lib/dbus/AddressTable.h \
+        AlertJournal.h \
         AlertNotificationService.h \
         CurrentTimeService.h \
         Device.h \
         DeviceManager.h \
+        Executor.h \
+        TimerWheel.h \
+        ServiceScheduler.h \
+        LatencyStats.h \
         GattService.h \
         ManagedDevice.h \
         NotificationEventSink.h
@@ -0,0 +1,230 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "ServiceScheduler.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "Logger.h"
+#include "EventLoop.h"
+#include "DeviceManager.h"
+#include "ManagedDevice.h"
+#include "GattService.h"
+
+
+
+#define WHEEL_TICK   100   // ms
+
+
+
+ServiceScheduler::ServiceScheduler(DeviceManager *devices, EventLoop *loop)
+        : _wheel(WHEEL_TICK, monotonicMillis())
+{
+        _devices = devices;
+        _loop = loop;
+        _triggered = false;
+        _seed = static_cast<unsigned int>(monotonicMillis());
+
+        // the wheel wakes the loop up only when something is due
+        _timer = _loop->addTimer(-1, 0, [this]() { runDueJobs(); });
+        _clockWatch = _loop->watchClockChanges([this]()
+        {
+                LOG_INFO("The host's clock has been set.");
+                trigger(GattService::TriggerClockChanged);
+        });
+}
+
+
+ServiceScheduler::~ServiceScheduler()
+{
+        _loop->removeTimer(_clockWatch);
+        _loop->removeTimer(_timer);
+        for (Job *job : _jobs)
+        {
+                _wheel.cancel(job);
+                delete job;
+        }
+        _jobs.clear();
+}
+
+
+void ServiceScheduler::addService(GattService *service)
+{
+        // guard
+        if (!service)
+                return;
+
+        // the service gets a job for every device which is already known
+        _services.push_back(service);
+        int64_t now = monotonicMillis();
+        for (ManagedDevice *device : _devicesWithJobs)
+                addJob(service, device, now);
+        addJobs();
+        armTimer();
+}
+
+
+void ServiceScheduler::trigger(int triggers, ManagedDevice *device)
+{
+        // mark the jobs of the services which are interested in the event
+        addJobs();
+        int64_t now = monotonicMillis();
+        bool any = false;
+        for (Job *job : _jobs)
+        {
+                if ((job->service->triggers() & triggers) == 0)
+                        continue;
+                if (device && (job->device != device))
+                        continue;
+
+                // a job which has just run waits for its coalescing window to pass, so a burst of
+                // events makes it run just once more
+                int window = job->service->coalescingWindow();
+                if ((window > 0) && (now - job->lastRun < window))
+                {
+                        int64_t heldUntil = job->lastRun + window;
+                        if (!job->pending() || (static_cast<int64_t>(job->due) * _wheel.tickLength() > heldUntil))
+                                _wheel.schedule(job, heldUntil);
+                        continue;
+                }
+                job->triggered = true;
+                any = true;
+        }
+        if (!any)
+                armTimer();
+
+        // they're run by the loop's next turn, so a burst of events is handled at once
+        if (any && !_triggered)
+        {
+                _triggered = true;
+                _loop->rearmTimer(_timer, 0, 0);
+        }
+}
+
+
+void ServiceScheduler::addJobs()
+{
+        // devices are only added while the daemon is running, they get their jobs when they're seen first
+        int64_t now = monotonicMillis();
+        for (int i = static_cast<int>(_devicesWithJobs.size()); i < _devices->managedDevicesCount(); i++)
+        {
+                ManagedDevice *device = _devices->managedDeviceByIndex(i);
+                _devicesWithJobs.push_back(device);
+                for (GattService *service : _services)
+                        addJob(service, device, now);
+        }
+}
+
+
+void ServiceScheduler::addJob(GattService *service, ManagedDevice *device, int64_t now)
+{
+        Job *job = new Job();
+        job->service = service;
+        job->device = device;
+        job->triggered = false;
+        job->lastRun = now - job->service->coalescingWindow();
+        _jobs.push_back(job);
+        scheduleJob(job, now, true);
+}
+
+
+void ServiceScheduler::scheduleJob(Job *job, int64_t now, bool first)
+{
+        // services without a period only run on their triggers
+        int period = job->service->period();
+        if (period <= 0)
+                return;
+
+        // the first run is just spread by the jitter, so the devices don't compete for the air
+        int jitter = job->service->jitter();
+        int delay = (jitter > 0) ? (rand_r(&_seed) % (jitter + 1)) : 0;
+        if (!first)
+                delay += period;
+        _wheel.schedule(job, now + delay);
+}
+
+
+void ServiceScheduler::runDueJobs()
+{
+        // collect the expired jobs
+        addJobs();
+        int64_t now = monotonicMillis();
+        std::vector<TimerWheel::Timer *> expired;
+        _wheel.advance(now, expired);
+        for (TimerWheel::Timer *timer : expired)
+                static_cast<Job *>(timer)->triggered = true;
+        _triggered = false;
+
+        // the due services run on their device's strand in their service's class, so an alert overtakes
+        // the state syncs which are still waiting (services of the same class run in the order they've been added)
+        for (ManagedDevice *device : _devicesWithJobs)
+        {
+                int count = 0;
+                for (Job *job : _jobs)
+                {
+                        if ((job->device != device) || !job->triggered)
+                                continue;
+                        GattService *service = job->service;
+                        job->triggered = false;
+                        job->lastRun = now;
+                        scheduleJob(job, now, false);
+                        device->post([device, service]()
+                        {
+                                if (device->isConnected())
+                                        service->run(device);
+                        }, service->priority());
+                        count++;
+                }
+                if (count > 0)
+                        LOG_DEBUG("Running %d due services on device %s.", count, device->address());
+        }
+
+        // sleep until the next job is due
+        armTimer();
+}
+
+
+void ServiceScheduler::armTimer()
+{
+        // a triggered run comes first anyway
+        if (_triggered)
+                return;
+        int64_t next = _wheel.nextExpiry();
+        if (next < 0)
+        {
+                _loop->rearmTimer(_timer, -1, 0);
+                return;
+        }
+        int64_t delay = next - monotonicMillis();
+        _loop->rearmTimer(_timer, (delay > 0) ? static_cast<int>(delay) : 0, 0);
+}
+
+
+int64_t ServiceScheduler::monotonicMillis()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000 + static_cast<int64_t>(now.tv_nsec / 1000000);
+}
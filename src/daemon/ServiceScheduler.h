@@ -0,0 +1,84 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#ifndef SERVICESCHEDULER_H
+#define SERVICESCHEDULER_H
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "TimerWheel.h"
+
+class DeviceManager;
+class ManagedDevice;
+class GattService;
+class EventLoop;
+
+
+
+// runs the services on the managed devices when they're due (periodically and on their triggers),
+// it's used by the loop's thread only, the services run on the devices' strands
+class ServiceScheduler
+{
+public:
+
+        ServiceScheduler(DeviceManager *devices, EventLoop *loop);
+        ~ServiceScheduler();
+
+        void addService(GattService *service);
+        int servicesCount() const { return static_cast<int>(_services.size()); }
+        void trigger(int triggers, ManagedDevice *device = nullptr);
+
+private:
+
+        struct Job : public TimerWheel::Timer
+        {
+        public:
+                GattService *service;
+                ManagedDevice *device;
+                bool triggered;   // runs with the loop's next turn
+                int64_t lastRun;  // ms, when the job has been posted to the device last
+        };
+
+        DeviceManager *_devices;
+        EventLoop *_loop;
+        TimerWheel _wheel;
+        int _timer;         // loop timer, armed for the wheel's next expiry
+        int _clockWatch;    // loop timer, cancelled when the host's clock is set
+        bool _triggered;    // the loop timer has been armed to fire right away
+        unsigned int _seed;
+        std::vector<GattService *> _services;
+        std::vector<ManagedDevice *> _devicesWithJobs;
+        std::vector<Job *> _jobs;
+
+        void addJobs();
+        void addJob(GattService *service, ManagedDevice *device, int64_t now);
+        void scheduleJob(Job *job, int64_t now, bool first);
+        void runDueJobs();
+        void armTimer();
+        static int64_t monotonicMillis();
+};
+
+#endif // SERVICESCHEDULER_H
@@ -0,0 +1,201 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "TimerWheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+
+TimerWheel::TimerWheel(int tickLength, int64_t now)
+{
+        _tickLength = (tickLength > 0) ? tickLength : 1;
+        _now = static_cast<uint64_t>(now) / _tickLength;
+        _count = 0;
+        memset(_slots, 0, sizeof(_slots));
+        memset(_occupied, 0, sizeof(_occupied));
+}
+
+
+TimerWheel::~TimerWheel()
+{
+        // the timers belong to their owners, they're just detached
+        for (int level = 0; level < LEVELS; level++)
+        {
+                for (int slot = 0; slot < SLOTS; slot++)
+                {
+                        while (_slots[level][slot])
+                                unlink(_slots[level][slot]);
+                }
+        }
+}
+
+
+void TimerWheel::schedule(Timer *timer, int64_t due)
+{
+        // guard
+        if (!timer)
+                return;
+
+        // a timer which is already pending is moved
+        if (timer->pending())
+                unlink(timer);
+        timer->due = static_cast<uint64_t>((due > 0) ? due : 0) / _tickLength;
+        insert(timer);
+}
+
+
+void TimerWheel::cancel(Timer *timer)
+{
+        if (timer && timer->pending())
+                unlink(timer);
+}
+
+
+int TimerWheel::advance(int64_t now, std::vector<Timer *> &expired)
+{
+        // jump from one occupied tick to the next, so long idle periods cost nothing
+        uint64_t target = static_cast<uint64_t>(now) / _tickLength;
+        size_t expiredBefore = expired.size();
+        while (_now < target)
+        {
+                uint64_t next = nextEventTick();
+                if (next > target)
+                {
+                        _now = target;
+                        break;
+                }
+                _now = next;
+                processTick(expired);
+        }
+        return static_cast<int>(expired.size() - expiredBefore);
+}
+
+
+int64_t TimerWheel::nextExpiry() const
+{
+        // timers on the upper levels are reported when they're moved down, which is early enough to rearm the wakeup
+        if (_count == 0)
+                return -1;
+        return static_cast<int64_t>(nextEventTick() * _tickLength);
+}
+
+
+void TimerWheel::insert(Timer *timer)
+{
+        // overdue timers expire with the next tick
+        if (timer->due <= _now)
+                timer->due = _now + 1;
+
+        // the level is chosen by the distance, the slot by the due tick (very distant timers wait in the last slot)
+        uint64_t delta = timer->due - _now;
+        int level = 0;
+        while ((level < LEVELS - 1) && (delta >= (1ULL << (SLOT_BITS * (level + 1)))))
+                level++;
+        uint64_t tick = timer->due;
+        uint64_t range = 1ULL << (SLOT_BITS * LEVELS);
+        if (delta >= range)
+                tick = _now + range - 1;
+        int slot = static_cast<int>((tick >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+        // put it at the head of the slot's list
+        timer->level = level;
+        timer->slot = slot;
+        timer->prev = nullptr;
+        timer->next = _slots[level][slot];
+        if (timer->next)
+                timer->next->prev = timer;
+        _slots[level][slot] = timer;
+        _occupied[level] |= (1ULL << slot);
+        _count++;
+}
+
+
+void TimerWheel::unlink(Timer *timer)
+{
+        if (timer->prev)
+                timer->prev->next = timer->next;
+        else
+                _slots[timer->level][timer->slot] = timer->next;
+        if (timer->next)
+                timer->next->prev = timer->prev;
+        if (!_slots[timer->level][timer->slot])
+                _occupied[timer->level] &= ~(1ULL << timer->slot);
+        timer->level = -1;
+        timer->prev = nullptr;
+        timer->next = nullptr;
+        _count--;
+}
+
+
+uint64_t TimerWheel::nextEventTick() const
+{
+        // the next occupied slot of each level is found by rotating its bitmap, upper levels count when they cascade
+        uint64_t best = UINT64_MAX;
+        for (int level = 0; level < LEVELS; level++)
+        {
+                if (_occupied[level] == 0)
+                        continue;
+                int shift = SLOT_BITS * level;
+                uint64_t current = _now >> shift;
+                int start = static_cast<int>((current + 1) & (SLOTS - 1));
+                uint64_t rotated = (_occupied[level] >> start) | (_occupied[level] << ((SLOTS - start) & (SLOTS - 1)));
+                uint64_t tick = (current + 1 + __builtin_ctzll(rotated)) << shift;
+                if (tick < best)
+                        best = tick;
+        }
+        return best;
+}
+
+
+void TimerWheel::processTick(std::vector<Timer *> &expired)
+{
+        // at a level's boundary, the upper level's current slot is spread over the lower levels
+        for (int level = 1; level < LEVELS; level++)
+        {
+                int shift = SLOT_BITS * level;
+                if ((_now & ((1ULL << shift) - 1)) != 0)
+                        break;
+                int slot = static_cast<int>((_now >> shift) & (SLOTS - 1));
+                while (_slots[level][slot])
+                {
+                        Timer *timer = _slots[level][slot];
+                        unlink(timer);
+                        insert(timer);
+                }
+        }
+
+        // the timers of the current slot are due (except those which have been waiting for a very long time)
+        int slot = static_cast<int>(_now & (SLOTS - 1));
+        while (_slots[0][slot])
+        {
+                Timer *timer = _slots[0][slot];
+                unlink(timer);
+                if (timer->due > _now)
+                        insert(timer);
+                else
+                        expired.push_back(timer);
+        }
+}
@@ -0,0 +1,82 @@
+/*
+ *
+ *  PineConnect - A companion daemon and app for the PineTime watch
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+
+#include <stdint.h>
+#include <vector>
+
+
+
+// a hierarchical timing wheel: four levels of 64 slots each, every level's slots are 64 times as long as the
+// ones of the level below, timers are moved down a level when their slot comes up (times are in milliseconds)
+class TimerWheel
+{
+public:
+
+        // timers are embedded into the scheduled objects, so scheduling doesn't allocate
+        struct Timer
+        {
+        public:
+                Timer() : due(0), level(-1), slot(0), prev(nullptr), next(nullptr) {}
+                bool pending() const { return (level >= 0); }
+                uint64_t due;   // in ticks
+                int level;      // -1 if not scheduled
+                int slot;
+                Timer *prev;
+                Timer *next;
+        };
+
+
+        TimerWheel(int tickLength, int64_t now);
+        ~TimerWheel();
+
+        int tickLength() const { return _tickLength; }
+        int count() const { return _count; }
+        void schedule(Timer *timer, int64_t due);
+        void cancel(Timer *timer);
+        int advance(int64_t now, std::vector<Timer *> &expired);
+        int64_t nextExpiry() const;
+
+private:
+
+        static const int LEVELS = 4;
+        static const int SLOT_BITS = 6;
+        static const int SLOTS = 1 << SLOT_BITS;
+
+        int _tickLength;
+        uint64_t _now;                    // in ticks
+        int _count;
+        Timer *_slots[LEVELS][SLOTS];     // doubly linked lists
+        uint64_t _occupied[LEVELS];       // one bit per non-empty slot
+
+        void insert(Timer *timer);
+        void unlink(Timer *timer);
+        uint64_t nextEventTick() const;
+        void processTick(std::vector<Timer *> &expired);
+};
+
+#endif // TIMERWHEEL_H
@@ -4,26 +4,55 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <string>
 
 #include "Logger.h"
 #include "BluezAdapter.h"
 #include "DeviceManager.h"
+#include "ServiceScheduler.h"
 #include "GattService.h"
 #include "CurrentTimeService.h"
 #include "AlertNotificationService.h"
 #include "DBusEventWatcher.h"
+#include "DBusConnectionFactory.h"
+#include "EventLoop.h"
 #include "NotificationEventSink.h"
 
 
 
-static bool _shutdown;
+#define MAINTENANCE_INTERVAL   10000   // ms between the checks of the adapters and connections
 
 
 
-static void handleSignal(int signal)
+static std::string alertJournalPath()
 {
-        _shutdown = true;
-        LOG_INFO("Will shut down due to %s signal.", strsignal(signal));
+        // the journal lives in the user's state directory
+        std::string directory;
+        const char *stateHome = getenv("XDG_STATE_HOME");
+        const char *home = getenv("HOME");
+        if (stateHome && (stateHome[0] == '/'))
+                directory = stateHome;
+        else if (home && (home[0] == '/'))
+                directory = std::string(home) + "/.local/state";
+        else
+                return std::string();
+        directory += "/pineconnect";
+
+        // create the missing directories
+        for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1))
+        {
+                std::string parent = directory.substr(0, slash);
+                if ((mkdir(parent.c_str(), 0700) != 0) && (errno != EEXIST))
+                {
+                        LOG_WARNING("Couldn't create directory %s: %s", parent.c_str(), strerror(errno));
+                        return std::string();
+                }
+                if (slash == std::string::npos)
+                        break;
+        }
+        return directory + "/alerts.journal";
 }
 
 
@@ -32,97 +61,117 @@ int main(int argc, char **argv)
         (void)argc;
         (void)argv;
 
-        // initialization
+        // initialization (libdbus has to be made thread-safe before it's used)
         Logger::setLogLevel(Logger::Debug);
         LOG_INFO("Starting.");
+        if (!dbus_threads_init_default())
+        {
+                LOG_ERROR("Couldn't initialize DBus thread support.");
+                return 1;
+        }
+        EventLoop *loop = new EventLoop();
+        if (!loop->isValid())
+        {
+                delete loop;
+                return 1;
+        }
+
+        // set up signal handler (the signals are blocked, so this has to be done before any thread is started)
+        LOG_DEBUG("Setting up OS signal handler.");
+        loop->watchSignals({SIGINT, SIGTERM, SIGHUP}, [loop](int signal)
+        {
+                LOG_INFO("Will shut down due to %s signal.", strsignal(signal));
+                loop->quit();
+        });
+
+        // the buses are dispatched by the loop
         DBusEventWatcher *sessionBusWatcher = new DBusEventWatcher(true);
+        sessionBusWatcher->attach(loop);
         NotificationEventSink *notificationEventSink = new NotificationEventSink();
         sessionBusWatcher->registerSink(notificationEventSink);
-        BluezAdapter *bluezAdapter = new BluezAdapter("hci0");
-        DeviceManager *devices = new DeviceManager(bluezAdapter);
+        DBusConnectionFactory *systemBus = new DBusConnectionFactory(DBUS_BUS_SYSTEM);
+        DeviceManager *devices = new DeviceManager(systemBus, loop);
         int servicesCount = 2;
         GattService *services[2];
         services[0] = new CurrentTimeService();
-        services[1] = new AlertNotificationService(notificationEventSink);
+        std::string journalPath = alertJournalPath();
+        AlertNotificationService *alertNotificationService = new AlertNotificationService(notificationEventSink, journalPath.empty() ? nullptr : journalPath.c_str());
+        services[1] = alertNotificationService;
 
         devices->addManagedDevice("FB:89:02:47:5F:C6");  // sealed PineTime
         devices->addManagedDevice("D9:C7:C5:38:D0:CB");  // development PineTime
 
-        // set up signal handler
-        LOG_DEBUG("Setting up OS signal handler.");
-        struct sigaction action;
-        action.sa_handler = handleSignal;
-        sigemptyset(&action.sa_mask);
-        action.sa_flags = 0;
-        sigaction(SIGINT, &action, nullptr);
-        sigaction(SIGTERM, &action, nullptr);
-        sigaction(SIGHUP, &action, nullptr);
-
-        // enter the daemon's main loop
-        LOG_DEBUG("Entering main loop.");
-        _shutdown = false;
-        while (!_shutdown)
+        // connect the devices which are already advertising, the others are connected as soon as they show up
+        if (devices->anyAdapterPowered())
+                devices->connectDiscoveredManagedDevices();
+
+        // the services run when they're due, notifications and resolved devices trigger them right away
+        // (notifications are journaled first, so they're kept until every device has got them)
+        ServiceScheduler *scheduler = new ServiceScheduler(devices, loop);
+        for (int i = 0; i < servicesCount; i++)
+                scheduler->addService(services[i]);
+        notificationEventSink->setQueuedHandler([scheduler, alertNotificationService]()
         {
-                // check message queue for ten seconds at most
-                for (int i = 0; i < 10; i++)
-                {
-                        bool pendingMessages = sessionBusWatcher->checkQueue(1);
-                        if (_shutdown || pendingMessages)
-                                break;
-                }
-                if (_shutdown)
-                        break;
+                alertNotificationService->journalNotifications();
+                scheduler->trigger(GattService::TriggerNotificationQueued);
+        });
+        notificationEventSink->setIdHandler([alertNotificationService](uint64_t sequence, int id)
+        {
+                alertNotificationService->assignId(sequence, id);
+        });
+        notificationEventSink->setClosedHandler([alertNotificationService](int id)
+        {
+                alertNotificationService->closeNotification(id);
+        });
+        devices->setReadyHandler([scheduler](ManagedDevice *device)
+        {
+                scheduler->trigger(GattService::TriggerDeviceReady, device);
+        });
+
+        // the adapters and connections are checked regularly
+        int maintenanceTimer = loop->addTimer(0, MAINTENANCE_INTERVAL, [&]()
+        {
+                if (loop->quitting())
+                        return;
+
+                // controllers may be plugged in (again) later, the attached ones are skipped
+                devices->attachAdapters();
 
-                // the bluetooth adapter has to be powered on
-                if (bluezAdapter->powered())
+                // at least one bluetooth adapter has to be powered on
+                if (devices->anyAdapterPowered())
                 {
-                        // find and connect devices
-                        if (devices->allManagedDevicesConnected())
-                                LOG_VERBOSE("All managed devices are connected, skipping scan.");
-                        else
-                        {
-                                // start the scan
-                                if (devices->startScan())
-                                {
-                                        // while waiting for the scan to complete, check the message queue
-                                        for (int i = 0; i < 4; i++)
-                                        {
-                                                bool pendingMessages = sessionBusWatcher->checkQueue(1);
-                                                if (_shutdown || pendingMessages)
-                                                        break;
-                                        }
-
-                                        // stop scan and connect devices
-                                        if (devices->stopScan() && !_shutdown)
-                                                devices->connectDiscoveredManagedDevices();
-                                }
-                        }
-                        if (_shutdown)
-                                break;
-
-                        // run the services
-                        for (int i = 0; i < servicesCount; i++)
-                        {
-                                devices->runService(services[i]);
-                                if (_shutdown)
-                                        break;
-                        }
+                        // keep scanning while there are devices to be found
+                        devices->updateScan();
 
-                        // the AlertNotification service should have sent all pending alerts
-                        notificationEventSink->clearNotificationQueue();
+                        // notification streams have to be set up again after reconnects (the strands do that in the
+                        // background, a renewal which hasn't finished yet is left alone)
+                        devices->renewSubscriptions([](int renewed)
+                        {
+                                if (renewed > 0)
+                                        LOG_VERBOSE("Renewed %d subscriptions.", renewed);
+                        });
                 }
                 else
-                        LOG_VERBOSE("Bluetooth adapter is powered off.");
-        }
+                        LOG_VERBOSE("All Bluetooth adapters are powered off.");
+        });
+
+        // enter the daemon's main loop (everything is dispatched as soon as it arrives)
+        LOG_DEBUG("Entering main loop.");
+        loop->run();
         LOG_DEBUG("Exited main loop.");
 
         // clean up
+        loop->removeTimer(maintenanceTimer);
+        notificationEventSink->setQueuedHandler(nullptr);
+        devices->setReadyHandler(nullptr);
+        delete scheduler;
         delete devices;
         for (int i = 0; i < servicesCount; i++)
                 delete services[i];
-        delete bluezAdapter;
+        delete systemBus;
         delete sessionBusWatcher;
         delete notificationEventSink;
+        delete loop;
 
         // done
         LOG_INFO("Exiting.");
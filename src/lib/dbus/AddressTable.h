@@ -0,0 +1,160 @@
+/*
+ *
+ *  AddressTable - An open addressing hash table keyed by Bluetooth device addresses
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef ADDRESSTABLE_H
+#define ADDRESSTABLE_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "MacAddress.h"
+
+
+
+#define ADDRESS_TABLE_INITIAL_SLOTS   16
+
+
+
+// linear probing over a flat slot array, kept at most half full
+template<typename T> class AddressTable
+{
+public:
+
+        AddressTable() : _count(0) { _slots.resize(ADDRESS_TABLE_INITIAL_SLOTS); }
+
+        int count() const { return _count; }
+        bool empty() const { return (_count == 0); }
+
+        void clear()
+        {
+                for (Slot &slot : _slots)
+                        slot = Slot();
+                _count = 0;
+        }
+
+        T *find(const MacAddress &address)
+        {
+                int index = indexOf(address);
+                return (index >= 0) ? &_slots[index].value : nullptr;
+        }
+
+        const T *find(const MacAddress &address) const
+        {
+                int index = indexOf(address);
+                return (index >= 0) ? &_slots[index].value : nullptr;
+        }
+
+        bool contains(const MacAddress &address) const { return (indexOf(address) >= 0); }
+
+        // replaces the value if the address is already known
+        bool insert(const MacAddress &address, const T &value)
+        {
+                // guard
+                if (!address.isValid())
+                        return false;
+
+                if ((_count + 1) * 2 > static_cast<int>(_slots.size()))
+                        grow();
+                size_t mask = _slots.size() - 1;
+                size_t index = address.hash() & mask;
+                while (_slots[index].used && (_slots[index].address != address))
+                        index = (index + 1) & mask;
+                if (!_slots[index].used)
+                        _count++;
+                _slots[index].used = true;
+                _slots[index].address = address;
+                _slots[index].value = value;
+                return true;
+        }
+
+        bool erase(const MacAddress &address)
+        {
+                int found = indexOf(address);
+                if (found < 0)
+                        return false;
+
+                // shift the following entries of the probe sequence back, so no tombstones are needed
+                size_t mask = _slots.size() - 1;
+                size_t hole = static_cast<size_t>(found);
+                size_t index = (hole + 1) & mask;
+                while (_slots[index].used)
+                {
+                        size_t home = _slots[index].address.hash() & mask;
+                        if (((index - home) & mask) >= ((index - hole) & mask))
+                        {
+                                _slots[hole] = _slots[index];
+                                hole = index;
+                        }
+                        index = (index + 1) & mask;
+                }
+                _slots[hole] = Slot();
+                _count--;
+                return true;
+        }
+
+private:
+
+        struct Slot
+        {
+        public:
+                Slot() : used(false), value() {}
+                bool used;
+                MacAddress address;
+                T value;
+        };
+
+        std::vector<Slot> _slots;   // the size is always a power of two
+        int _count;
+
+        int indexOf(const MacAddress &address) const
+        {
+                if (!address.isValid())
+                        return -1;
+                size_t mask = _slots.size() - 1;
+                size_t index = address.hash() & mask;
+                while (_slots[index].used)
+                {
+                        if (_slots[index].address == address)
+                                return static_cast<int>(index);
+                        index = (index + 1) & mask;
+                }
+                return -1;
+        }
+
+        void grow()
+        {
+                std::vector<Slot> oldSlots;
+                oldSlots.swap(_slots);
+                _slots.resize(oldSlots.size() * 2);
+                _count = 0;
+                for (const Slot &slot : oldSlots)
+                {
+                        if (slot.used)
+                                insert(slot.address, slot.value);
+                }
+        }
+};
+
+#endif // ADDRESSTABLE_H
@@ -25,15 +25,51 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <dbus/dbus.h>
 
 #include "Logger.h"
+#include "DBusMarshal.h"
 
 
 
 #define DEVICE_ADDRESS_LENGTH   17
 #define MAX_PATH_LENGTH         256
-#define DEFAULT_TIMEOUT         4000
+
+// default timeouts of the operation classes (in milliseconds)
+#define CONNECT_TIMEOUT         4000
+#define DISCONNECT_TIMEOUT      5000
+#define PROPERTY_TIMEOUT        2000
+#define METHOD_TIMEOUT          4000
+#define GATT_TIMEOUT            4000
+
+
+
+static inline int timeoutOrDefault(int timeout, int defaultTimeout)
+{
+        // a timeout of zero or less selects the default of the operation's class
+        return (timeout > 0) ? timeout : defaultTimeout;
+}
+
+#define MAX_PENDING_CALLS_PER_DEVICE   4
+#define MAX_BYPASSED_CALLS             8    // urgent calls sent before a waiting class gets its turn
+
+#define COMMAND_WRITE_CREDITS          4
+#define COMMAND_SYNC_INTERVAL          16
+#define DEFAULT_ATT_MTU                23
+
+#define MAX_QUERY_TEMPLATES            256
+
+
+
+// the class of the asynchronous calls started by the current thread
+static thread_local BluezAdapter::CallPriority currentCallPriority = BluezAdapter::PriorityStateSync;
 
 
 
@@ -43,6 +79,7 @@ void BluezAdapter::DeviceInfo::setAddress(const char *value)
                 _address = value;
         else
                 _address.clear();
+        _mac = MacAddress::parse(value);
 }
 
 
@@ -56,11 +93,16 @@ void BluezAdapter::DeviceInfo::setName(const char *value)
 
 
 
-BluezAdapter::BluezAdapter(const char *hci)
+BluezAdapter::BluezAdapter(const char *hci, DBusConnection *connection)
 {
         // initialize
-        _timeout = DEFAULT_TIMEOUT;
         _discoveredDevices.clear();
+        _deviceListener = nullptr;
+        _objects.setListener(this);
+        _queuedCallsCount = 0;
+        _dispatchThread = std::this_thread::get_id();
+        _loop = nullptr;
+        _wakeupFd = -1;
 
         // copy adapter name
         if (hci)
@@ -68,7 +110,23 @@ BluezAdapter::BluezAdapter(const char *hci)
         else
                 _hci = "hci0";
 
-        // open DBus connection
+        // only the signals about the adapter's own objects are routed to its connection (the object manager
+        // signals are emitted on the root path, so they're matched by the object path in their first argument,
+        // once for the adapter itself and once for everything below it)
+        std::string adapterPath = "/org/bluez/" + _hci;
+        _matches.push_back("type='signal',sender='org.bluez',interface='org.freedesktop.DBus.ObjectManager',arg0path='" + adapterPath + "'");
+        _matches.push_back("type='signal',sender='org.bluez',interface='org.freedesktop.DBus.ObjectManager',arg0path='" + adapterPath + "/'");
+        _matches.push_back("type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',path_namespace='" + adapterPath + "'");
+        _matches.push_back("type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.bluez'");
+
+        // use the given (private) connection
+        if (connection)
+        {
+                _connection = dbus_connection_ref(connection);
+                return;
+        }
+
+        // otherwise fall back to the shared system bus connection
         DBusError dbusError;
         dbus_error_init(&dbusError);
         _connection = dbus_bus_get(DBUS_BUS_SYSTEM, &dbusError);
@@ -90,51 +148,364 @@ BluezAdapter::BluezAdapter(const char *hci)
 
 BluezAdapter::~BluezAdapter()
 {
+        // the loop mustn't watch anything which is about to go away
+        detach();
+
+        // drop all asynchronous calls without notifying anyone
+        for (PendingCall *call : _callsInFlight)
+        {
+                dbus_pending_call_cancel(call->pending);
+                dbus_pending_call_unref(call->pending);
+                delete call;
+        }
+        _callsInFlight.clear();
+        for (std::pair<const std::string, CallLane> &lane : _callLanes)
+        {
+                for (int i = 0; i < CALL_PRIORITIES; i++)
+                {
+                        for (PendingCall *call : lane.second.queued[i])
+                        {
+                                dbus_message_unref(call->query);
+                                delete call;
+                        }
+                }
+        }
+        _callLanes.clear();
+        if (_connection)
+                dbus_connection_unref(_connection);
+
+        // unfinished command transfers fail (a synchronous writer may still be waiting for them)
+        for (CommandTransfer *transfer : _commandTransfers)
+        {
+                if (transfer->callback)
+                        transfer->callback(false);
+                delete transfer;
+        }
+        _commandTransfers.clear();
+
+        // closing the sockets stops the notifications
+        for (GattNotificationStream *stream : _notificationStreams)
+                delete stream;
+        _notificationStreams.clear();
+        for (std::pair<const std::string, GattWriteStream *> &entry : _writeStreams)
+                delete entry.second;
+        _writeStreams.clear();
+
+        clearQueryTemplates();
         clearDiscoveredDevicesList();
 }
 
 
+void BluezAdapter::attach(EventLoop *loop)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // guards
+        if (!loop || !_connection)
+                return;
+        if (_loop)
+                detach();
+
+        // the loop dispatches the connection and reads the notification sockets as soon as they're ready
+        _loop = loop;
+        _loop->addConnection(_connection);
+        for (GattNotificationStream *stream : _notificationStreams)
+                watchNotificationStream(stream);
+
+        // asynchronous calls queued by other threads are sent as soon as the loop has been woken up
+        _wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_wakeupFd < 0)
+        {
+                LOG_ERROR("Couldn't create wakeup event for adapter %s.", _hci.c_str());
+                return;
+        }
+        int fd = _wakeupFd;
+        _loop->addFd(fd, EPOLLIN, [this, fd](uint32_t events)
+        {
+                (void)events;
+                uint64_t count;
+                ssize_t length = read(fd, &count, sizeof(count));
+                (void)length;
+                startQueuedCalls();
+        });
+}
+
+
+void BluezAdapter::detach()
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // guard
+        if (!_loop)
+                return;
+
+        // stop watching everything
+        for (GattNotificationStream *stream : _notificationStreams)
+        {
+                if (stream->acquired())
+                        _loop->removeFd(stream->fd());
+        }
+        if (_wakeupFd >= 0)
+        {
+                _loop->removeFd(_wakeupFd);
+                close(_wakeupFd);
+                _wakeupFd = -1;
+        }
+        _loop->removeConnection(_connection);
+        _loop = nullptr;
+}
+
+
+int BluezAdapter::findAdapters(DBusConnection *connection, std::vector<std::string> &hcis)
+{
+        // guard
+        hcis.clear();
+        if (!connection)
+                return 0;
+
+        // take a snapshot of Bluez' objects
+        BluezObjectCache objects;
+        if (!objects.seed(connection, PROPERTY_TIMEOUT))
+                return 0;
+
+        // every object implementing the Adapter1 interface is a Bluetooth controller
+        const BluezObjectCache::Objects &tree = objects.objects();
+        for (BluezObjectCache::Objects::const_iterator it = tree.begin(); it != tree.end(); ++it)
+        {
+                if (it->second.find("org.bluez.Adapter1") == it->second.end())
+                        continue;
+                size_t slash = it->first.rfind('/');
+                hcis.push_back(it->first.substr(slash + 1));
+        }
+        return static_cast<int>(hcis.size());
+}
+
+
+void BluezAdapter::setCallPriority(CallPriority priority)
+{
+        currentCallPriority = priority;
+}
+
+
+BluezAdapter::CallPriority BluezAdapter::callPriority()
+{
+        return currentCallPriority;
+}
+
+
+int BluezAdapter::matchesCount() const
+{
+        return static_cast<int>(_matches.size());
+}
+
+
+const char *BluezAdapter::match(int index) const
+{
+        if ((index >= 0) && (index < static_cast<int>(_matches.size())))
+                return _matches[index].c_str();
+        return nullptr;
+}
+
+
+void BluezAdapter::inspectMessage(DBusMessage *message)
+{
+        // a restarted Bluez daemon comes with a new object tree
+        if (isSignal(message, "org.freedesktop.DBus", "NameOwnerChanged"))
+        {
+                bluezOwnerChanged(message);
+                return;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // the object cache calls back for the changes which are of interest
+        _objects.inspectMessage(message);
+}
+
+
+void BluezAdapter::bluezOwnerChanged(DBusMessage *message)
+{
+        // only Bluez' name is of interest
+        const char *name = nullptr;
+        const char *oldOwner = nullptr;
+        const char *newOwner = nullptr;
+        if (!dbus_message_get_args(message, nullptr, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID))
+                return;
+        if (strcmp(name, "org.bluez") != 0)
+                return;
+
+        // everything which has been mirrored from the previous instance is stale, and its sockets are dead
+        {
+                std::lock_guard<std::recursive_mutex> lock(_mutex);
+                if (*oldOwner)
+                        LOG_WARNING("Bluez has left the system bus, dropping the objects mirrored on %s.", _hci.c_str());
+                _objects.clear();
+                _characteristicIndexes.clear();
+                clearDiscoveredDevicesList();
+                std::string adapterPath = "/org/bluez/";
+                adapterPath.append(_hci);
+                closeStreams(adapterPath.c_str());
+        }
+
+        // the new instance is mirrored without holding up the dispatcher, the objects it exports after
+        // the reply has been sent arrive as signals
+        if (*newOwner)
+        {
+                LOG_INFO("Bluez has appeared on the system bus, mirroring its objects on %s again.", _hci.c_str());
+                reseedObjects();
+        }
+}
+
+
+void BluezAdapter::reseedObjects()
+{
+        DBusMessage *query = BluezObjectCache::createObjectsQuery();
+        if (!query)
+                return;
+        sendAsync(query, PROPERTY_TIMEOUT, [this](DBusMessage *reply)
+        {
+                // otherwise the next lookup seeds the cache
+                if (!reply)
+                        return;
+
+                // a lookup by another thread may have been quicker
+                std::lock_guard<std::recursive_mutex> lock(_mutex);
+                if (!_objects.seeded())
+                        _objects.seed(reply);
+                clearDiscoveredDevicesList();
+                listDiscoveredDevices();
+        });
+}
+
+
 bool BluezAdapter::powered()
 {
+        if (!ensureObjectsSeeded())
+                return false;
+
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
         char path[MAX_PATH_LENGTH];
         snprintf(path, MAX_PATH_LENGTH, "/org/bluez/%s", _hci.c_str());
-        return readBooleanProperty(path, "org.bluez.Adapter1", "Powered");
+        return _objects.booleanProperty(path, "org.bluez.Adapter1", "Powered");
 }
 
 
 bool BluezAdapter::isDiscovering()
 {
+        if (!ensureObjectsSeeded())
+                return false;
+
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
         char path[MAX_PATH_LENGTH];
         snprintf(path, MAX_PATH_LENGTH, "/org/bluez/%s", _hci.c_str());
-        return readBooleanProperty(path, "org.bluez.Adapter1", "Discovering");
+        return _objects.booleanProperty(path, "org.bluez.Adapter1", "Discovering");
 }
 
 
-bool BluezAdapter::startDiscovery()
+bool BluezAdapter::setDiscoveryFilter(const DiscoveryFilter &filter, int timeout)
 {
-        // call the adapter's StartDiscovery method
+        // guard
+        if (!_connection)
+                return false;
+
+        // create the query message
         char path[MAX_PATH_LENGTH];
         snprintf(path, MAX_PATH_LENGTH, "/org/bluez/%s", _hci.c_str());
-        return callMethod(path, "org.bluez.Adapter1", "StartDiscovery");
+        DBusMessage *query = dbus_message_new_method_call("org.bluez", path, "org.bluez.Adapter1", "SetDiscoveryFilter");
+        if (!query)
+        {
+                LOG_ERROR("Couldn't allocate memory for the query message.");
+                return false;
+        }
+
+        // the filter is passed as a String->Variant dictionary
+        DBusMessageIter paramsIter;
+        dbus_message_iter_init_append(query, &paramsIter);
+        DBusDictWriter options(&paramsIter);
+        options.add("Transport", filter.transport.c_str());
+        options.add("DuplicateData", filter.duplicateData);
+        if (filter.rssiThreshold != 0)
+                options.add("RSSI", static_cast<int16_t>(filter.rssiThreshold));
+        if (!filter.uuids.empty())
+        {
+                std::vector<std::string> texts;
+                for (const Uuid &uuid : filter.uuids)
+                        texts.push_back(uuid.toString());
+                std::vector<const char *> uuids;
+                for (const std::string &text : texts)
+                        uuids.push_back(text.c_str());
+                options.addArray("UUIDs", uuids);
+        }
+        options.close();
+
+        // send the query and wait for the reply
+        DBusError dbusError;
+        dbus_error_init(&dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeoutOrDefault(timeout, METHOD_TIMEOUT), &dbusError);
+        dbus_message_unref(query);
+        if (dbus_error_is_set(&dbusError))
+        {
+                LOG_ERROR("Couldn't set discovery filter: %s", dbusError.message);
+                dbus_error_free(&dbusError);
+                return false;
+        }
+        dbus_message_unref(reply);
+        return true;
+}
+
+
+void BluezAdapter::addAddressFilter(const char *address)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // guard
+        if (!isValidAddress(address))
+                return;
+
+        // addresses are compared in their packed form
+        _addressFilter.insert(MacAddress::parse(address), true);
+
+        // devices which don't pass the filter anymore are dropped
+        for (int i = static_cast<int>(_discoveredDevices.size()) - 1; i >= 0; i--)
+        {
+                if (!passesAddressFilter(_discoveredDevices[i]->mac()))
+                        removeDiscoveredDeviceAt(i);
+        }
 }
 
 
-bool BluezAdapter::stopDiscovery()
+void BluezAdapter::clearAddressFilter()
 {
-        // call the adapter's StopDiscovery method
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        _addressFilter.clear();
+}
+
+
+bool BluezAdapter::startDiscovery(int timeout)
+{
+        // call the adapter's StartDiscovery method
         char path[MAX_PATH_LENGTH];
         snprintf(path, MAX_PATH_LENGTH, "/org/bluez/%s", _hci.c_str());
-        if (!callMethod(path, "org.bluez.Adapter1", "StopDiscovery"))
-                return false;
+        return callMethod(path, "org.bluez.Adapter1", "StartDiscovery", timeoutOrDefault(timeout, METHOD_TIMEOUT));
+}
 
-        // update the list of discovered devices
-        updateDiscoveredDevicesList();
-        return true;
+
+bool BluezAdapter::stopDiscovery(int timeout)
+{
+        // call the adapter's StopDiscovery method (the list of discovered devices is kept up to date by signals)
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, MAX_PATH_LENGTH, "/org/bluez/%s", _hci.c_str());
+        return callMethod(path, "org.bluez.Adapter1", "StopDiscovery", timeoutOrDefault(timeout, METHOD_TIMEOUT));
 }
 
 
 const BluezAdapter::DeviceInfo *BluezAdapter::discoveredDeviceAt(int index) const
 {
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
         if ((index >= 0) && (index < static_cast<int>(_discoveredDevices.size())))
                 return static_cast<const DeviceInfo*>(_discoveredDevices[index]);
         else
@@ -142,6 +513,38 @@ const BluezAdapter::DeviceInfo *BluezAdapter::discoveredDeviceAt(int index) cons
 }
 
 
+const BluezAdapter::DeviceInfo *BluezAdapter::discoveredDevice(const char *address) const
+{
+        return discoveredDevice(MacAddress::parse(address));
+}
+
+
+const BluezAdapter::DeviceInfo *BluezAdapter::discoveredDevice(const MacAddress &address) const
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        int index = indexOfDiscoveredDevice(address);
+        if (index >= 0)
+                return _discoveredDevices[index];
+        return nullptr;
+}
+
+
+bool BluezAdapter::knowsDevice(const char *address)
+{
+        // guard
+        if (!isValidAddress(address))
+                return false;
+
+        // Bluez keeps an object for every device it has seen through this adapter
+        if (!ensureObjectsSeeded())
+                return false;
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        std::string path = getDevicePath(address);
+        return (_objects.properties(path.c_str(), "org.bluez.Device1") != nullptr);
+}
+
+
 bool BluezAdapter::isDeviceConnected(const char *address)
 {
         // guard
@@ -151,13 +554,16 @@ bool BluezAdapter::isDeviceConnected(const char *address)
                 return false;
         }
 
-        // read the device's Connect property
+        // get the device's Connected property from the cache
+        if (!ensureObjectsSeeded())
+                return false;
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
         std::string path = getDevicePath(address);
-        return readBooleanProperty(path.c_str(), "org.bluez.Device1", "Connected", false);
+        return _objects.booleanProperty(path.c_str(), "org.bluez.Device1", "Connected");
 }
 
 
-bool BluezAdapter::connectDevice(const char *address, bool verify)
+bool BluezAdapter::connectDevice(const char *address, bool verify, int timeout)
 {
         // guard
         if (!isValidAddress(address))
@@ -166,20 +572,24 @@ bool BluezAdapter::connectDevice(const char *address, bool verify)
                 return false;
         }
 
-        // call the device's Connect method
+        // call the device's Connect method (the verification has to fit into the same time frame)
+        int64_t deadline = monotonicMillis() + timeoutOrDefault(timeout, CONNECT_TIMEOUT);
         std::string path = getDevicePath(address);
-        if (!callMethod(path.c_str(), "org.bluez.Device1", "Connect"))
+        if (!callMethod(path.c_str(), "org.bluez.Device1", "Connect", remainingMillis(deadline)))
                 return false;
 
-        // verify that the Connected property is true
+        // the characteristics have to be looked up again for the new connection
+        invalidateCharacteristicIndex(address);
+
+        // verify that the Connected property is true (the cache may not have received the change yet)
         if (verify)
-                return isDeviceConnected(address);
+                return readBooleanProperty(path.c_str(), "org.bluez.Device1", "Connected", remainingMillis(deadline), false);
         else
                 return true;
 }
 
 
-bool BluezAdapter::disconnectDevice(const char *address, bool verify)
+bool BluezAdapter::disconnectDevice(const char *address, bool verify, int timeout)
 {
         // guard
         if (!isValidAddress(address))
@@ -188,20 +598,22 @@ bool BluezAdapter::disconnectDevice(const char *address, bool verify)
                 return false;
         }
 
-        // call the device's Disconnect method
+        // call the device's Disconnect method (the verification has to fit into the same time frame)
+        int64_t deadline = monotonicMillis() + timeoutOrDefault(timeout, DISCONNECT_TIMEOUT);
         std::string path = getDevicePath(address);
-        if (!callMethod(path.c_str(), "org.bluez.Device1", "Disconnect"))
+        if (!callMethod(path.c_str(), "org.bluez.Device1", "Disconnect", remainingMillis(deadline)))
                 return false;
+        invalidateCharacteristicIndex(address);
 
-        // verify that the Connected property is true
+        // verify that the Connected property is false (the cache may not have received the change yet)
         if (verify)
-                return !isDeviceConnected(address);
+                return !readBooleanProperty(path.c_str(), "org.bluez.Device1", "Connected", remainingMillis(deadline), false);
         else
                 return true;
 }
 
 
-bool BluezAdapter::removeDevice(const char *address)
+bool BluezAdapter::removeDevice(const char *address, int timeout)
 {
         // guards
         if (!_connection)
@@ -212,22 +624,15 @@ bool BluezAdapter::removeDevice(const char *address)
                 return false;
         }
 
-        std::string path = "/org/bluez/";
-        path.append(_hci);
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", path.c_str(), "org.bluez.Adapter1", "RemoveDevice");
+        // prepare the query message
+        DBusMessage *query = createRemoveDeviceQuery(address);
         if (!query)
-        {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
                 return false;
-        }
-
-        std::string devicePath = getDevicePath(address);
-        const char *constDevicePath = devicePath.c_str();
-        dbus_message_append_args(query, DBUS_TYPE_OBJECT_PATH, &constDevicePath, DBUS_TYPE_INVALID);
 
+        // send the query and wait for the reply
         DBusError dbusError;
         dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeoutOrDefault(timeout, METHOD_TIMEOUT), &dbusError);
         dbus_message_unref(query);
         if (dbus_error_is_set(&dbusError))
         {
@@ -240,71 +645,38 @@ bool BluezAdapter::removeDevice(const char *address)
 }
 
 
-char *BluezAdapter::findCharacteristicPath(const char *deviceAddress, const char *charUUID)
+std::string BluezAdapter::findCharacteristicPath(const char *deviceAddress, const Uuid &charUuid)
 {
         // guards
-        if (!_connection)
-                return nullptr;
+        if (!_connection || charUuid.isNull())
+                return std::string();
         if (!isValidAddress(deviceAddress))
         {
                 LOG_DEBUG("Invalid device address.");
-                return nullptr;
-        }
-
-        // prepare the query message
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
-        if (!query)
-        {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
-                return nullptr;
-        }
-
-        // send the query and wait for the reply
-        DBusError dbusError;
-        dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
-        dbus_message_unref(query);
-        if (dbus_error_is_set(&dbusError))
-        {
-                LOG_ERROR("Couldn't execute command: %s", dbusError.message);
-                dbus_error_free(&dbusError);
-                return nullptr;
+                return std::string();
         }
 
-        // get the device's path
+        // the device's characteristics are indexed once per connection
+        if (!ensureObjectsSeeded())
+                return std::string();
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
         std::string devicePath = getDevicePath(deviceAddress);
+        CharacteristicIndex &index = _characteristicIndexes[devicePath];
+        if (!index.populated)
+                populateCharacteristicIndex(devicePath.c_str(), &index);
 
-        // go through the returned data
-        DBusMessageIter objArrayIter;
-        dbus_message_iter_init(reply, &objArrayIter);
-        if (dbus_message_iter_get_arg_type(&objArrayIter) == DBUS_TYPE_ARRAY)
+        // look up the characteristic (unknown UUIDs are remembered as missing)
+        std::unordered_map<Uuid, std::string, UuidHash>::const_iterator it = index.paths.find(charUuid);
+        if (it == index.paths.end())
         {
-                DBusMessageIter objIter;
-                dbus_message_iter_recurse(&objArrayIter, &objIter);
-                while (true)
-                {
-                        const char *result = findCharacteristicPath_object(&objIter, devicePath.c_str(), charUUID);
-                        if (result)
-                        {
-                                // copy the result to a new buffer
-                                size_t resultLength = strlen(result) + 1;
-                                char *resultBuffer = new char[resultLength];
-                                strncpy(resultBuffer, result, resultLength);
-
-                                // free the reply's ressources and return the new buffer
-                                dbus_message_unref(reply);
-                                return resultBuffer;
-                        }
-                        if (!dbus_message_iter_next(&objIter))
-                                break;
-                }
+                index.paths[charUuid] = std::string();
+                return std::string();
         }
-        dbus_message_unref(reply);
-        return nullptr;
+        return it->second;
 }
 
 
-int BluezAdapter::readCharacteristic(const char *charPath, uint8_t *buffer, int bufferSize)
+int BluezAdapter::readCharacteristic(const char *charPath, uint8_t *buffer, int bufferSize, uint16_t offset, int timeout)
 {
         // guards
         if (!_connection)
@@ -313,26 +685,14 @@ int BluezAdapter::readCharacteristic(const char *charPath, uint8_t *buffer, int
                 return -1;
 
         // prepare the query message
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", charPath, "org.bluez.GattCharacteristic1", "ReadValue");
+        DBusMessage *query = createReadCharacteristicQuery(charPath, offset);
         if (!query)
-        {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
                 return -1;
-        }
-
-        // we need an initial iterator for the query's parameters
-        DBusMessageIter paramsIter;
-        dbus_message_iter_init_append(query, &paramsIter);
-
-        // add an empty String->Variant dictionary container (options parameter)
-        DBusMessageIter dictIter;
-        dbus_message_iter_open_container(&paramsIter, DBUS_TYPE_ARRAY, "{sv}", &dictIter);
-        dbus_message_iter_close_container(&paramsIter, &dictIter);
 
         // send the query and wait for the reply
         DBusError dbusError;
         dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeoutOrDefault(timeout, GATT_TIMEOUT), &dbusError);
         dbus_message_unref(query);
         if (dbus_error_is_set(&dbusError))
         {
@@ -342,34 +702,15 @@ int BluezAdapter::readCharacteristic(const char *charPath, uint8_t *buffer, int
         }
 
         // copy the returned byte array to the buffer
-        int copiedBytes = 0;
-        DBusMessageIter byteArrayIter;
-        dbus_message_iter_init(reply, &byteArrayIter);
-        if (dbus_message_iter_get_arg_type(&byteArrayIter) == DBUS_TYPE_ARRAY)
+        const uint8_t *data = nullptr;
+        int copiedBytes = getByteArray(reply, &data);
+        if (copiedBytes > bufferSize)
         {
-                DBusMessageIter byteIter;
-                dbus_message_iter_recurse(&byteArrayIter, &byteIter);
-                while (true)
-                {
-                        if (dbus_message_iter_get_arg_type(&byteIter) == DBUS_TYPE_BYTE)
-                        {
-                                dbus_uint32_t value;
-                                dbus_message_iter_get_basic(&byteIter, &value);
-                                if (copiedBytes < bufferSize)
-                                {
-                                        buffer[copiedBytes] = static_cast<uint8_t>(value);
-                                        copiedBytes++;
-                                }
-                                else
-                                {
-                                        LOG_WARNING("Buffer too small to contain all returned bytes.");
-                                        break;
-                                }
-                        }
-                        if (!dbus_message_iter_next(&byteIter))
-                                break;
-                }
+                LOG_WARNING("Buffer too small to contain all returned bytes.");
+                copiedBytes = bufferSize;
         }
+        if (copiedBytes > 0)
+                memcpy(buffer, data, copiedBytes);
 
         // done
         dbus_message_unref(reply);
@@ -378,7 +719,7 @@ int BluezAdapter::readCharacteristic(const char *charPath, uint8_t *buffer, int
 }
 
 
-bool BluezAdapter::writeCharacteristic(const char *charPath, uint8_t *buffer, int length)
+bool BluezAdapter::writeCharacteristic(const char *charPath, const uint8_t *buffer, int length, uint16_t offset, int timeout)
 {
         // guards
         if (!_connection)
@@ -387,36 +728,14 @@ bool BluezAdapter::writeCharacteristic(const char *charPath, uint8_t *buffer, in
                 return false;
 
         // prepare the query message
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", charPath, "org.bluez.GattCharacteristic1", "WriteValue");
+        DBusMessage *query = createWriteCharacteristicQuery(charPath, buffer, length, offset);
         if (!query)
-        {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
                 return false;
-        }
-
-        // we need an initial iterator for the query's parameters
-        DBusMessageIter paramsIter;
-        dbus_message_iter_init_append(query, &paramsIter);
-
-        // copy the buffer bytes into a byte array container parameter
-        DBusMessageIter arrayIter;
-        dbus_message_iter_open_container(&paramsIter, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &arrayIter);
-        for (int i = 0; i < length; i++)
-        {
-                dbus_uint32_t value = static_cast<dbus_uint32_t>(buffer[i]);
-                dbus_message_iter_append_basic(&arrayIter, DBUS_TYPE_BYTE, &value);
-        }
-        dbus_message_iter_close_container(&paramsIter, &arrayIter);
-
-        // add an empty String->Variant dictionary container (options parameter)
-        DBusMessageIter dictIter;
-        dbus_message_iter_open_container(&paramsIter, DBUS_TYPE_ARRAY, "{sv}", &dictIter);
-        dbus_message_iter_close_container(&paramsIter, &dictIter);
 
         // send the query and wait for the reply
         DBusError dbusError;
         dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeoutOrDefault(timeout, GATT_TIMEOUT), &dbusError);
         dbus_message_unref(query);
         if (dbus_error_is_set(&dbusError))
         {
@@ -432,6 +751,376 @@ bool BluezAdapter::writeCharacteristic(const char *charPath, uint8_t *buffer, in
 }
 
 
+bool BluezAdapter::connectDeviceAsync(const char *address, ResultCallback callback, int timeout)
+{
+        // guard
+        if (!isValidAddress(address))
+        {
+                LOG_DEBUG("Invalid device address.");
+                return false;
+        }
+
+        // call the device's Connect method
+        std::string path = getDevicePath(address);
+        std::string addressCopy = address;
+        return callMethodAsync(path.c_str(), "org.bluez.Device1", "Connect", [this, callback, addressCopy](bool success)
+        {
+                // the characteristics have to be looked up again for the new connection
+                if (success)
+                        invalidateCharacteristicIndex(addressCopy.c_str());
+                if (callback)
+                        callback(success);
+        }, timeoutOrDefault(timeout, CONNECT_TIMEOUT));
+}
+
+
+bool BluezAdapter::callMethodAsync(const char *path, const char *interface, const char *method, ResultCallback callback, int timeout)
+{
+        // guard
+        if (!_connection)
+                return false;
+
+        // create the query message
+        DBusMessage *query = createMethodQuery(path, interface, method);
+        if (!query)
+                return false;
+
+        // send it
+        return sendAsync(query, timeoutOrDefault(timeout, METHOD_TIMEOUT), [callback](DBusMessage *reply)
+        {
+                if (callback)
+                        callback(reply != nullptr);
+        });
+}
+
+
+bool BluezAdapter::readBooleanPropertyAsync(const char *path, const char *interface, const char *propName, BooleanCallback callback, int timeout)
+{
+        // guard
+        if (!_connection)
+                return false;
+
+        // create the query message
+        DBusMessage *query = createPropertyQuery(path, interface, propName);
+        if (!query)
+                return false;
+
+        // send it and extract the property's value from the reply's Variant container
+        return sendAsync(query, timeoutOrDefault(timeout, PROPERTY_TIMEOUT), [this, callback](DBusMessage *reply)
+        {
+                if (!callback)
+                        return;
+                if (!reply)
+                {
+                        callback(false, false);
+                        return;
+                }
+                DBusMessageIter varIter;
+                dbus_message_iter_init(reply, &varIter);
+                callback(true, getBooleanFromVariant(&varIter));
+        });
+}
+
+
+bool BluezAdapter::removeDeviceAsync(const char *address, ResultCallback callback, int timeout)
+{
+        // guards
+        if (!_connection)
+                return false;
+        if (!isValidAddress(address))
+        {
+                LOG_DEBUG("Invalid device address.");
+                return false;
+        }
+
+        // create the query message
+        DBusMessage *query = createRemoveDeviceQuery(address);
+        if (!query)
+                return false;
+
+        // send it
+        return sendAsync(query, timeoutOrDefault(timeout, METHOD_TIMEOUT), [callback](DBusMessage *reply)
+        {
+                if (callback)
+                        callback(reply != nullptr);
+        });
+}
+
+
+bool BluezAdapter::readCharacteristicAsync(const char *charPath, ReadCallback callback, uint16_t offset, int timeout)
+{
+        // guard
+        if (!_connection)
+                return false;
+
+        // create the query message
+        DBusMessage *query = createReadCharacteristicQuery(charPath, offset);
+        if (!query)
+                return false;
+
+        // send it and hand the returned bytes to the callback (they're valid while the reply exists)
+        std::string path = charPath;
+        return sendAsync(query, timeoutOrDefault(timeout, GATT_TIMEOUT), [this, callback, path](DBusMessage *reply)
+        {
+                if (!callback)
+                        return;
+                if (!reply)
+                {
+                        callback(false, nullptr, 0);
+                        return;
+                }
+                const uint8_t *data = nullptr;
+                int length = getByteArray(reply, &data);
+                LOG_DEBUG("Read %d bytes from characteristic %s.", length, path.c_str());
+                callback(true, data, length);
+        });
+}
+
+
+bool BluezAdapter::writeCharacteristicAsync(const char *charPath, const uint8_t *buffer, int length, ResultCallback callback, uint16_t offset, int timeout)
+{
+        // guards
+        if (!_connection)
+                return false;
+        if (!buffer || (length < 0))
+                return false;
+
+        // create the query message (the data is copied right away)
+        DBusMessage *query = createWriteCharacteristicQuery(charPath, buffer, length, offset);
+        if (!query)
+                return false;
+
+        // send it
+        std::string path = charPath;
+        return sendAsync(query, timeoutOrDefault(timeout, GATT_TIMEOUT), [callback, path, length](DBusMessage *reply)
+        {
+                if (reply)
+                        LOG_DEBUG("Wrote %d bytes to characteristic %s.", length, path.c_str());
+                if (callback)
+                        callback(reply != nullptr);
+        });
+}
+
+
+bool BluezAdapter::writeCharacteristicWithoutResponse(const char *charPath, const uint8_t *buffer, int length, int timeout)
+{
+        // the replies are received by the dispatching thread, which can't wait for them itself
+        if (std::this_thread::get_id() == _dispatchThread)
+                return writeCharacteristic(charPath, buffer, length, 0, timeout);
+
+        // the state is shared with the callback, which may still run after the caller has given up
+        struct Completion
+        {
+        public:
+                Completion() : finished(false), success(false) {}
+                std::mutex mutex;
+                std::condition_variable done;
+                bool finished;
+                bool success;
+        };
+        std::shared_ptr<Completion> completion = std::make_shared<Completion>();
+        bool started = writeCharacteristicWithoutResponseAsync(charPath, buffer, length, [completion](bool success)
+        {
+                std::lock_guard<std::mutex> lock(completion->mutex);
+                completion->finished = true;
+                completion->success = success;
+                completion->done.notify_all();
+        }, timeout);
+        if (!started)
+                return false;
+
+        // every acknowledged chunk may take up to the timeout, and the commands before it have to be answered first
+        int chunks = length / (DEFAULT_ATT_MTU - 3) + 1;
+        int64_t limit = static_cast<int64_t>(timeoutOrDefault(timeout, GATT_TIMEOUT)) * 2 * (chunks / COMMAND_SYNC_INTERVAL + 1);
+        std::unique_lock<std::mutex> lock(completion->mutex);
+        if (!completion->done.wait_for(lock, std::chrono::milliseconds(limit), [&completion]() { return completion->finished; }))
+        {
+                LOG_ERROR("Timed out while writing to characteristic %s without response.", charPath);
+                return false;
+        }
+        return completion->success;
+}
+
+
+bool BluezAdapter::writeCharacteristicWithoutResponseAsync(const char *charPath, const uint8_t *buffer, int length, ResultCallback callback, int timeout)
+{
+        // guards
+        if (!_connection)
+                return false;
+        if (!buffer || (length <= 0))
+                return false;
+
+        // a write command has to fit into a single ATT packet
+        int mtu = DEFAULT_ATT_MTU;
+        if (ensureObjectsSeeded())
+        {
+                std::lock_guard<std::recursive_mutex> lock(_mutex);
+                mtu = _objects.integerProperty(charPath, "org.bluez.GattCharacteristic1", "MTU", DEFAULT_ATT_MTU);
+        }
+        if (mtu < DEFAULT_ATT_MTU)
+                mtu = DEFAULT_ATT_MTU;
+
+        // the data is copied, so the caller's buffer can go away
+        CommandTransfer *transfer = new CommandTransfer();
+        transfer->charPath = charPath;
+        transfer->data.assign(buffer, buffer + length);
+        transfer->chunkSize = mtu - 3;
+        transfer->timeout = timeoutOrDefault(timeout, GATT_TIMEOUT);
+        transfer->offset = 0;
+        transfer->chunksSent = 0;
+        transfer->inFlight = 0;
+        transfer->syncing = false;
+        transfer->failed = false;
+        transfer->pumping = false;
+        transfer->priority = callPriority();
+        transfer->callback = callback;
+
+        // the replies are handled with the lock held, so the first chunks are sent with it as well
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        _commandTransfers.push_back(transfer);
+        return pumpCommandTransfer(transfer);
+}
+
+
+GattNotificationStream *BluezAdapter::subscribeNotifications(const char *charPath, int timeout)
+{
+        // guards
+        if (!_connection)
+                return nullptr;
+        if (!charPath || !*charPath)
+                return nullptr;
+
+        // prefer a socket of our own, so the notifications don't have to pass the DBus daemon
+        GattNotificationStream *stream = nullptr;
+        int fd = -1;
+        int mtu = 0;
+        timeout = timeoutOrDefault(timeout, GATT_TIMEOUT);
+        if (acquireSocket(charPath, "AcquireNotify", timeout, &fd, &mtu))
+        {
+                stream = new GattNotificationStream(charPath, fd, mtu);
+                LOG_DEBUG("Acquired notification socket of characteristic %s (MTU %d).", charPath, mtu);
+        }
+        else
+        {
+                // fall back to the changes of the characteristic's Value property
+                if (!callMethod(charPath, "org.bluez.GattCharacteristic1", "StartNotify", timeout))
+                        return nullptr;
+                stream = new GattNotificationStream(charPath, -1, 0);
+                LOG_DEBUG("Started notifications of characteristic %s.", charPath);
+        }
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        _notificationStreams.push_back(stream);
+        watchNotificationStream(stream);
+        return stream;
+}
+
+
+void BluezAdapter::unsubscribeNotifications(GattNotificationStream *stream)
+{
+        // guard
+        if (!stream)
+                return;
+
+        // forget the stream
+        {
+                std::lock_guard<std::recursive_mutex> lock(_mutex);
+                for (size_t i = 0; i < _notificationStreams.size(); i++)
+                {
+                        if (_notificationStreams[i] == stream)
+                        {
+                                _notificationStreams.erase(_notificationStreams.begin() + i);
+                                break;
+                        }
+                }
+                if (_loop && stream->acquired())
+                        _loop->removeFd(stream->fd());
+        }
+
+        // an acquired socket just needs to be closed, otherwise notifying has to be stopped explicitly
+        if (!stream->acquired() && stream->isOpen())
+                callMethod(stream->charPath(), "org.bluez.GattCharacteristic1", "StopNotify", GATT_TIMEOUT);
+        LOG_DEBUG("Stopped notifications of characteristic %s.", stream->charPath());
+        delete stream;
+}
+
+
+GattNotificationStream *BluezAdapter::notificationStreamAt(int index) const
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // guard
+        if ((index < 0) || (index >= static_cast<int>(_notificationStreams.size())))
+                return nullptr;
+
+        return _notificationStreams[index];
+}
+
+
+bool BluezAdapter::supportsWriteStream(const char *charPath)
+{
+        // Bluez only exports this property for characteristics which can be written without response
+        if (!ensureObjectsSeeded())
+                return false;
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        return (_objects.property(charPath, "org.bluez.GattCharacteristic1", "WriteAcquired") != nullptr);
+}
+
+
+bool BluezAdapter::writeCharacteristicStream(const char *charPath, const uint8_t *buffer, int length, int timeout, int *written)
+{
+        // guards
+        if (written)
+                *written = 0;
+        if (!_connection)
+                return false;
+        if (!buffer || (length < 0))
+                return false;
+
+        // the socket is kept open for subsequent transfers, it's taken out of the list while it's in use
+        // (so the lock isn't held while waiting for the socket, and the stream can't be closed meanwhile)
+        timeout = timeoutOrDefault(timeout, GATT_TIMEOUT);
+        GattWriteStream *stream = nullptr;
+        {
+                std::lock_guard<std::recursive_mutex> lock(_mutex);
+                std::map<std::string, GattWriteStream *>::iterator it = _writeStreams.find(charPath);
+                if (it != _writeStreams.end())
+                {
+                        stream = it->second;
+                        _writeStreams.erase(it);
+                }
+        }
+        if (stream && !stream->isOpen())
+        {
+                delete stream;
+                stream = nullptr;
+        }
+        if (!stream)
+        {
+                int fd = -1;
+                int mtu = 0;
+                if (!acquireSocket(charPath, "AcquireWrite", timeout, &fd, &mtu))
+                {
+                        // nothing has been sent, so the caller may still choose another way
+                        if (written)
+                                *written = -1;
+                        return false;
+                }
+                stream = new GattWriteStream(charPath, fd, mtu);
+                LOG_DEBUG("Acquired write socket of characteristic %s (MTU %d).", charPath, mtu);
+        }
+
+        // write the data in MTU sized chunks
+        bool result = stream->write(buffer, length, timeout, written);
+
+        // a failed socket is acquired again with the next transfer (a stream which has been opened by
+        // another thread in the meantime is kept instead)
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        if (!result || !_writeStreams.emplace(charPath, stream).second)
+                delete stream;
+        return result;
+}
+
+
 bool BluezAdapter::isValidAddress(const char *address) const
 {
         // it shouldn't be NULL
@@ -486,58 +1175,68 @@ std::string BluezAdapter::getDevicePath(const char *address)
 }
 
 
-const char *BluezAdapter::getStringFromVariant(DBusMessageIter *variantIter)
+std::string BluezAdapter::getDevicePathOf(const char *objPath) const
 {
-        // make sure that it's really a variant
-        if (dbus_message_iter_get_arg_type(variantIter) != DBUS_TYPE_VARIANT)
-                return nullptr;
+        // the object has to belong to this adapter
+        if (!objPath || (strncmp(objPath, "/org/bluez/", 11) != 0))
+                return std::string();
+        if ((strncmp(objPath + 11, _hci.c_str(), _hci.length()) != 0) || (objPath[11 + _hci.length()] != '/'))
+                return std::string();
+
+        // device paths look like /org/bluez/hci0/dev_XX_XX_XX_XX_XX_XX
+        const char *deviceElement = strstr(objPath, "/dev_");
+        if (!deviceElement)
+                return std::string();
+        const char *end = strchr(deviceElement + 1, '/');
+        if (!end)
+                return std::string(objPath);
+        return std::string(objPath, end - objPath);
+}
 
-        // get the value
-        DBusMessageIter valueIter;
-        dbus_message_iter_recurse(variantIter, &valueIter);
-        if (dbus_message_iter_get_arg_type(&valueIter) != DBUS_TYPE_STRING)
-                return nullptr;
+
+std::string BluezAdapter::getAddressOf(const char *devicePath) const
+{
+        std::string address;
+        const char *deviceElement = strstr(devicePath, "/dev_");
+        if (!deviceElement)
+                return address;
+        for (const char *src = deviceElement + 5; *src && (*src != '/'); src++)
+                address += (*src == '_') ? ':' : *src;
+        return address;
+}
+
+
+const char *BluezAdapter::getStringFromVariant(DBusMessageIter *variantIter)
+{
         const char *value = nullptr;
-        dbus_message_iter_get_basic(&valueIter, &value);
+        DBusMarshal::readVariant(variantIter, &value);
         return value;
 }
 
 
 bool BluezAdapter::getBooleanFromVariant(DBusMessageIter *variantIter)
 {
-        // make sure that it's really a variant
-        if (dbus_message_iter_get_arg_type(variantIter) != DBUS_TYPE_VARIANT)
-                return false;
-
-        // get the value
-        DBusMessageIter valueIter;
-        dbus_message_iter_recurse(variantIter, &valueIter);
-        if (dbus_message_iter_get_arg_type(&valueIter) != DBUS_TYPE_BOOLEAN)
-                return false;
-        dbus_bool_t value = FALSE;
-        dbus_message_iter_get_basic(&valueIter, &value);
-        return (value == TRUE);
+        bool value = false;
+        DBusMarshal::readVariant(variantIter, &value);
+        return value;
 }
 
 
-bool BluezAdapter::callMethod(const char *path, const char *interface, const char *method)
+bool BluezAdapter::callMethod(const char *path, const char *interface, const char *method, int timeout)
 {
         // guard
         if (!_connection)
                 return false;
 
         // create the query message
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", path, interface, method);
+        DBusMessage *query = createMethodQuery(path, interface, method);
         if (!query)
-        {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
                 return false;
-        }
 
         // send the query and wait for the reply
         DBusError dbusError;
         dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeout, &dbusError);
         dbus_message_unref(query);
         if (dbus_error_is_set(&dbusError))
         {
@@ -550,26 +1249,21 @@ bool BluezAdapter::callMethod(const char *path, const char *interface, const cha
 }
 
 
-bool BluezAdapter::readBooleanProperty(const char *path, const char *interface, const char *propName, bool logErrors)
+bool BluezAdapter::readBooleanProperty(const char *path, const char *interface, const char *propName, int timeout, bool logErrors)
 {
         // guard
         if (!_connection)
                 return false;
 
         // create the query message
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", path, "org.freedesktop.DBus.Properties", "Get");
+        DBusMessage *query = createPropertyQuery(path, interface, propName);
         if (!query)
-        {
-                if (logErrors)
-                        LOG_ERROR("Couldn't allocate memory for the query message.");
                 return false;
-        }
-        dbus_message_append_args(query, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &propName, DBUS_TYPE_INVALID);
 
         // send the query and wait for the reply
         DBusError dbusError;
         dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeout, &dbusError);
         dbus_message_unref(query);
         if (dbus_error_is_set(&dbusError))
         {
@@ -588,367 +1282,903 @@ bool BluezAdapter::readBooleanProperty(const char *path, const char *interface,
 }
 
 
-void BluezAdapter::clearDiscoveredDevicesList()
+DBusMessage *BluezAdapter::createMethodQuery(const char *path, const char *interface, const char *method)
 {
-        for (DeviceInfo *device : _discoveredDevices)
-                delete device;
-        _discoveredDevices.clear();
+        std::string key = std::string(method) + '@' + path;
+        return copyQueryTemplate(key, [path, interface, method]()
+        {
+                return dbus_message_new_method_call("org.bluez", path, interface, method);
+        });
 }
 
 
-void BluezAdapter::updateDiscoveredDevicesList()
+DBusMessage *BluezAdapter::createPropertyQuery(const char *path, const char *interface, const char *propName)
 {
-        // start with an empty list
-        clearDiscoveredDevicesList();
-
-        // guard
-        if (!_connection)
-                return;
-
-        // prepare the query message
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
-        if (!query)
-        {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
-                return;
-        }
-
-        // send the query and wait for the reply
-        DBusError dbusError;
-        dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
-        dbus_message_unref(query);
-        if (dbus_error_is_set(&dbusError))
+        std::string key = std::string("Get:") + interface + '.' + propName + '@' + path;
+        return copyQueryTemplate(key, [path, interface, propName]()
         {
-                LOG_ERROR("Couldn't execute command: %s", dbusError.message);
-                dbus_error_free(&dbusError);
-                return;
-        }
-
-        // go through the returned data
-        DBusMessageIter objArrayIter;
-        dbus_message_iter_init(reply, &objArrayIter);
-        if (dbus_message_iter_get_arg_type(&objArrayIter) == DBUS_TYPE_ARRAY)
-        {
-                DBusMessageIter objIter;
-                dbus_message_iter_recurse(&objArrayIter, &objIter);
-                while (true)
+                DBusMessage *query = dbus_message_new_method_call("org.bluez", path, "org.freedesktop.DBus.Properties", "Get");
+                if (query)
                 {
-                        updateDiscoveredDevicesList_object(&objIter);
-                        if (!dbus_message_iter_next(&objIter))
-                                break;
+                        DBusMessageIter paramsIter;
+                        dbus_message_iter_init_append(query, &paramsIter);
+                        DBusMarshal::append(&paramsIter, interface);
+                        DBusMarshal::append(&paramsIter, propName);
                 }
-        }
-        dbus_message_unref(reply);
+                return query;
+        });
 }
 
 
-void BluezAdapter::updateDiscoveredDevicesList_object(DBusMessageIter *objIter)
+DBusMessage *BluezAdapter::createRemoveDeviceQuery(const char *address)
 {
-        // the current object should be a ObjectPath->Array dictionary
-        if (dbus_message_iter_get_arg_type(objIter) != DBUS_TYPE_DICT_ENTRY)
+        std::string path = "/org/bluez/";
+        path.append(_hci);
+        DBusMessage *query = dbus_message_new_method_call("org.bluez", path.c_str(), "org.bluez.Adapter1", "RemoveDevice");
+        if (!query)
         {
-                LOG_WARNING("Expected a dictionary, but it wasn't.");
-                return;
+                LOG_ERROR("Couldn't allocate memory for the query message.");
+                return nullptr;
         }
 
-        // get the object path
-        DBusMessageIter dictElementsIter;
-        dbus_message_iter_recurse(objIter, &dictElementsIter);
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_OBJECT_PATH)
-        {
-                LOG_WARNING("Expected ObjectPath as first dictionary element, but it wasn't.");
-                return;
-        }
-        const char *objPath = nullptr;
-        dbus_message_iter_get_basic(&dictElementsIter, &objPath);
+        std::string devicePath = getDevicePath(address);
+        DBusMessageIter paramsIter;
+        dbus_message_iter_init_append(query, &paramsIter);
+        DBusMarshal::append(&paramsIter, DBusObjectPath(devicePath.c_str()));
+        return query;
+}
 
-        // get the object's array
-        if (!dbus_message_iter_next(&dictElementsIter))
-        {
-                LOG_WARNING("Object dictionary has no second element.");
-                return;
-        }
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_ARRAY)
-        {
-                LOG_WARNING("Expected Array as second dictionary element, but it wasn't.");
-                return;
-        }
 
-        // go through the array of devices
-        DBusMessageIter arrayIter;
-        dbus_message_iter_recurse(&dictElementsIter, &arrayIter);
-        while (true)
+DBusMessage *BluezAdapter::createReadCharacteristicQuery(const char *charPath, uint16_t offset)
+{
+        // plain reads are the most frequent ones, so they're built from a template
+        if (offset == 0)
         {
-                updateDiscoveredDevicesList_device(&arrayIter);
-                if (!dbus_message_iter_next(&arrayIter))
-                        break;
+                std::string key = std::string("ReadValue@") + charPath;
+                return copyQueryTemplate(key, [this, charPath]()
+                {
+                        return buildReadCharacteristicQuery(charPath, 0);
+                });
         }
+        return buildReadCharacteristicQuery(charPath, offset);
 }
 
 
-void BluezAdapter::updateDiscoveredDevicesList_device(DBusMessageIter *deviceIter)
+DBusMessage *BluezAdapter::buildReadCharacteristicQuery(const char *charPath, uint16_t offset)
 {
-        // the current element should be a String->Array dictionary
-        if (dbus_message_iter_get_arg_type(deviceIter) != DBUS_TYPE_DICT_ENTRY)
+        DBusMessage *query = dbus_message_new_method_call("org.bluez", charPath, "org.bluez.GattCharacteristic1", "ReadValue");
+        if (!query)
+                return nullptr;
+
+        // the only parameter is the options dictionary
+        DBusMessageIter paramsIter;
+        dbus_message_iter_init_append(query, &paramsIter);
+        addReadWriteOptions(&paramsIter, offset);
+        return query;
+}
+
+
+DBusMessage *BluezAdapter::createWriteCharacteristicQuery(const char *charPath, const uint8_t *buffer, int length, uint16_t offset, const char *writeType)
+{
+        DBusMessage *query = dbus_message_new_method_call("org.bluez", charPath, "org.bluez.GattCharacteristic1", "WriteValue");
+        if (!query)
         {
-                LOG_WARNING("Expected a dictionary, but it wasn't.");
-                return;
+                LOG_ERROR("Couldn't allocate memory for the query message.");
+                return nullptr;
         }
 
-        // get the device's interface name
-        DBusMessageIter dictElementsIter;
-        dbus_message_iter_recurse(deviceIter, &dictElementsIter);
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_STRING)
+        // we need an initial iterator for the query's parameters
+        DBusMessageIter paramsIter;
+        dbus_message_iter_init_append(query, &paramsIter);
+
+        // copy the buffer into a byte array container parameter in one go
+        DBusMarshal::appendBytes(&paramsIter, buffer, length);
+
+        // add the options dictionary
+        addReadWriteOptions(&paramsIter, offset, writeType);
+        return query;
+}
+
+
+int BluezAdapter::getByteArray(DBusMessage *reply, const uint8_t **data)
+{
+        // the reply's first argument should be a byte array
+        DBusMessageIter byteArrayIter;
+        dbus_message_iter_init(reply, &byteArrayIter);
+        int length = DBusMarshal::readBytes(&byteArrayIter, data);
+        return (length > 0) ? length : 0;
+}
+
+
+void BluezAdapter::addReadWriteOptions(DBusMessageIter *paramsIter, uint16_t offset, const char *writeType)
+{
+        // add a String->Variant dictionary container (options parameter)
+        DBusDictWriter options(paramsIter);
+
+        // the offset is only needed for long reads and writes
+        if (offset > 0)
+                options.add("offset", offset);
+
+        // the write type selects between requests and commands (without response)
+        if (writeType)
+                options.add("type", writeType);
+
+        options.close();
+}
+
+
+DBusMessage *BluezAdapter::copyQueryTemplate(const std::string &key, const std::function<DBusMessage *()> &build)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // frequent queries are built once and only copied afterwards, which skips the name validation and marshalling
+        std::map<std::string, DBusMessage *>::iterator it = _queryTemplates.find(key);
+        if (it == _queryTemplates.end())
         {
-                LOG_WARNING("Expected String as first dictionary element, but it wasn't.");
-                return;
+                DBusMessage *query = build();
+                if (!query)
+                {
+                        LOG_ERROR("Couldn't allocate memory for the query message.");
+                        return nullptr;
+                }
+                if (_queryTemplates.size() >= MAX_QUERY_TEMPLATES)
+                        clearQueryTemplates();
+                it = _queryTemplates.insert(std::make_pair(key, query)).first;
         }
-        const char *deviceInterfaceName = nullptr;
-        dbus_message_iter_get_basic(&dictElementsIter, &deviceInterfaceName);
+        DBusMessage *copy = dbus_message_copy(it->second);
+        if (!copy)
+                LOG_ERROR("Couldn't allocate memory for the query message.");
+        return copy;
+}
+
+
+void BluezAdapter::clearQueryTemplates()
+{
+        for (std::pair<const std::string, DBusMessage *> &entry : _queryTemplates)
+                dbus_message_unref(entry.second);
+        _queryTemplates.clear();
+}
 
-        // we're only interested in "real" devices
-        if (strcasecmp(deviceInterfaceName, "org.bluez.Device1") != 0)
-                return;
 
-        // get the device's attribute array
-        if (!dbus_message_iter_next(&dictElementsIter))
+bool BluezAdapter::acquireSocket(const char *charPath, const char *method, int timeout, int *fd, int *mtu)
+{
+        // file descriptors can only be passed if the connection supports it
+        if (!dbus_connection_can_send_type(_connection, DBUS_TYPE_UNIX_FD))
+                return false;
+
+        // create the query message
+        DBusMessage *query = dbus_message_new_method_call("org.bluez", charPath, "org.bluez.GattCharacteristic1", method);
+        if (!query)
         {
-                LOG_WARNING("Device dictionary has no second element.");
-                return;
+                LOG_ERROR("Couldn't allocate memory for the query message.");
+                return false;
         }
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_ARRAY)
+        DBusMessageIter paramsIter;
+        dbus_message_iter_init_append(query, &paramsIter);
+        addReadWriteOptions(&paramsIter, 0);
+
+        // send the query and wait for the reply (not every characteristic supports this)
+        DBusError dbusError;
+        dbus_error_init(&dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, timeout, &dbusError);
+        dbus_message_unref(query);
+        if (dbus_error_is_set(&dbusError))
         {
-                LOG_WARNING("Expected Array as second dictionary element, but it wasn't.");
-                return;
+                LOG_DEBUG("Couldn't execute %s on %s: %s", method, charPath, dbusError.message);
+                dbus_error_free(&dbusError);
+                return false;
         }
 
-        // create an info object for the discovered device
-        DeviceInfo *device = new DeviceInfo();
+        // extract the socket and the MTU
+        int socket = -1;
+        dbus_uint16_t attMtu = 0;
+        dbus_error_init(&dbusError);
+        if (!dbus_message_get_args(reply, &dbusError, DBUS_TYPE_UNIX_FD, &socket, DBUS_TYPE_UINT16, &attMtu, DBUS_TYPE_INVALID))
+        {
+                LOG_ERROR("Unexpected reply to %s: %s", method, dbusError.message);
+                dbus_error_free(&dbusError);
+                dbus_message_unref(reply);
+                return false;
+        }
+        dbus_message_unref(reply);
+        *fd = socket;
+        *mtu = attMtu;
+        return true;
+}
 
-        // go through the attributes array
-        DBusMessageIter arrayIter;
-        dbus_message_iter_recurse(&dictElementsIter, &arrayIter);
-        while (true)
+
+void BluezAdapter::closeStreams(const char *devicePath)
+{
+        // the sockets of a disconnected device are dead
+        std::string prefix = devicePath;
+        prefix += '/';
+        for (GattNotificationStream *stream : _notificationStreams)
+        {
+                if (strncmp(stream->charPath(), prefix.c_str(), prefix.length()) == 0)
+                        closeNotificationStream(stream);
+        }
+        std::map<std::string, GattWriteStream *>::iterator it = _writeStreams.lower_bound(prefix);
+        while ((it != _writeStreams.end()) && (it->first.compare(0, prefix.length(), prefix) == 0))
         {
-                // the current array element should be a String->Variant dictionary
-                if (dbus_message_iter_get_arg_type(&arrayIter) != DBUS_TYPE_DICT_ENTRY)
+                delete it->second;
+                it = _writeStreams.erase(it);
+        }
+}
+
+
+void BluezAdapter::watchNotificationStream(GattNotificationStream *stream)
+{
+        // guard
+        if (!_loop || !stream->acquired() || !stream->isOpen())
+                return;
+
+        // the packets are handed to the subscriber as soon as they arrive
+        int fd = stream->fd();
+        _loop->addFd(fd, EPOLLIN, [this, fd](uint32_t events)
+        {
+                (void)events;
+                readNotificationSocket(fd);
+        });
+}
+
+
+void BluezAdapter::readNotificationSocket(int fd)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // the stream may have been unsubscribed in the meantime
+        for (GattNotificationStream *stream : _notificationStreams)
+        {
+                if (stream->acquired() && (stream->fd() == fd))
                 {
-                        LOG_WARNING("Expected a dictionary for the attributes array element, but it wasn't.");
-                        break;
+                        drainNotificationStream(stream);
+                        return;
                 }
+        }
+}
+
+
+int BluezAdapter::drainNotificationStream(GattNotificationStream *stream)
+{
+        // a dead socket is closed after its last packets have been read
+        if (stream->acquired())
+        {
+                stream->readPackets();
+                if (!stream->isOpen())
+                        closeNotificationStream(stream);
+        }
+        return stream->dispatchPackets();
+}
+
+
+void BluezAdapter::closeNotificationStream(GattNotificationStream *stream)
+{
+        // the loop has to forget the socket before its file descriptor can be reused
+        if (_loop && stream->acquired())
+                _loop->removeFd(stream->fd());
+        stream->close();
+}
+
+
+void BluezAdapter::wakeDispatcher()
+{
+        if (_wakeupFd < 0)
+                return;
+        uint64_t one = 1;
+        ssize_t length = write(_wakeupFd, &one, sizeof(one));
+        (void)length;
+}
+
+
+bool BluezAdapter::CallLane::hasQueued() const
+{
+        for (int i = 0; i < CALL_PRIORITIES; i++)
+        {
+                if (!queued[i].empty())
+                        return true;
+        }
+        return false;
+}
+
+
+bool BluezAdapter::sendAsync(DBusMessage *query, int timeout, CallPriority priority, ReplyHandler handler)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // guard (a call which nobody would send or dispatch is refused, its handler is never called, otherwise the
+        // handler is called exactly once, which may happen before this returns if the call can't be sent)
+        bool dispatching = (std::this_thread::get_id() == _dispatchThread);
+        if (!_connection || !dbus_connection_get_is_connected(_connection) || !_loop || (!dispatching && (_wakeupFd < 0)))
+        {
+                LOG_ERROR("Couldn't queue asynchronous query, adapter %s isn't attached to a connected dispatcher.", _hci.c_str());
+                dbus_message_unref(query);
+                return false;
+        }
+
+        // calls are queued per device, so one device can't hog the connection
+        std::string lane = getDevicePathOf(dbus_message_get_path(query));
+        if (lane.empty())
+                lane = dbus_message_get_path(query);
+
+        // queue the call
+        PendingCall *call = new PendingCall();
+        call->adapter = this;
+        call->lane = lane;
+        call->query = query;
+        call->pending = nullptr;
+        call->timeout = timeout;
+        call->deadline = 0;
+        call->priority = priority;
+        call->handler = handler;
+        _callLanes[lane].queued[priority].push_back(call);
+        _queuedCallsCount++;
+
+        // calls queued by other threads are sent by the dispatching thread, which also receives the replies
+        if (!dispatching)
+        {
+                wakeDispatcher();
+                return true;
+        }
 
-                // get the attribute's name
-                DBusMessageIter attributeDictIter;
-                dbus_message_iter_recurse(&arrayIter, &attributeDictIter);
-                if (dbus_message_iter_get_arg_type(&attributeDictIter) != DBUS_TYPE_STRING)
+        // send it if there's room in the device's lane
+        expireTimedOutCalls();
+        startQueuedCalls(lane);
+        return true;
+}
+
+
+int BluezAdapter::nextQueuedClass(CallLane &callLane)
+{
+        // the last slot of a lane is kept for interactive calls, so an alert never waits behind a full lane
+        int next = -1;
+        for (int i = 0; i < CALL_PRIORITIES; i++)
+        {
+                if (callLane.queued[i].empty())
+                        continue;
+                int slots = (i == PriorityInteractive) ? MAX_PENDING_CALLS_PER_DEVICE : (MAX_PENDING_CALLS_PER_DEVICE - 1);
+                if (callLane.inFlight >= slots)
+                        continue;
+
+                // the most urgent class goes first, unless a less urgent one has been passed over too often
+                if ((next < 0) || ((callLane.bypassed[i] >= MAX_BYPASSED_CALLS) && (callLane.bypassed[next] < MAX_BYPASSED_CALLS)))
+                        next = i;
+        }
+        if (next < 0)
+                return -1;
+
+        // the less urgent classes which have to wait once more are counted
+        callLane.bypassed[next] = 0;
+        for (int i = next + 1; i < CALL_PRIORITIES; i++)
+        {
+                if (!callLane.queued[i].empty())
+                        callLane.bypassed[i]++;
+        }
+        return next;
+}
+
+
+void BluezAdapter::startQueuedCalls(const std::string &lane)
+{
+        CallLane &callLane = _callLanes[lane];
+        for (int priority = nextQueuedClass(callLane); priority >= 0; priority = nextQueuedClass(callLane))
+        {
+                // take the next call from the queue
+                PendingCall *call = callLane.queued[priority].front();
+                callLane.queued[priority].pop_front();
+                _queuedCallsCount--;
+
+                // send it
+                DBusPendingCall *pending = nullptr;
+                bool sent = dbus_connection_send_with_reply(_connection, call->query, &pending, call->timeout);
+                dbus_message_unref(call->query);
+                call->query = nullptr;
+                if (!sent || !pending)
                 {
-                        LOG_WARNING("Expected String as first attribute dictionary element, but it wasn't.");
-                        break;
+                        LOG_ERROR("Couldn't send asynchronous query.");
+                        ReplyHandler handler = call->handler;
+                        delete call;
+                        if (handler)
+                                handler(nullptr);
+                        continue;
                 }
-                const char *attributeName = nullptr;
-                dbus_message_iter_get_basic(&attributeDictIter, &attributeName);
 
-                // make sure there's an attribute value
-                if (!dbus_message_iter_next(&attributeDictIter))
+                // wait for the reply
+                call->pending = pending;
+                call->deadline = monotonicMillis() + call->timeout;
+                callLane.inFlight++;
+                _callsInFlight.push_back(call);
+                dbus_pending_call_set_notify(pending, onPendingCallNotify, call, nullptr);
+        }
+}
+
+
+void BluezAdapter::startQueuedCalls()
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        if (_queuedCallsCount == 0)
+                return;
+        std::vector<std::string> lanes;
+        for (std::pair<const std::string, CallLane> &lane : _callLanes)
+        {
+                if (lane.second.hasQueued())
+                        lanes.push_back(lane.first);
+        }
+        for (const std::string &lane : lanes)
+                startQueuedCalls(lane);
+}
+
+
+void BluezAdapter::completeCall(PendingCall *call, DBusMessage *reply)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // the call isn't in flight anymore
+        for (size_t i = 0; i < _callsInFlight.size(); i++)
+        {
+                if (_callsInFlight[i] == call)
                 {
-                        LOG_WARNING("Attribute dictionary has no second element.");
+                        _callsInFlight.erase(_callsInFlight.begin() + i);
                         break;
                 }
+        }
+        std::string lane = call->lane;
+        _callLanes[lane].inFlight--;
+        dbus_pending_call_unref(call->pending);
 
-                // copy the interesting attributes
-                if (strcasecmp(attributeName, "Address") == 0)
-                        device->setAddress(getStringFromVariant(&attributeDictIter));
-                else if (strcasecmp(attributeName, "Name") == 0)
-                        device->setName(getStringFromVariant(&attributeDictIter));
-
-                // get the next array element
-                if (!dbus_message_iter_next(&arrayIter))
-                        break;
+        // error replies count as failures
+        if (reply && (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR))
+        {
+                DBusError dbusError;
+                dbus_error_init(&dbusError);
+                dbus_set_error_from_message(&dbusError, reply);
+                LOG_ERROR("Couldn't execute command: %s", dbusError.message);
+                dbus_error_free(&dbusError);
+                reply = nullptr;
         }
 
-        // consider adding the device to the list of discovered devices
-        if (isValidAddress(device->address()) && canReadConnectedProperty(device->address()))
+        // notify the caller
+        if (call->handler)
+                call->handler(reply);
+        delete call;
+
+        // there's room for the next call now
+        startQueuedCalls(lane);
+}
+
+
+void BluezAdapter::expireTimedOutCalls()
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        int64_t now = monotonicMillis();
+        for (size_t i = 0; i < _callsInFlight.size(); )
         {
-                // add the device
-                _discoveredDevices.push_back(device);
-                LOG_DEBUG("Found registered device: %s", device->address());
+                PendingCall *call = _callsInFlight[i];
+                if (call->deadline > now)
+                {
+                        i++;
+                        continue;
+                }
+
+                // give up on the call (this also removes it from the list)
+                LOG_ERROR("Couldn't execute command: no reply within %d ms.", call->timeout);
+                dbus_pending_call_cancel(call->pending);
+                completeCall(call, nullptr);
         }
-        else
-                delete device;
 }
 
 
-bool BluezAdapter::canReadConnectedProperty(const char *address)
+void BluezAdapter::onPendingCallNotify(DBusPendingCall *pending, void *userData)
 {
-        // guards
-        if (!_connection)
-                return false;
-        if (!isValidAddress(address))
+        PendingCall *call = static_cast<PendingCall *>(userData);
+        DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+        call->adapter->completeCall(call, reply);
+        if (reply)
+                dbus_message_unref(reply);
+}
+
+
+int64_t BluezAdapter::monotonicMillis()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000 + static_cast<int64_t>(now.tv_nsec / 1000000);
+}
+
+
+int BluezAdapter::remainingMillis(int64_t deadline)
+{
+        // an expired deadline still allows the call to be attempted
+        int64_t remaining = deadline - monotonicMillis();
+        return (remaining > 0) ? static_cast<int>(remaining) : 1;
+}
+
+
+bool BluezAdapter::pumpCommandTransfer(CommandTransfer *transfer)
+{
+        // replies may arrive while chunks are being sent
+        if (transfer->pumping)
+                return true;
+        transfer->pumping = true;
+
+        // send chunks as long as there are credits left
+        int size = static_cast<int>(transfer->data.size());
+        while (!transfer->failed && !transfer->syncing && (transfer->offset < size))
         {
-                LOG_DEBUG("Invalid device address.");
-                return false;
+                // every few chunks (and the last one) are acknowledged by the device, after all commands before them went out
+                int chunk = size - transfer->offset;
+                if (chunk > transfer->chunkSize)
+                        chunk = transfer->chunkSize;
+                bool sync = ((transfer->offset + chunk) >= size) || (((transfer->chunksSent + 1) % COMMAND_SYNC_INTERVAL) == 0);
+                if (sync && (transfer->inFlight > 0))
+                        break;
+                if (transfer->inFlight >= COMMAND_WRITE_CREDITS)
+                        break;
+
+                // send the chunk (a refused one isn't counted, its handler is never called)
+                DBusMessage *query = createWriteCharacteristicQuery(transfer->charPath.c_str(), transfer->data.data() + transfer->offset, chunk, 0, sync ? "request" : "command");
+                if (!query)
+                {
+                        transfer->failed = true;
+                        break;
+                }
+                transfer->offset += chunk;
+                transfer->chunksSent++;
+                transfer->inFlight++;
+                transfer->syncing = sync;
+                bool queued = sendAsync(query, transfer->timeout, transfer->priority, [this, transfer, sync](DBusMessage *reply)
+                {
+                        // a reply returns the credit, a failure aborts the whole transfer
+                        transfer->inFlight--;
+                        if (!reply)
+                                transfer->failed = true;
+                        if (sync)
+                                transfer->syncing = false;
+                        pumpCommandTransfer(transfer);
+                });
+                if (!queued)
+                {
+                        transfer->offset -= chunk;
+                        transfer->chunksSent--;
+                        transfer->inFlight--;
+                        transfer->syncing = false;
+                        transfer->failed = true;
+                }
         }
+        transfer->pumping = false;
 
-        // create the query message
-        std::string path = getDevicePath(address);
-        const char *interface = "org.bluez.Device1";
-        const char *propName = "Connected";
-        DBusMessage *query = dbus_message_new_method_call("org.bluez", path.c_str(), "org.freedesktop.DBus.Properties", "Get");
-        if (!query)
+        // the transfer is done once all chunks have been answered
+        if ((transfer->inFlight > 0) || (!transfer->failed && (transfer->offset < size)))
+                return true;
+        for (size_t i = 0; i < _commandTransfers.size(); i++)
         {
-                LOG_ERROR("Couldn't allocate memory for the query message.");
-                return false;
+                if (_commandTransfers[i] == transfer)
+                {
+                        _commandTransfers.erase(_commandTransfers.begin() + i);
+                        break;
+                }
         }
-        dbus_message_append_args(query, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &propName, DBUS_TYPE_INVALID);
 
-        // send the query and wait for the reply
-        DBusError dbusError;
-        dbus_error_init(&dbusError);
-        DBusMessage *reply = dbus_connection_send_with_reply_and_block(_connection, query, _timeout, &dbusError);
-        dbus_message_unref(query);
-        if (dbus_error_is_set(&dbusError))
+        // a transfer which couldn't send anything is refused like a single call, without calling back
+        if (transfer->chunksSent == 0)
         {
-                dbus_error_free(&dbusError);
+                delete transfer;
                 return false;
         }
-        dbus_message_unref(reply);
+        if (transfer->failed)
+                LOG_ERROR("Write to characteristic %s failed after %d of %d bytes.", transfer->charPath.c_str(), transfer->offset, size);
+        else
+                LOG_DEBUG("Wrote %d bytes to characteristic %s in %d chunks.", size, transfer->charPath.c_str(), transfer->chunksSent);
+        ResultCallback callback = transfer->callback;
+        bool success = !transfer->failed;
+        delete transfer;
+        if (callback)
+                callback(success);
         return true;
 }
 
 
-const char *BluezAdapter::findCharacteristicPath_object(DBusMessageIter *objIter, const char *devicePath, const char *charUUID)
+void BluezAdapter::clearDiscoveredDevicesList()
 {
-        // the current object should be a ObjectPath->Array dictionary
-        if (dbus_message_iter_get_arg_type(objIter) != DBUS_TYPE_DICT_ENTRY)
-        {
-                LOG_WARNING("Expected a dictionary, but it wasn't.");
-                return nullptr;
-        }
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        for (DeviceInfo *device : _discoveredDevices)
+                delete device;
+        _discoveredDevices.clear();
+        _discoveredIndex.clear();
+}
+
+
+void BluezAdapter::updateDiscoveredDevicesList()
+{
+        bool seeded = ensureObjectsSeeded();
+
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        // start with an empty list
+        clearDiscoveredDevicesList();
+        if (seeded)
+                listDiscoveredDevices();
+}
+
 
-        // get the object path
-        DBusMessageIter dictElementsIter;
-        dbus_message_iter_recurse(objIter, &dictElementsIter);
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_OBJECT_PATH)
+void BluezAdapter::listDiscoveredDevices()
+{
+        // add all of the adapter's devices
+        const BluezObjectCache::Objects &objects = _objects.objects();
+        for (BluezObjectCache::Objects::const_iterator it = objects.begin(); it != objects.end(); ++it)
         {
-                LOG_WARNING("Expected ObjectPath as first dictionary element, but it wasn't.");
-                return nullptr;
+                if (it->second.find("org.bluez.Device1") != it->second.end())
+                        updateDiscoveredDevice(it->first.c_str());
         }
-        const char *objPath = nullptr;
-        dbus_message_iter_get_basic(&dictElementsIter, &objPath);
+}
 
-        // the left part of the discovered path needs to match the device's path
-        if (strncasecmp(objPath, devicePath, strlen(devicePath)) != 0)
-                return nullptr;
 
-        // get the object's array
-        if (!dbus_message_iter_next(&dictElementsIter))
+void BluezAdapter::updateDiscoveredDevice(const char *devicePath)
+{
+        // only the adapter's devices are of interest
+        if (getDevicePathOf(devicePath).length() != strlen(devicePath))
+                return;
+
+        // create an info object for the discovered device
+        const char *interface = "org.bluez.Device1";
+        DeviceInfo *device = new DeviceInfo();
+        device->setAddress(_objects.stringProperty(devicePath, interface, "Address"));
+        device->setName(_objects.stringProperty(devicePath, interface, "Name"));
+        if (_objects.property(devicePath, interface, "RSSI"))
+                device->setRssi(_objects.integerProperty(devicePath, interface, "RSSI"));
+
+        // consider adding the device to the list of discovered devices
+        if (!device->mac().isValid() || !passesAddressFilter(device->mac()))
         {
-                LOG_WARNING("Object dictionary has no second element.");
-                return nullptr;
+                delete device;
+                return;
         }
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_ARRAY)
+        int index = indexOfDiscoveredDevice(device->mac());
+        if (index >= 0)
         {
-                LOG_WARNING("Expected Array as second dictionary element, but it wasn't.");
-                return nullptr;
+                delete _discoveredDevices[index];
+                _discoveredDevices[index] = device;
+        }
+        else
+        {
+                _discoveredIndex.insert(device->mac(), static_cast<int>(_discoveredDevices.size()));
+                _discoveredDevices.push_back(device);
+                LOG_DEBUG("Found registered device: %s", device->address());
         }
 
-        // go through the array of devices
-        DBusMessageIter arrayIter;
-        dbus_message_iter_recurse(&dictElementsIter, &arrayIter);
-        while (true)
+        // a device with a signal strength is currently advertising
+        if (device->rssiValid() && _deviceListener)
         {
-                if (findCharacteristicPath_device(&arrayIter, charUUID))
-                        return objPath;
-                if (!dbus_message_iter_next(&arrayIter))
-                        break;
+                std::string address = device->address();
+                _deviceListener->deviceAdvertised(this, address.c_str(), device->rssi());
         }
+}
 
-        // no match in this object
-        return nullptr;
+
+bool BluezAdapter::passesAddressFilter(const MacAddress &address) const
+{
+        // without a filter, every device passes
+        return _addressFilter.empty() || _addressFilter.contains(address);
+}
+
+
+int BluezAdapter::indexOfDiscoveredDevice(const MacAddress &address) const
+{
+        const int *index = _discoveredIndex.find(address);
+        return index ? *index : -1;
 }
 
 
-bool BluezAdapter::findCharacteristicPath_device(DBusMessageIter *deviceIter, const char *charUUID)
+void BluezAdapter::removeDiscoveredDeviceAt(int index)
 {
-        // the current element should be a String->Array dictionary
-        if (dbus_message_iter_get_arg_type(deviceIter) != DBUS_TYPE_DICT_ENTRY)
+        // the last device takes the removed one's place, so only one index entry has to be updated
+        int last = static_cast<int>(_discoveredDevices.size()) - 1;
+        _discoveredIndex.erase(_discoveredDevices[index]->mac());
+        delete _discoveredDevices[index];
+        if (index != last)
         {
-                LOG_WARNING("Expected a dictionary, but it wasn't.");
-                return false;
+                _discoveredDevices[index] = _discoveredDevices[last];
+                _discoveredIndex.insert(_discoveredDevices[index]->mac(), index);
         }
+        _discoveredDevices.pop_back();
+}
+
 
-        // get the interface name
-        DBusMessageIter dictElementsIter;
-        dbus_message_iter_recurse(deviceIter, &dictElementsIter);
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_STRING)
+bool BluezAdapter::ensureObjectsSeeded()
+{
+        // the cache is filled once, afterwards it's kept up to date by the signals
         {
-                LOG_WARNING("Expected String as first dictionary element, but it wasn't.");
-                return false;
+                std::lock_guard<std::recursive_mutex> lock(_mutex);
+                if (_objects.seeded())
+                        return true;
+                if (!_connection)
+                        return false;
         }
-        const char *interfaceName = nullptr;
-        dbus_message_iter_get_basic(&dictElementsIter, &interfaceName);
 
-        // we're only interested in GATT characteristics
-        if (strcasecmp(interfaceName, "org.bluez.GattCharacteristic1") != 0)
+        // the round trip is made without the lock (so callers mustn't hold it either), if several threads
+        // get here at once, the first reply is mirrored
+        DBusMessage *reply = BluezObjectCache::fetchObjects(_connection, PROPERTY_TIMEOUT);
+        if (!reply)
                 return false;
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+        if (!_objects.seeded())
+                _objects.seed(reply);
+        dbus_message_unref(reply);
+        return true;
+}
+
+
+void BluezAdapter::interfaceAdded(const char *path, const char *interface)
+{
+        std::string devicePath = getDevicePathOf(path);
+        if (devicePath.empty())
+                return;
 
-        // get the characteristic's attribute array
-        if (!dbus_message_iter_next(&dictElementsIter))
+        // a new device has been discovered
+        if (strcmp(interface, "org.bluez.Device1") == 0)
         {
-                LOG_WARNING("Device dictionary has no second element.");
-                return false;
+                if (devicePath.length() == strlen(path))
+                        updateDiscoveredDevice(path);
+                return;
         }
-        if (dbus_message_iter_get_arg_type(&dictElementsIter) != DBUS_TYPE_ARRAY)
+
+        // only characteristic indexes which have already been populated need to be kept up to date
+        if (strcmp(interface, "org.bluez.GattCharacteristic1") != 0)
+                return;
+        std::map<std::string, CharacteristicIndex>::iterator it = _characteristicIndexes.find(devicePath);
+        if ((it == _characteristicIndexes.end()) || !it->second.populated)
+                return;
+
+        // the UUID is parsed only once, lookups compare the binary form (a UUID which is already
+        // known keeps its path, so a duplicate in another service doesn't take over)
+        Uuid uuid = Uuid::parse(_objects.stringProperty(path, interface, "UUID"));
+        if (uuid.isNull())
+                return;
+        std::string &indexedPath = it->second.paths[uuid];
+        if (indexedPath.empty())
+                indexedPath = path;
+}
+
+
+void BluezAdapter::interfaceRemoved(const char *path, const char *interface)
+{
+        // the controller itself is gone
+        if (strcmp(interface, "org.bluez.Adapter1") == 0)
         {
-                LOG_WARNING("Expected Array as second dictionary element, but it wasn't.");
-                return false;
+                if ((strncmp(path, "/org/bluez/", 11) != 0) || (_hci != path + 11))
+                        return;
+                LOG_WARNING("Bluetooth adapter %s has been removed.", _hci.c_str());
+                if (_deviceListener)
+                        _deviceListener->adapterRemoved(this);
+                return;
         }
 
-        // go through the attributes array
-        DBusMessageIter arrayIter;
-        dbus_message_iter_recurse(&dictElementsIter, &arrayIter);
-        while (true)
+        std::string devicePath = getDevicePathOf(path);
+        if (devicePath.empty())
+                return;
+
+        // a removed device takes all of its characteristics with it
+        if (strcmp(interface, "org.bluez.Device1") == 0)
         {
-                // the current array element should be a String->Variant dictionary
-                if (dbus_message_iter_get_arg_type(&arrayIter) != DBUS_TYPE_DICT_ENTRY)
+                if (devicePath.length() != strlen(path))
+                        return;
+                _characteristicIndexes.erase(devicePath);
+                int index = indexOfDiscoveredDevice(MacAddress::parse(getAddressOf(path).c_str()));
+                if (index >= 0)
                 {
-                        LOG_WARNING("Expected a dictionary for the attributes array element, but it wasn't.");
-                        break;
+                        LOG_DEBUG("Device has been removed: %s", _discoveredDevices[index]->address());
+                        removeDiscoveredDeviceAt(index);
                 }
+                return;
+        }
 
-                // get the attribute's name
-                DBusMessageIter attributeDictIter;
-                dbus_message_iter_recurse(&arrayIter, &attributeDictIter);
-                if (dbus_message_iter_get_arg_type(&attributeDictIter) != DBUS_TYPE_STRING)
+        // a removed characteristic may have hidden another one with the same UUID, so the index is
+        // populated again with the next lookup
+        if (strcmp(interface, "org.bluez.GattCharacteristic1") != 0)
+                return;
+        std::map<std::string, CharacteristicIndex>::iterator it = _characteristicIndexes.find(devicePath);
+        if (it == _characteristicIndexes.end())
+                return;
+        std::unordered_map<Uuid, std::string, UuidHash> &paths = it->second.paths;
+        for (std::unordered_map<Uuid, std::string, UuidHash>::iterator pathIt = paths.begin(); pathIt != paths.end(); ++pathIt)
+        {
+                if (pathIt->second == path)
                 {
-                        LOG_WARNING("Expected String as first attribute dictionary element, but it wasn't.");
-                        break;
+                        it->second.populated = false;
+                        return;
                 }
-                const char *attributeName = nullptr;
-                dbus_message_iter_get_basic(&attributeDictIter, &attributeName);
+        }
+}
 
-                // make sure there's an attribute value
-                if (!dbus_message_iter_next(&attributeDictIter))
+
+void BluezAdapter::propertyChanged(const char *path, const char *interface, const char *name, const BluezObjectCache::Value &value)
+{
+        // notifications of characteristics without an acquired socket arrive as value changes
+        if ((strcmp(interface, "org.bluez.GattCharacteristic1") == 0) && (strcmp(name, "Value") == 0))
+        {
+                for (GattNotificationStream *stream : _notificationStreams)
                 {
-                        LOG_WARNING("Attribute dictionary has no second element.");
-                        break;
+                        if (!stream->acquired() && (strcmp(stream->charPath(), path) == 0))
+                        {
+                                stream->pushPacket(value.bytes.data(), static_cast<int>(value.bytes.size()));
+                                if (_loop)
+                                        stream->dispatchPackets();
+                        }
                 }
+                return;
+        }
 
-                // check if it's the correct UUID
-                if (strcasecmp(attributeName, "UUID") == 0)
+        // only the adapter's devices are of interest
+        if (strcmp(interface, "org.bluez.Device1") != 0)
+                return;
+        if (getDevicePathOf(path).length() != strlen(path))
+                return;
+        std::string address = getAddressOf(path);
+
+        // a device with a signal strength is currently advertising
+        if (strcmp(name, "RSSI") == 0)
+        {
+                MacAddress mac = MacAddress::parse(address.c_str());
+                if (!passesAddressFilter(mac))
+                        return;
+                int index = indexOfDiscoveredDevice(mac);
+                if (index >= 0)
+                        _discoveredDevices[index]->setRssi(static_cast<int>(value.number));
+                if (_deviceListener)
+                        _deviceListener->deviceAdvertised(this, address.c_str(), static_cast<int>(value.number));
+        }
+
+        // a lost connection invalidates the characteristics
+        else if (strcmp(name, "Connected") == 0)
+        {
+                bool connected = (value.number != 0);
+                if (!connected)
                 {
-                        const char *currentUUID = getStringFromVariant(&attributeDictIter);
-                        if (strcasecmp(currentUUID, charUUID) == 0)
-                                return true;
-                        break;
+                        invalidateCharacteristicIndex(address.c_str());
+                        closeStreams(path);
                 }
+                if (_deviceListener)
+                        _deviceListener->deviceConnectionChanged(this, address.c_str(), connected);
+        }
 
-                // get the next array element
-                if (!dbus_message_iter_next(&arrayIter))
+        // the characteristics can be used once the services have been resolved (paths looked up before may be outdated)
+        else if (strcmp(name, "ServicesResolved") == 0)
+        {
+                if (value.number == 0)
+                        return;
+                invalidateCharacteristicIndex(address.c_str());
+                if (_deviceListener)
+                        _deviceListener->deviceServicesResolved(this, address.c_str());
+        }
+}
+
+
+void BluezAdapter::populateCharacteristicIndex(const char *devicePath, CharacteristicIndex *index)
+{
+        // collect all characteristics below the device's path (they're sorted by their paths, so a UUID which
+        // is used by several services resolves to the first one, just like a walk through the managed objects)
+        index->paths.clear();
+        std::string prefix = devicePath;
+        prefix += '/';
+        const BluezObjectCache::Objects &objects = _objects.objects();
+        for (BluezObjectCache::Objects::const_iterator it = objects.lower_bound(prefix); it != objects.end(); ++it)
+        {
+                if (it->first.compare(0, prefix.length(), prefix) != 0)
                         break;
+                Uuid uuid = Uuid::parse(_objects.stringProperty(it->first.c_str(), "org.bluez.GattCharacteristic1", "UUID"));
+                if (!uuid.isNull())
+                        index->paths.emplace(uuid, it->first);
         }
+        index->populated = true;
+        LOG_DEBUG("Indexed %d GATT characteristics of %s.", static_cast<int>(index->paths.size()), devicePath);
+}
 
-        // no match here
-        return false;
+
+void BluezAdapter::invalidateCharacteristicIndex(const char *address)
+{
+        std::lock_guard<std::recursive_mutex> lock(_mutex);
+
+        _characteristicIndexes.erase(getDevicePath(address));
 }
@@ -28,81 +28,290 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
 #include <string>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <dbus/dbus.h>
 
+#include "DBusEventWatcher.h"
+#include "EventLoop.h"
+#include "BluezObjectCache.h"
+#include "GattNotificationStream.h"
+#include "GattWriteStream.h"
+#include "Uuid.h"
+#include "MacAddress.h"
+#include "AddressTable.h"
 
 
-class BluezAdapter
+
+class BluezAdapter : public DBusEventWatcher::EventSink, public BluezObjectCache::Listener
 {
 public:
 
         struct DeviceInfo
         {
         public:
+                DeviceInfo() : _rssi(0), _rssiValid(false) {}
                 const char *address() const { return _address.c_str(); }
+                const MacAddress &mac() const { return _mac; }
                 void setAddress(const char *value);
                 const char *name() const { return _name.c_str(); }
                 void setName(const char *value);
+                bool rssiValid() const { return _rssiValid; }
+                int rssi() const { return _rssi; }
+                void setRssi(int value) { _rssi = value; _rssiValid = true; }
         private:
                 std::string _address;
+                MacAddress _mac;
                 std::string _name;
+                int _rssi;
+                bool _rssiValid;
         };
 
 
-        BluezAdapter(const char *hci);
-        ~BluezAdapter();
+        struct DiscoveryFilter
+        {
+        public:
+                DiscoveryFilter() : transport("le"), rssiThreshold(0), duplicateData(false) {}
+                std::string transport;            // "auto", "bredr" or "le"
+                std::vector<Uuid> uuids;   // advertised service UUIDs, empty for any
+                int rssiThreshold;                // in dBm, 0 for any
+                bool duplicateData;               // report every advertisement, not just changes
+        };
+
+
+        class DeviceListener
+        {
+        public:
+                virtual ~DeviceListener() {}
+                virtual void deviceAdvertised(BluezAdapter *adapter, const char *address, int rssi) = 0;
+                virtual void deviceConnectionChanged(BluezAdapter *adapter, const char *address, bool connected) = 0;
+                virtual void deviceServicesResolved(BluezAdapter *adapter, const char *address) = 0;
+                virtual void adapterRemoved(BluezAdapter *adapter) = 0;   // the controller has been unplugged
+        };
+
+
+        // classes of the asynchronous calls, a device's lane sends the more urgent ones first
+        enum CallPriority
+        {
+                PriorityInteractive = 0,   // the user is waiting for it (alerts)
+                PriorityStateSync = 1,     // keeps the device's state up to date (time, settings)
+                PriorityBackground = 2     // bulk transfers and maintenance
+        };
+        static const int CALL_PRIORITIES = 3;
+
+
+        typedef std::function<void(bool success)> ResultCallback;
+        typedef std::function<void(bool success, bool value)> BooleanCallback;
+        typedef std::function<void(bool success, const uint8_t *data, int length)> ReadCallback;
+
+
+        BluezAdapter(const char *hci, DBusConnection *connection = nullptr);
+        ~BluezAdapter() override;
+
+        static int findAdapters(DBusConnection *connection, std::vector<std::string> &hcis);
+
+        // the asynchronous calls started by the current thread get this class (state sync by default)
+        static void setCallPriority(CallPriority priority);
+        static CallPriority callPriority();
+
+        const char *id() const override { return "BluezAdapter"; }
+        int matchesCount() const override;
+        const char *match(int index) const override;
+        void inspectMessage(DBusMessage *message) override;
 
         bool dbusConnected() const { return (_connection); }
+        const char *hci() const { return _hci.c_str(); }
+
+        void attach(EventLoop *loop);
+        void detach();
 
-        int timeout() const { return _timeout; }
-        void setTimeout(int value) { _timeout = value; }
+        void setDeviceListener(DeviceListener *listener) { std::lock_guard<std::recursive_mutex> lock(_mutex); _deviceListener = listener; }
 
         bool powered();
 
         bool isDiscovering();
-        bool startDiscovery();
-        bool stopDiscovery();
-        int discoveredDevicesCount() const { return static_cast<int>(_discoveredDevices.size()); }
+        bool setDiscoveryFilter(const DiscoveryFilter &filter, int timeout = -1);
+        void addAddressFilter(const char *address);
+        void clearAddressFilter();
+        bool startDiscovery(int timeout = -1);
+        bool stopDiscovery(int timeout = -1);
+        int discoveredDevicesCount() const { std::lock_guard<std::recursive_mutex> lock(_mutex); return static_cast<int>(_discoveredDevices.size()); }
         const DeviceInfo *discoveredDeviceAt(int index) const;
+        const DeviceInfo *discoveredDevice(const char *address) const;
+        const DeviceInfo *discoveredDevice(const MacAddress &address) const;
+        void updateDiscoveredDevicesList();
 
+        bool knowsDevice(const char *address);
         bool isDeviceConnected(const char *address);
-        bool connectDevice(const char *address, bool verify = true);
-        bool disconnectDevice(const char *address, bool verify = true);
-        bool removeDevice(const char *address);
+        bool connectDevice(const char *address, bool verify = true, int timeout = -1);
+        bool disconnectDevice(const char *address, bool verify = true, int timeout = -1);
+        bool removeDevice(const char *address, int timeout = -1);
+
+        std::string findCharacteristicPath(const char *deviceAddress, const Uuid &charUuid);
+        int readCharacteristic(const char *charPath, uint8_t *buffer, int bufferSize, uint16_t offset = 0, int timeout = -1);
+        bool writeCharacteristic(const char *charPath, const uint8_t *buffer, int length, uint16_t offset = 0, int timeout = -1);
+
+        bool connectDeviceAsync(const char *address, ResultCallback callback, int timeout = -1);
+        bool callMethodAsync(const char *path, const char *interface, const char *method, ResultCallback callback, int timeout = -1);
+        bool readBooleanPropertyAsync(const char *path, const char *interface, const char *propName, BooleanCallback callback, int timeout = -1);
+        bool removeDeviceAsync(const char *address, ResultCallback callback, int timeout = -1);
+        bool readCharacteristicAsync(const char *charPath, ReadCallback callback, uint16_t offset = 0, int timeout = -1);
+        bool writeCharacteristicAsync(const char *charPath, const uint8_t *buffer, int length, ResultCallback callback, uint16_t offset = 0, int timeout = -1);
+        bool writeCharacteristicWithoutResponse(const char *charPath, const uint8_t *buffer, int length, int timeout = -1);
+        bool writeCharacteristicWithoutResponseAsync(const char *charPath, const uint8_t *buffer, int length, ResultCallback callback, int timeout = -1);
+        int pendingCallsCount() const { std::lock_guard<std::recursive_mutex> lock(_mutex); return static_cast<int>(_callsInFlight.size()) + _queuedCallsCount; }
+
+        GattNotificationStream *subscribeNotifications(const char *charPath, int timeout = -1);
+        void unsubscribeNotifications(GattNotificationStream *stream);
+        int notificationStreamsCount() const { std::lock_guard<std::recursive_mutex> lock(_mutex); return static_cast<int>(_notificationStreams.size()); }
+        GattNotificationStream *notificationStreamAt(int index) const;
 
-        char *findCharacteristicPath(const char *deviceAddress, const char *charUUID);
-        int readCharacteristic(const char *charPath, uint8_t *buffer, int bufferSize);
-        bool writeCharacteristic(const char *charPath, uint8_t *buffer, int length);
+        bool supportsWriteStream(const char *charPath);
+        bool writeCharacteristicStream(const char *charPath, const uint8_t *buffer, int length, int timeout = -1, int *written = nullptr);   // written is -1 without a socket
 
 protected:
 
+        struct CharacteristicIndex
+        {
+        public:
+                CharacteristicIndex() : populated(false) {}
+                bool populated;
+                std::unordered_map<Uuid, std::string, UuidHash> paths;   // object paths, empty path if known to be missing
+        };
+
+        // all state is guarded by the mutex, but it isn't held during blocking round trips, so devices
+        // can be served by several threads at once (asynchronous calls are sent by the dispatching thread)
+        mutable std::recursive_mutex _mutex;
+        std::thread::id _dispatchThread;
+        EventLoop *_loop;    // optional, otherwise the connection and the sockets have to be polled
+        int _wakeupFd;       // tells the loop about calls queued by other threads
         DBusConnection *_connection;
         std::string _hci;
-        int _timeout;
+        std::vector<std::string> _matches;   // signal match rules, limited to the adapter's objects
+        BluezObjectCache _objects;
         std::vector<DeviceInfo *> _discoveredDevices;
+        AddressTable<int> _discoveredIndex;     // index into the list of discovered devices
+        AddressTable<bool> _addressFilter;      // empty for any
+        DeviceListener *_deviceListener;
+        std::map<std::string, CharacteristicIndex> _characteristicIndexes;   // keyed by device path
 
         bool isValidAddress(const char *address) const;
         std::string getDevicePath(const char *address);
+        std::string getDevicePathOf(const char *objPath) const;
+        std::string getAddressOf(const char *devicePath) const;
 
         const char *getStringFromVariant(DBusMessageIter *variantIter);
         bool getBooleanFromVariant(DBusMessageIter *variantIter);
 
-        bool callMethod(const char *path, const char *interface, const char *method);
-        bool readBooleanProperty(const char *path, const char *interface, const char *propName, bool logErrors = true);
+        bool callMethod(const char *path, const char *interface, const char *method, int timeout);
+        bool readBooleanProperty(const char *path, const char *interface, const char *propName, int timeout, bool logErrors = true);
 
 private:
 
+        typedef std::function<void(DBusMessage *reply)> ReplyHandler;
+
+        struct PendingCall
+        {
+        public:
+                BluezAdapter *adapter;
+                std::string lane;
+                DBusMessage *query;
+                DBusPendingCall *pending;
+                int timeout;
+                int64_t deadline;
+                CallPriority priority;
+                ReplyHandler handler;
+        };
+
+        struct CallLane
+        {
+        public:
+                CallLane() : inFlight(0), bypassed() {}
+                bool hasQueued() const;
+                int inFlight;
+                std::deque<PendingCall *> queued[CALL_PRIORITIES];
+                int bypassed[CALL_PRIORITIES];   // calls of a more urgent class sent ahead of the class's next one
+        };
+
+        struct CommandTransfer
+        {
+        public:
+                std::string charPath;
+                std::vector<uint8_t> data;
+                int chunkSize;
+                int timeout;         // per chunk
+                int offset;          // start of the next chunk to be sent
+                int chunksSent;
+                int inFlight;        // unacknowledged chunks, each one holds a credit
+                bool syncing;        // waiting for the reply of an acknowledged write
+                bool failed;
+                bool pumping;
+                CallPriority priority;   // of the caller, the chunks are sent by the dispatching thread
+                ResultCallback callback;
+        };
+
+        std::map<std::string, CallLane> _callLanes;   // keyed by device path (or adapter path)
+        std::vector<PendingCall *> _callsInFlight;
+        int _queuedCallsCount;
+        std::vector<CommandTransfer *> _commandTransfers;
+        std::vector<GattNotificationStream *> _notificationStreams;
+        std::map<std::string, GattWriteStream *> _writeStreams;   // keyed by characteristic path
+        std::map<std::string, DBusMessage *> _queryTemplates;
+
+        DBusMessage *copyQueryTemplate(const std::string &key, const std::function<DBusMessage *()> &build);
+        void clearQueryTemplates();
+        DBusMessage *createMethodQuery(const char *path, const char *interface, const char *method);
+        DBusMessage *createPropertyQuery(const char *path, const char *interface, const char *propName);
+        DBusMessage *createRemoveDeviceQuery(const char *address);
+        DBusMessage *createReadCharacteristicQuery(const char *charPath, uint16_t offset);
+        DBusMessage *buildReadCharacteristicQuery(const char *charPath, uint16_t offset);
+        DBusMessage *createWriteCharacteristicQuery(const char *charPath, const uint8_t *buffer, int length, uint16_t offset, const char *writeType = nullptr);
+        int getByteArray(DBusMessage *reply, const uint8_t **data);
+
+        bool sendAsync(DBusMessage *query, int timeout, ReplyHandler handler) { return sendAsync(query, timeout, callPriority(), handler); }
+        bool sendAsync(DBusMessage *query, int timeout, CallPriority priority, ReplyHandler handler);
+        int nextQueuedClass(CallLane &callLane);
+        void startQueuedCalls(const std::string &lane);
+        void startQueuedCalls();
+        void completeCall(PendingCall *call, DBusMessage *reply);
+        void expireTimedOutCalls();
+        static void onPendingCallNotify(DBusPendingCall *pending, void *userData);
+        static int64_t monotonicMillis();
+        static int remainingMillis(int64_t deadline);
+
+        bool pumpCommandTransfer(CommandTransfer *transfer);
+
+        bool ensureObjectsSeeded();
+        void bluezOwnerChanged(DBusMessage *message);
+        void reseedObjects();
+        void interfaceAdded(const char *path, const char *interface) override;
+        void interfaceRemoved(const char *path, const char *interface) override;
+        void propertyChanged(const char *path, const char *interface, const char *name, const BluezObjectCache::Value &value) override;
+
         void clearDiscoveredDevicesList();
-        void updateDiscoveredDevicesList();
-        void updateDiscoveredDevicesList_object(DBusMessageIter *objIter);
-        void updateDiscoveredDevicesList_device(DBusMessageIter *deviceIter);
-        bool canReadConnectedProperty(const char *address);
+        void listDiscoveredDevices();
+        void updateDiscoveredDevice(const char *devicePath);
+        int indexOfDiscoveredDevice(const MacAddress &address) const;
+        void removeDiscoveredDeviceAt(int index);
+        bool passesAddressFilter(const MacAddress &address) const;
+
+        void populateCharacteristicIndex(const char *devicePath, CharacteristicIndex *index);
+        void invalidateCharacteristicIndex(const char *address);
 
-        const char *findCharacteristicPath_object(DBusMessageIter *objIter, const char *devicePath, const char *charUUID);
-        bool findCharacteristicPath_device(DBusMessageIter *deviceIter, const char *charUUID);
+        void addReadWriteOptions(DBusMessageIter *paramsIter, uint16_t offset, const char *writeType = nullptr);
 
-        void addReadWriteOptions(DBusMessage *query);
+        bool acquireSocket(const char *charPath, const char *method, int timeout, int *fd, int *mtu);
+        void closeStreams(const char *devicePath);
+        void watchNotificationStream(GattNotificationStream *stream);
+        void readNotificationSocket(int fd);
+        int drainNotificationStream(GattNotificationStream *stream);
+        void closeNotificationStream(GattNotificationStream *stream);
+        void wakeDispatcher();
 };
 
 #endif // BLUEZADAPTER_H
@@ -0,0 +1,362 @@
+/*
+ *
+ *  BluezObjectCache - A local mirror of the objects and properties exported by the Bluez daemon
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "BluezObjectCache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "Logger.h"
+#include "DBusMarshal.h"
+
+
+
+BluezObjectCache::BluezObjectCache()
+{
+        _seeded = false;
+        _listener = nullptr;
+}
+
+
+BluezObjectCache::~BluezObjectCache()
+{
+}
+
+
+bool BluezObjectCache::seed(DBusConnection *connection, int timeout)
+{
+        DBusMessage *reply = fetchObjects(connection, timeout);
+        if (!reply)
+                return false;
+        bool result = seed(reply);
+        dbus_message_unref(reply);
+        return result;
+}
+
+
+bool BluezObjectCache::seed(DBusMessage *reply)
+{
+        // guard
+        if (!reply)
+                return false;
+
+        // mirror all returned objects (the reply is an ObjectPath->(String->(String->Variant)) dictionary)
+        _objects.clear();
+        DBusMessageIter objArrayIter;
+        dbus_message_iter_init(reply, &objArrayIter);
+        if (!DBusMarshal::forEachEntry<DBusObjectPath>(&objArrayIter, [this](DBusObjectPath objPath, DBusMessageIter *interfacesIter)
+        {
+                parseInterfaces(objPath.value, interfacesIter, false);
+        }))
+                LOG_WARNING("Expected dictionary of managed objects, but it wasn't.");
+        _seeded = true;
+        LOG_DEBUG("Mirrored %d Bluez objects.", static_cast<int>(_objects.size()));
+        return true;
+}
+
+
+DBusMessage *BluezObjectCache::fetchObjects(DBusConnection *connection, int timeout)
+{
+        // guard
+        if (!connection)
+                return nullptr;
+
+        // prepare the query message
+        DBusMessage *query = createObjectsQuery();
+        if (!query)
+                return nullptr;
+
+        // send the query and wait for the reply (the cache isn't touched, so the caller needn't hold its lock)
+        DBusError dbusError;
+        dbus_error_init(&dbusError);
+        DBusMessage *reply = dbus_connection_send_with_reply_and_block(connection, query, timeout, &dbusError);
+        dbus_message_unref(query);
+        if (dbus_error_is_set(&dbusError))
+        {
+                LOG_ERROR("Couldn't execute command: %s", dbusError.message);
+                dbus_error_free(&dbusError);
+                return nullptr;
+        }
+        return reply;
+}
+
+
+DBusMessage *BluezObjectCache::createObjectsQuery()
+{
+        // the reply can be passed to seed(), e.g. when the query has been sent asynchronously
+        DBusMessage *query = dbus_message_new_method_call("org.bluez", "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+        if (!query)
+                LOG_ERROR("Couldn't allocate memory for the query message.");
+        return query;
+}
+
+
+void BluezObjectCache::clear()
+{
+        _objects.clear();
+        _seeded = false;
+}
+
+
+void BluezObjectCache::inspectMessage(DBusMessage *message)
+{
+        // signals received before seeding would be lost anyway
+        if (!_seeded || (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL))
+                return;
+
+        if (dbus_message_is_signal(message, "org.freedesktop.DBus.ObjectManager", "InterfacesAdded"))
+                handleInterfacesAdded(message);
+        else if (dbus_message_is_signal(message, "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved"))
+                handleInterfacesRemoved(message);
+        else if (dbus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged"))
+                handlePropertiesChanged(message);
+}
+
+
+const BluezObjectCache::Properties *BluezObjectCache::properties(const char *path, const char *interface) const
+{
+        Objects::const_iterator objIt = _objects.find(path);
+        if (objIt == _objects.end())
+                return nullptr;
+        Interfaces::const_iterator interfaceIt = objIt->second.find(interface);
+        if (interfaceIt == objIt->second.end())
+                return nullptr;
+        return &interfaceIt->second;
+}
+
+
+const BluezObjectCache::Value *BluezObjectCache::property(const char *path, const char *interface, const char *name) const
+{
+        const Properties *props = properties(path, interface);
+        if (!props)
+                return nullptr;
+        Properties::const_iterator propIt = props->find(name);
+        if (propIt == props->end())
+                return nullptr;
+        return &propIt->second;
+}
+
+
+bool BluezObjectCache::booleanProperty(const char *path, const char *interface, const char *name, bool defaultValue) const
+{
+        const Value *value = property(path, interface, name);
+        if (!value || (value->type != DBUS_TYPE_BOOLEAN))
+                return defaultValue;
+        return (value->number != 0);
+}
+
+
+int BluezObjectCache::integerProperty(const char *path, const char *interface, const char *name, int defaultValue) const
+{
+        const Value *value = property(path, interface, name);
+        if (!value || (value->type == DBUS_TYPE_INVALID) || !dbus_type_is_basic(value->type))
+                return defaultValue;
+        return static_cast<int>(value->number);
+}
+
+
+const char *BluezObjectCache::stringProperty(const char *path, const char *interface, const char *name) const
+{
+        const Value *value = property(path, interface, name);
+        if (!value || ((value->type != DBUS_TYPE_STRING) && (value->type != DBUS_TYPE_OBJECT_PATH)))
+                return nullptr;
+        return value->text.c_str();
+}
+
+
+void BluezObjectCache::parseInterfaces(const char *path, DBusMessageIter *interfacesIter, bool notify)
+{
+        // the interfaces should be stored in a String->Array dictionary
+        bool valid = DBusMarshal::forEachEntry<const char *>(interfacesIter, [this, path, notify](const char *interfaceName, DBusMessageIter *propsIter)
+        {
+                _objects[path][interfaceName].clear();
+                parseProperties(path, interfaceName, propsIter, false);
+                if (notify && _listener)
+                        _listener->interfaceAdded(path, interfaceName);
+        });
+        if (!valid)
+                LOG_WARNING("Expected dictionary of interfaces, but it wasn't.");
+}
+
+
+void BluezObjectCache::parseProperties(const char *path, const char *interface, DBusMessageIter *propsIter, bool notify)
+{
+        // the properties should be stored in a String->Variant dictionary
+        Properties &props = _objects[path][interface];
+        bool valid = DBusMarshal::forEachEntry<const char *>(propsIter, [this, path, interface, notify, &props](const char *propName, DBusMessageIter *variantIter)
+        {
+                Value &value = props[propName];
+                if (parseValue(variantIter, &value) && notify && _listener)
+                        _listener->propertyChanged(path, interface, propName, value);
+        });
+        if (!valid)
+                LOG_WARNING("Expected dictionary of properties, but it wasn't.");
+}
+
+
+bool BluezObjectCache::parseValue(DBusMessageIter *variantIter, Value *value)
+{
+        // make sure that it's really a variant
+        if (dbus_message_iter_get_arg_type(variantIter) != DBUS_TYPE_VARIANT)
+                return false;
+        DBusMessageIter valueIter;
+        dbus_message_iter_recurse(variantIter, &valueIter);
+        value->type = dbus_message_iter_get_arg_type(&valueIter);
+        value->number = 0;
+        value->text.clear();
+        value->bytes.clear();
+
+        // copy the value
+        switch (value->type)
+        {
+        case DBUS_TYPE_BOOLEAN:
+        {
+                dbus_bool_t boolValue = FALSE;
+                dbus_message_iter_get_basic(&valueIter, &boolValue);
+                value->number = (boolValue == TRUE) ? 1 : 0;
+                break;
+        }
+        case DBUS_TYPE_BYTE:
+        case DBUS_TYPE_INT16:
+        case DBUS_TYPE_UINT16:
+        case DBUS_TYPE_INT32:
+        case DBUS_TYPE_UINT32:
+        case DBUS_TYPE_INT64:
+        case DBUS_TYPE_UINT64:
+        {
+                DBusBasicValue basicValue;
+                memset(&basicValue, 0, sizeof(basicValue));
+                dbus_message_iter_get_basic(&valueIter, &basicValue);
+                if (value->type == DBUS_TYPE_BYTE)
+                        value->number = basicValue.byt;
+                else if (value->type == DBUS_TYPE_INT16)
+                        value->number = basicValue.i16;
+                else if (value->type == DBUS_TYPE_UINT16)
+                        value->number = basicValue.u16;
+                else if (value->type == DBUS_TYPE_INT32)
+                        value->number = basicValue.i32;
+                else if (value->type == DBUS_TYPE_UINT32)
+                        value->number = basicValue.u32;
+                else if (value->type == DBUS_TYPE_INT64)
+                        value->number = basicValue.i64;
+                else
+                        value->number = static_cast<int64_t>(basicValue.u64);
+                break;
+        }
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+        {
+                const char *text = nullptr;
+                dbus_message_iter_get_basic(&valueIter, &text);
+                if (text)
+                        value->text = text;
+                break;
+        }
+        case DBUS_TYPE_ARRAY:
+        {
+                // only byte arrays are kept, other containers are just marked as present
+                const uint8_t *data = nullptr;
+                int length = DBusMarshal::readBytes(&valueIter, &data);
+                if (length > 0)
+                        value->bytes.assign(data, data + length);
+                break;
+        }
+        default:
+                break;
+        }
+        return true;
+}
+
+
+void BluezObjectCache::handleInterfacesAdded(DBusMessage *message)
+{
+        // get the object's path
+        DBusMessageIter paramsIter;
+        DBusObjectPath objPath;
+        dbus_message_iter_init(message, &paramsIter);
+        if (!DBusMarshal::read(&paramsIter, &objPath) || (strncmp(objPath.value, "/org/bluez", 10) != 0))
+                return;
+
+        // store its interfaces
+        if (dbus_message_iter_next(&paramsIter))
+                parseInterfaces(objPath.value, &paramsIter, true);
+}
+
+
+void BluezObjectCache::handleInterfacesRemoved(DBusMessage *message)
+{
+        // get the object's path
+        DBusMessageIter paramsIter;
+        DBusObjectPath objPath;
+        dbus_message_iter_init(message, &paramsIter);
+        if (!DBusMarshal::read(&paramsIter, &objPath))
+                return;
+        Objects::iterator objIt = _objects.find(objPath.value);
+        if (objIt == _objects.end())
+                return;
+
+        // remove the listed interfaces
+        if (!dbus_message_iter_next(&paramsIter))
+                return;
+        DBusMarshal::forEachElement<const char *>(&paramsIter, [this, objPath, objIt](const char *interfaceName)
+        {
+                objIt->second.erase(interfaceName);
+                if (_listener)
+                        _listener->interfaceRemoved(objPath.value, interfaceName);
+        });
+
+        // objects without interfaces are gone
+        if (objIt->second.empty())
+                _objects.erase(objIt);
+}
+
+
+void BluezObjectCache::handlePropertiesChanged(DBusMessage *message)
+{
+        // only objects which are known are updated
+        const char *objPath = dbus_message_get_path(message);
+        if (!objPath || (_objects.find(objPath) == _objects.end()))
+                return;
+
+        // get the interface's name
+        DBusMessageIter paramsIter;
+        const char *interfaceName = nullptr;
+        dbus_message_iter_init(message, &paramsIter);
+        if (!DBusMarshal::read(&paramsIter, &interfaceName))
+                return;
+
+        // store the changed properties
+        if (!dbus_message_iter_next(&paramsIter))
+                return;
+        parseProperties(objPath, interfaceName, &paramsIter, true);
+
+        // drop the invalidated properties
+        if (!dbus_message_iter_next(&paramsIter))
+                return;
+        Properties &props = _objects[objPath][interfaceName];
+        DBusMarshal::forEachElement<const char *>(&paramsIter, [&props](const char *propName)
+        {
+                props.erase(propName);
+        });
+}
@@ -0,0 +1,101 @@
+/*
+ *
+ *  BluezObjectCache - A local mirror of the objects and properties exported by the Bluez daemon
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef BLUEZOBJECTCACHE_H
+#define BLUEZOBJECTCACHE_H
+
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <dbus/dbus.h>
+
+
+
+class BluezObjectCache
+{
+public:
+
+        struct Value
+        {
+        public:
+                Value() : type(DBUS_TYPE_INVALID), number(0) {}
+                int type;                     // DBus type of the value
+                int64_t number;               // booleans and integers
+                std::string text;             // strings and object paths
+                std::vector<uint8_t> bytes;   // byte arrays
+        };
+
+        typedef std::map<std::string, Value> Properties;       // keyed by property name
+        typedef std::map<std::string, Properties> Interfaces;  // keyed by interface name
+        typedef std::map<std::string, Interfaces> Objects;     // keyed by object path
+
+
+        class Listener
+        {
+        public:
+                virtual ~Listener() {}
+                virtual void interfaceAdded(const char *path, const char *interface) = 0;
+                virtual void interfaceRemoved(const char *path, const char *interface) = 0;
+                virtual void propertyChanged(const char *path, const char *interface, const char *name, const Value &value) = 0;
+        };
+
+
+        BluezObjectCache();
+        ~BluezObjectCache();
+
+        void setListener(Listener *listener) { _listener = listener; }
+
+        bool seeded() const { return _seeded; }
+        bool seed(DBusConnection *connection, int timeout);
+        bool seed(DBusMessage *reply);
+        static DBusMessage *fetchObjects(DBusConnection *connection, int timeout);
+        static DBusMessage *createObjectsQuery();
+        void clear();
+
+        void inspectMessage(DBusMessage *message);
+
+        const Objects &objects() const { return _objects; }
+        const Properties *properties(const char *path, const char *interface) const;
+        const Value *property(const char *path, const char *interface, const char *name) const;
+        bool booleanProperty(const char *path, const char *interface, const char *name, bool defaultValue = false) const;
+        int integerProperty(const char *path, const char *interface, const char *name, int defaultValue = 0) const;
+        const char *stringProperty(const char *path, const char *interface, const char *name) const;
+
+private:
+
+        Objects _objects;
+        bool _seeded;
+        Listener *_listener;
+
+        void parseInterfaces(const char *path, DBusMessageIter *interfacesIter, bool notify);
+        void parseProperties(const char *path, const char *interface, DBusMessageIter *propsIter, bool notify);
+        bool parseValue(DBusMessageIter *variantIter, Value *value);
+
+        void handleInterfacesAdded(DBusMessage *message);
+        void handleInterfacesRemoved(DBusMessage *message);
+        void handlePropertiesChanged(DBusMessage *message);
+};
+
+#endif // BLUEZOBJECTCACHE_H
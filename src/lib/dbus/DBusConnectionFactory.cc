@@ -0,0 +1,122 @@
+/*
+ *
+ *  DBusConnectionFactory - Hands out private DBus connections
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "DBusConnectionFactory.h"
+
+#include "Logger.h"
+
+
+
+DBusConnectionFactory::DBusConnectionFactory(DBusBusType bus)
+{
+        _bus = bus;
+        _entries.clear();
+}
+
+
+DBusConnectionFactory::~DBusConnectionFactory()
+{
+        // connections which are still in use are closed anyway
+        for (Entry &entry : _entries)
+        {
+                LOG_WARNING("DBus connection '%s' is still used by %d owners.", entry.key.c_str(), entry.users);
+                closeConnection(entry.connection);
+        }
+        _entries.clear();
+}
+
+
+DBusConnection *DBusConnectionFactory::acquire(const char *key)
+{
+        // guard
+        if (!key)
+                return nullptr;
+
+        // everyone asking for the same key shares one connection
+        for (Entry &entry : _entries)
+        {
+                if (entry.key == key)
+                {
+                        entry.users++;
+                        return entry.connection;
+                }
+        }
+
+        // open a new private connection
+        DBusError dbusError;
+        dbus_error_init(&dbusError);
+        DBusConnection *connection = dbus_bus_get_private(_bus, &dbusError);
+        if (dbus_error_is_set(&dbusError))
+        {
+                LOG_ERROR("Could not open a private DBus connection for '%s': %s", key, dbusError.message);
+                dbus_error_free(&dbusError);
+                return nullptr;
+        }
+        if (!connection)
+        {
+                LOG_ERROR("Could not open a private DBus connection for '%s'.", key);
+                return nullptr;
+        }
+        LOG_DEBUG("Opened private DBus connection for '%s'. Unique name: %s", key, dbus_bus_get_unique_name(connection));
+
+        // remember it
+        Entry entry;
+        entry.key = key;
+        entry.connection = connection;
+        entry.users = 1;
+        _entries.push_back(entry);
+        return connection;
+}
+
+
+void DBusConnectionFactory::release(DBusConnection *connection)
+{
+        // guard
+        if (!connection)
+                return;
+
+        // the connection is closed when its last user is gone
+        for (size_t i = 0; i < _entries.size(); i++)
+        {
+                if (_entries[i].connection != connection)
+                        continue;
+                _entries[i].users--;
+                if (_entries[i].users <= 0)
+                {
+                        LOG_DEBUG("Closing private DBus connection for '%s'.", _entries[i].key.c_str());
+                        closeConnection(connection);
+                        _entries.erase(_entries.begin() + i);
+                }
+                return;
+        }
+        LOG_WARNING("Tried to release an unknown DBus connection.");
+}
+
+
+void DBusConnectionFactory::closeConnection(DBusConnection *connection)
+{
+        // private connections have to be closed before the last reference is dropped
+        dbus_connection_flush(connection);
+        dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+}
@@ -0,0 +1,61 @@
+/*
+ *
+ *  DBusConnectionFactory - Hands out private DBus connections
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef DBUSCONNECTIONFACTORY_H
+#define DBUSCONNECTIONFACTORY_H
+
+
+#include <vector>
+#include <string>
+#include <dbus/dbus.h>
+
+
+
+class DBusConnectionFactory
+{
+public:
+
+        DBusConnectionFactory(DBusBusType bus);
+        ~DBusConnectionFactory();
+
+        DBusConnection *acquire(const char *key);
+        void release(DBusConnection *connection);
+        int connectionsCount() const { return static_cast<int>(_entries.size()); }
+
+private:
+
+        struct Entry
+        {
+        public:
+                std::string key;
+                DBusConnection *connection;
+                int users;
+        };
+
+        DBusBusType _bus;
+        std::vector<Entry> _entries;
+
+        static void closeConnection(DBusConnection *connection);
+};
+
+#endif // DBUSCONNECTIONFACTORY_H
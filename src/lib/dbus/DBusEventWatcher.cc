@@ -28,6 +28,7 @@
 #include <dbus/dbus.h>
 
 #include "Logger.h"
+#include "EventLoop.h"
 
 
 
@@ -104,6 +105,7 @@ DBusEventWatcher::DBusEventWatcher(bool watchSessionBus)
 {
         // initialize
         _sinks.clear();
+        _loop = nullptr;
 
         // open DBus connection
         DBusError dbusError;
@@ -125,11 +127,37 @@ DBusEventWatcher::DBusEventWatcher(bool watchSessionBus)
                 return;
         }
         LOG_DEBUG("Established DBus connection. Unique name: %s", dbus_bus_get_unique_name(_connection));
+
+        // incoming messages are handed to the sinks while the connection is being dispatched
+        if (!dbus_connection_add_filter(_connection, filterMessage, this, nullptr))
+                LOG_ERROR("Couldn't add message filter to the DBus connection.");
+}
+
+
+DBusEventWatcher::DBusEventWatcher(DBusConnection *connection)
+{
+        // initialize
+        _sinks.clear();
+        _loop = nullptr;
+        _connection = connection ? dbus_connection_ref(connection) : nullptr;
+        if (!_connection)
+                return;
+
+        // incoming messages are handed to the sinks while the connection is being dispatched
+        if (!dbus_connection_add_filter(_connection, filterMessage, this, nullptr))
+                LOG_ERROR("Couldn't add message filter to the DBus connection.");
 }
 
 
 DBusEventWatcher::~DBusEventWatcher()
 {
+        if (_connection)
+        {
+                if (_loop)
+                        _loop->removeConnection(_connection);
+                dbus_connection_remove_filter(_connection, filterMessage, this);
+                dbus_connection_unref(_connection);
+        }
 }
 
 
@@ -159,40 +187,64 @@ void DBusEventWatcher::registerSink(EventSink *sink)
 }
 
 
-bool DBusEventWatcher::checkQueue(int timeoutSecs)
+void DBusEventWatcher::unregisterSink(EventSink *sink)
 {
         // guard
-        if (!_connection)
-                return false;
+        if (!sink)
+                return;
 
-        // check for messages
-        bool pendingMessages = false;
-        for (int i = 0; i < (timeoutSecs * 10); i++)
+        // remove the sink
+        bool found = false;
+        for (size_t i = 0; i < _sinks.size(); i++)
         {
-                // give the connection some time to process messages
-                dbus_connection_read_write(_connection, 100);
-
-                // process all pending messages
-                while (true)
+                if (_sinks[i] == sink)
                 {
-                        // get the next message from the queue
-                        DBusMessage *message = dbus_connection_pop_message(_connection);
-                        if (message)
-                                pendingMessages = true;
-                        else
-                                break;
-
-                        // notify the event sinks
-                        for (EventSink *sink : _sinks)
-                                sink->inspectMessage(message);
-
-                        // clean up
-                        dbus_message_unref(message);
+                        _sinks.erase(_sinks.begin() + i);
+                        found = true;
+                        break;
                 }
+        }
+        if (!found)
+                return;
+        LOG_DEBUG("Removed event sink: %s", sink->id());
 
-                // stop waiting if there are pending messages
-                if (pendingMessages)
-                        break;
+        // remove the sink's matches (without waiting for the bus daemon's answer)
+        if (_connection)
+        {
+                for (int i = 0; i < sink->matchesCount(); i++)
+                        dbus_bus_remove_match(_connection, sink->match(i), nullptr);
         }
-        return pendingMessages;
+}
+
+
+bool DBusEventWatcher::attach(EventLoop *loop)
+{
+        // guards
+        if (!_connection || !loop)
+                return false;
+        if (_loop)
+                return (_loop == loop);
+
+        // from now on, the loop dispatches the connection as soon as a message arrives
+        if (!loop->addConnection(_connection))
+                return false;
+        _loop = loop;
+        return true;
+}
+
+
+DBusHandlerResult DBusEventWatcher::filterMessage(DBusConnection *connection, DBusMessage *message, void *userData)
+{
+        (void)connection;
+        DBusEventWatcher *watcher = static_cast<DBusEventWatcher *>(userData);
+
+        // notify the event sinks
+        for (EventSink *sink : watcher->_sinks)
+                sink->inspectMessage(message);
+
+        // we're only listening, but libdbus would answer unhandled (eavesdropped) method calls with an error,
+        // everything else is passed on so that its own handlers (e.g. for Disconnected) still run
+        if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+                return DBUS_HANDLER_RESULT_HANDLED;
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
@@ -28,6 +28,8 @@
 #include <vector>
 #include <dbus/dbus.h>
 
+class EventLoop;
+
 
 
 class DBusEventWatcher
@@ -51,16 +53,21 @@ public:
 
 
         DBusEventWatcher(bool watchSessionBus = true);
+        DBusEventWatcher(DBusConnection *connection);
         ~DBusEventWatcher();
 
         void registerSink(EventSink *sink);
+        void unregisterSink(EventSink *sink);
 
-        bool checkQueue(int timeoutSecs);
+        bool attach(EventLoop *loop);
 
 private:
 
         DBusConnection *_connection;
+        EventLoop *_loop;
         std::vector<EventSink *> _sinks;
+
+        static DBusHandlerResult filterMessage(DBusConnection *connection, DBusMessage *message, void *userData);
 };
 
 #endif // DBUSEVENTWATCHER_H
@@ -0,0 +1,285 @@
+/*
+ *
+ *  DBusMarshal - Typed encoding and decoding of DBus message arguments
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef DBUSMARSHAL_H
+#define DBUSMARSHAL_H
+
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <dbus/dbus.h>
+
+
+
+// object paths are strings with a DBus type of their own
+struct DBusObjectPath
+{
+public:
+        DBusObjectPath() : value(nullptr) {}
+        explicit DBusObjectPath(const char *path) : value(path) {}
+        const char *value;
+};
+
+
+
+// maps C++ types to DBus types (there's intentionally no generic version, so
+// unsupported types are rejected by the compiler)
+template<typename T> struct DBusTraits;
+
+template<> struct DBusTraits<bool>
+{
+        typedef dbus_bool_t Wire;
+        static const int type = DBUS_TYPE_BOOLEAN;
+        static const char *signature() { return DBUS_TYPE_BOOLEAN_AS_STRING; }
+        static Wire toWire(bool value) { return value ? TRUE : FALSE; }
+        static bool fromWire(Wire value) { return (value == TRUE); }
+};
+
+template<> struct DBusTraits<uint8_t>
+{
+        typedef uint8_t Wire;
+        static const int type = DBUS_TYPE_BYTE;
+        static const char *signature() { return DBUS_TYPE_BYTE_AS_STRING; }
+        static Wire toWire(uint8_t value) { return value; }
+        static uint8_t fromWire(Wire value) { return value; }
+};
+
+template<> struct DBusTraits<int16_t>
+{
+        typedef dbus_int16_t Wire;
+        static const int type = DBUS_TYPE_INT16;
+        static const char *signature() { return DBUS_TYPE_INT16_AS_STRING; }
+        static Wire toWire(int16_t value) { return value; }
+        static int16_t fromWire(Wire value) { return value; }
+};
+
+template<> struct DBusTraits<uint16_t>
+{
+        typedef dbus_uint16_t Wire;
+        static const int type = DBUS_TYPE_UINT16;
+        static const char *signature() { return DBUS_TYPE_UINT16_AS_STRING; }
+        static Wire toWire(uint16_t value) { return value; }
+        static uint16_t fromWire(Wire value) { return value; }
+};
+
+template<> struct DBusTraits<int32_t>
+{
+        typedef dbus_int32_t Wire;
+        static const int type = DBUS_TYPE_INT32;
+        static const char *signature() { return DBUS_TYPE_INT32_AS_STRING; }
+        static Wire toWire(int32_t value) { return value; }
+        static int32_t fromWire(Wire value) { return value; }
+};
+
+template<> struct DBusTraits<uint32_t>
+{
+        typedef dbus_uint32_t Wire;
+        static const int type = DBUS_TYPE_UINT32;
+        static const char *signature() { return DBUS_TYPE_UINT32_AS_STRING; }
+        static Wire toWire(uint32_t value) { return value; }
+        static uint32_t fromWire(Wire value) { return value; }
+};
+
+template<> struct DBusTraits<const char *>
+{
+        typedef const char *Wire;
+        static const int type = DBUS_TYPE_STRING;
+        static const char *signature() { return DBUS_TYPE_STRING_AS_STRING; }
+        static Wire toWire(const char *value) { return value ? value : ""; }
+        static const char *fromWire(Wire value) { return value; }
+};
+
+template<> struct DBusTraits<DBusObjectPath>
+{
+        typedef const char *Wire;
+        static const int type = DBUS_TYPE_OBJECT_PATH;
+        static const char *signature() { return DBUS_TYPE_OBJECT_PATH_AS_STRING; }
+        static Wire toWire(const DBusObjectPath &value) { return value.value; }
+        static DBusObjectPath fromWire(Wire value) { return DBusObjectPath(value); }
+};
+
+
+
+class DBusMarshal
+{
+public:
+
+        // basic values
+
+        template<typename T> static void append(DBusMessageIter *iter, const T &value)
+        {
+                typename DBusTraits<T>::Wire wire = DBusTraits<T>::toWire(value);
+                dbus_message_iter_append_basic(iter, DBusTraits<T>::type, &wire);
+        }
+
+        template<typename T> static bool read(DBusMessageIter *iter, T *value)
+        {
+                if (dbus_message_iter_get_arg_type(iter) != DBusTraits<T>::type)
+                        return false;
+                typename DBusTraits<T>::Wire wire;
+                dbus_message_iter_get_basic(iter, &wire);
+                *value = DBusTraits<T>::fromWire(wire);
+                return true;
+        }
+
+
+        // variants
+
+        template<typename T> static void appendVariant(DBusMessageIter *iter, const T &value)
+        {
+                DBusMessageIter variantIter;
+                dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, DBusTraits<T>::signature(), &variantIter);
+                append(&variantIter, value);
+                dbus_message_iter_close_container(iter, &variantIter);
+        }
+
+        template<typename T> static bool readVariant(DBusMessageIter *iter, T *value)
+        {
+                if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+                        return false;
+                DBusMessageIter valueIter;
+                dbus_message_iter_recurse(iter, &valueIter);
+                return read(&valueIter, value);
+        }
+
+
+        // arrays
+
+        static void appendBytes(DBusMessageIter *iter, const uint8_t *data, int length)
+        {
+                // byte arrays are copied in one go
+                DBusMessageIter arrayIter;
+                dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &arrayIter);
+                dbus_message_iter_append_fixed_array(&arrayIter, DBUS_TYPE_BYTE, &data, length);
+                dbus_message_iter_close_container(iter, &arrayIter);
+        }
+
+        static int readBytes(DBusMessageIter *iter, const uint8_t **data)
+        {
+                // the data isn't copied, it's valid as long as the message exists
+                *data = nullptr;
+                if ((dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) || (dbus_message_iter_get_element_type(iter) != DBUS_TYPE_BYTE))
+                        return -1;
+                DBusMessageIter byteIter;
+                dbus_message_iter_recurse(iter, &byteIter);
+                int length = 0;
+                dbus_message_iter_get_fixed_array(&byteIter, data, &length);
+                return length;
+        }
+
+        template<typename T> static void appendArray(DBusMessageIter *iter, const std::vector<T> &values)
+        {
+                DBusMessageIter arrayIter;
+                dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, DBusTraits<T>::signature(), &arrayIter);
+                for (const T &value : values)
+                        append(&arrayIter, value);
+                dbus_message_iter_close_container(iter, &arrayIter);
+        }
+
+        template<typename T, typename Visitor> static bool forEachElement(DBusMessageIter *iter, Visitor visit)
+        {
+                // the element type is checked once for the whole array
+                if ((dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) || (dbus_message_iter_get_element_type(iter) != DBusTraits<T>::type))
+                        return false;
+                DBusMessageIter elementIter;
+                dbus_message_iter_recurse(iter, &elementIter);
+                while (dbus_message_iter_get_arg_type(&elementIter) == DBusTraits<T>::type)
+                {
+                        typename DBusTraits<T>::Wire wire;
+                        dbus_message_iter_get_basic(&elementIter, &wire);
+                        visit(DBusTraits<T>::fromWire(wire));
+                        dbus_message_iter_next(&elementIter);
+                }
+                return true;
+        }
+
+
+        // dictionaries (the visitor gets the typed key and an iterator pointing to the value)
+
+        template<typename Key, typename Visitor> static bool forEachEntry(DBusMessageIter *iter, Visitor visit)
+        {
+                if ((dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) || (dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY))
+                        return false;
+                DBusMessageIter entriesIter;
+                dbus_message_iter_recurse(iter, &entriesIter);
+                while (dbus_message_iter_get_arg_type(&entriesIter) == DBUS_TYPE_DICT_ENTRY)
+                {
+                        DBusMessageIter entryIter;
+                        dbus_message_iter_recurse(&entriesIter, &entryIter);
+                        Key key;
+                        if (read(&entryIter, &key) && dbus_message_iter_next(&entryIter))
+                                visit(key, &entryIter);
+                        dbus_message_iter_next(&entriesIter);
+                }
+                return true;
+        }
+};
+
+
+
+// writes a String->Variant dictionary (e.g. an options parameter)
+class DBusDictWriter
+{
+public:
+
+        DBusDictWriter(DBusMessageIter *iter) : _parentIter(iter)
+        {
+                dbus_message_iter_open_container(_parentIter, DBUS_TYPE_ARRAY, "{sv}", &_dictIter);
+        }
+
+        template<typename T> void add(const char *key, const T &value)
+        {
+                DBusMessageIter entryIter;
+                dbus_message_iter_open_container(&_dictIter, DBUS_TYPE_DICT_ENTRY, nullptr, &entryIter);
+                DBusMarshal::append(&entryIter, key);
+                DBusMarshal::appendVariant(&entryIter, value);
+                dbus_message_iter_close_container(&_dictIter, &entryIter);
+        }
+
+        template<typename T> void addArray(const char *key, const std::vector<T> &values)
+        {
+                std::string signature = DBUS_TYPE_ARRAY_AS_STRING;
+                signature += DBusTraits<T>::signature();
+                DBusMessageIter entryIter;
+                DBusMessageIter variantIter;
+                dbus_message_iter_open_container(&_dictIter, DBUS_TYPE_DICT_ENTRY, nullptr, &entryIter);
+                DBusMarshal::append(&entryIter, key);
+                dbus_message_iter_open_container(&entryIter, DBUS_TYPE_VARIANT, signature.c_str(), &variantIter);
+                DBusMarshal::appendArray(&variantIter, values);
+                dbus_message_iter_close_container(&entryIter, &variantIter);
+                dbus_message_iter_close_container(&_dictIter, &entryIter);
+        }
+
+        void close()
+        {
+                dbus_message_iter_close_container(_parentIter, &_dictIter);
+        }
+
+private:
+
+        DBusMessageIter *_parentIter;
+        DBusMessageIter _dictIter;
+};
+
+#endif // DBUSMARSHAL_H
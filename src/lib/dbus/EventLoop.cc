@@ -0,0 +1,707 @@
+/*
+ *
+ *  EventLoop - An epoll based reactor for DBus connections, timers, signals and sockets
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "EventLoop.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <dbus/dbus.h>
+
+#include "Logger.h"
+
+
+
+#define MAX_EVENTS   32
+
+
+
+EventLoop::EventLoop()
+{
+        // initialize
+        _wakeupFd = -1;
+        _signalFd = -1;
+        _quit = false;
+        _dispatching = false;
+
+        // create the epoll instance
+        _epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epollFd < 0)
+        {
+                LOG_ERROR("Couldn't create epoll instance: %s", strerror(errno));
+                return;
+        }
+
+        // other threads can interrupt the wait (the counter is just reset, waking up is all that matters)
+        _wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_wakeupFd < 0)
+        {
+                LOG_ERROR("Couldn't create wakeup event: %s", strerror(errno));
+                return;
+        }
+        int fd = _wakeupFd;
+        addSource(fd, EPOLLIN, [fd](uint32_t events)
+        {
+                (void)events;
+                uint64_t count;
+                ssize_t length = read(fd, &count, sizeof(count));
+                (void)length;
+        }, true);
+}
+
+
+EventLoop::~EventLoop()
+{
+        // detach the connections, which removes their watches and timeouts
+        std::vector<DBusConnection *> connections;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                connections = _connections;
+        }
+        for (DBusConnection *connection : connections)
+                removeConnection(connection);
+
+        // close what the loop has opened itself
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (std::pair<const int, Source> &entry : _sources)
+                {
+                        if (entry.second.owned)
+                                close(entry.first);
+                }
+                _sources.clear();
+                _timeoutTimers.clear();
+        }
+        if (_epollFd >= 0)
+                close(_epollFd);
+}
+
+
+bool EventLoop::addConnection(DBusConnection *connection)
+{
+        // guards
+        if (!connection || (_epollFd < 0))
+                return false;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (DBusConnection *known : _connections)
+                {
+                        if (known == connection)
+                                return true;
+                }
+        }
+
+        // libdbus reports the connection's current watches and timeouts right away
+        if (!dbus_connection_set_watch_functions(connection, addWatch, removeWatch, toggleWatch, this, nullptr) ||
+            !dbus_connection_set_timeout_functions(connection, addTimeout, removeTimeout, toggleTimeout, this, nullptr))
+        {
+                LOG_ERROR("Couldn't attach DBus connection to the event loop.");
+                dbus_connection_set_watch_functions(connection, nullptr, nullptr, nullptr, nullptr, nullptr);
+                dbus_connection_set_timeout_functions(connection, nullptr, nullptr, nullptr, nullptr, nullptr);
+                return false;
+        }
+        dbus_connection_set_wakeup_main_function(connection, wakeupMain, this, nullptr);
+        dbus_connection_set_dispatch_status_function(connection, dispatchStatusChanged, this, nullptr);
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _connections.push_back(dbus_connection_ref(connection));
+        }
+
+        // messages which have already been received are dispatched by the next turn
+        wakeup();
+        return true;
+}
+
+
+void EventLoop::removeConnection(DBusConnection *connection)
+{
+        // guard
+        if (!connection)
+                return;
+
+        // forget the connection
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                bool found = false;
+                for (size_t i = 0; i < _connections.size(); i++)
+                {
+                        if (_connections[i] == connection)
+                        {
+                                _connections.erase(_connections.begin() + i);
+                                found = true;
+                                break;
+                        }
+                }
+                if (!found)
+                        return;
+        }
+
+        // resetting the functions removes all watches and timeouts
+        dbus_connection_set_dispatch_status_function(connection, nullptr, nullptr, nullptr);
+        dbus_connection_set_wakeup_main_function(connection, nullptr, nullptr, nullptr);
+        dbus_connection_set_watch_functions(connection, nullptr, nullptr, nullptr, nullptr, nullptr);
+        dbus_connection_set_timeout_functions(connection, nullptr, nullptr, nullptr, nullptr, nullptr);
+        dbus_connection_unref(connection);
+}
+
+
+bool EventLoop::addFd(int fd, uint32_t events, FdHandler handler)
+{
+        return addSource(fd, events, handler, false);
+}
+
+
+void EventLoop::removeFd(int fd)
+{
+        std::lock_guard<std::mutex> lock(_mutex);
+        dropSource(fd);
+}
+
+
+int EventLoop::addTimer(int delay, int interval, TimerHandler handler)
+{
+        // guard
+        if (_epollFd < 0)
+                return -1;
+
+        // every timer has a timerfd of its own, which doubles as the timer's ID
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0)
+        {
+                LOG_ERROR("Couldn't create timer: %s", strerror(errno));
+                return -1;
+        }
+        if (!armTimer(fd, delay, interval))
+        {
+                LOG_ERROR("Couldn't arm timer: %s", strerror(errno));
+                close(fd);
+                return -1;
+        }
+        bool added = addSource(fd, EPOLLIN, [fd, handler](uint32_t events)
+        {
+                (void)events;
+                if (readTimer(fd) && handler)
+                        handler();
+        }, true);
+        if (!added)
+        {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+bool EventLoop::rearmTimer(int timer, int delay, int interval)
+{
+        // only timers created by the loop can be rearmed
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::unordered_map<int, Source>::iterator it = _sources.find(timer);
+        if ((it == _sources.end()) || !it->second.owned || it->second.timeout)
+                return false;
+        return armTimer(timer, delay, interval);
+}
+
+
+void EventLoop::removeTimer(int timer)
+{
+        removeFd(timer);
+}
+
+
+int EventLoop::watchClockChanges(TimerHandler handler)
+{
+        // guard
+        if (_epollFd < 0)
+                return -1;
+
+        // a realtime timer which is cancelled when the clock is set (it's removed like any other timer)
+        int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0)
+        {
+                LOG_ERROR("Couldn't create clock watch: %s", strerror(errno));
+                return -1;
+        }
+        if (!armClockWatch(fd))
+        {
+                LOG_ERROR("Couldn't arm clock watch: %s", strerror(errno));
+                close(fd);
+                return -1;
+        }
+        bool added = addSource(fd, EPOLLIN, [fd, handler](uint32_t events)
+        {
+                (void)events;
+                uint64_t expirations = 0;
+                if ((read(fd, &expirations, sizeof(expirations)) < 0) && (errno == ECANCELED))
+                {
+                        armClockWatch(fd);
+                        if (handler)
+                                handler();
+                }
+        }, true);
+        if (!added)
+        {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+bool EventLoop::watchSignals(const std::vector<int> &signals, SignalHandler handler)
+{
+        // guards
+        if (_epollFd < 0)
+                return false;
+        if (_signalFd >= 0)
+        {
+                LOG_ERROR("Signals are already being watched.");
+                return false;
+        }
+
+        // the signals have to be blocked, otherwise they wouldn't be queued for the signalfd
+        // (threads inherit the mask, so this has to happen before any other thread is started)
+        sigset_t mask;
+        sigemptyset(&mask);
+        for (int signal : signals)
+                sigaddset(&mask, signal);
+        if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0)
+        {
+                LOG_ERROR("Couldn't block signals.");
+                return false;
+        }
+        int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd < 0)
+        {
+                LOG_ERROR("Couldn't create signalfd: %s", strerror(errno));
+                return false;
+        }
+        bool added = addSource(fd, EPOLLIN, [fd, handler](uint32_t events)
+        {
+                (void)events;
+                struct signalfd_siginfo info;
+                while (read(fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info)))
+                {
+                        if (handler)
+                                handler(static_cast<int>(info.ssi_signo));
+                }
+        }, true);
+        if (!added)
+        {
+                close(fd);
+                return false;
+        }
+        _signalFd = fd;
+        return true;
+}
+
+
+void EventLoop::wakeup()
+{
+        if (_wakeupFd < 0)
+                return;
+        uint64_t one = 1;
+        ssize_t length = write(_wakeupFd, &one, sizeof(one));
+        (void)length;
+}
+
+
+int EventLoop::runOnce(int timeout)
+{
+        // guard
+        if (_epollFd < 0)
+                return -1;
+
+        // messages may already be queued (e.g. if they have been read by another thread's blocking call)
+        int handled = dispatchConnections();
+
+        // wait for the next events, but don't wait at all if there has been something to do
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(_epollFd, events, MAX_EVENTS, (handled > 0) ? 0 : timeout);
+        if (count < 0)
+        {
+                if (errno != EINTR)
+                        LOG_ERROR("Couldn't wait for events: %s", strerror(errno));
+                count = 0;
+        }
+        for (int i = 0; i < count; i++)
+                handleEvent(events[i].data.fd, events[i].events);
+
+        // what has been read is dispatched right away
+        return handled + count + dispatchConnections();
+}
+
+
+void EventLoop::run()
+{
+        while (!_quit)
+                runOnce(-1);
+}
+
+
+void EventLoop::quit()
+{
+        _quit = true;
+        wakeup();
+}
+
+
+bool EventLoop::addSource(int fd, uint32_t events, FdHandler handler, bool owned)
+{
+        // guards
+        if ((fd < 0) || (_epollFd < 0))
+                return false;
+
+        // a file descriptor can only be watched once
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_sources.find(fd) != _sources.end())
+        {
+                LOG_ERROR("File descriptor %d is already being watched.", fd);
+                return false;
+        }
+        Source &source = _sources[fd];
+        source.fd = fd;
+        source.events = events;
+        source.owned = owned;
+        source.handler = handler;
+        if (!updateSource(source))
+        {
+                _sources.erase(fd);
+                return false;
+        }
+        return true;
+}
+
+
+void EventLoop::dropSource(int fd)
+{
+        std::unordered_map<int, Source>::iterator it = _sources.find(fd);
+        if (it == _sources.end())
+                return;
+        if (it->second.registered)
+                epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        if (it->second.owned)
+                close(fd);
+        _sources.erase(it);
+}
+
+
+bool EventLoop::updateSource(Source &source)
+{
+        // a source without any events isn't registered at all, since hangups would be reported anyway
+        if (source.events == 0)
+        {
+                if (source.registered)
+                        epoll_ctl(_epollFd, EPOLL_CTL_DEL, source.fd, nullptr);
+                source.registered = false;
+                return true;
+        }
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = source.events;
+        event.data.fd = source.fd;
+        if (epoll_ctl(_epollFd, source.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, source.fd, &event) != 0)
+        {
+                LOG_ERROR("Couldn't watch file descriptor %d: %s", source.fd, strerror(errno));
+                return false;
+        }
+        source.registered = true;
+        return true;
+}
+
+
+uint32_t EventLoop::watchEvents(const Source &source)
+{
+        // libdbus may use one file descriptor for several watches
+        uint32_t events = 0;
+        for (DBusWatch *watch : source.watches)
+        {
+                if (!dbus_watch_get_enabled(watch))
+                        continue;
+                unsigned int flags = dbus_watch_get_flags(watch);
+                if (flags & DBUS_WATCH_READABLE)
+                        events |= EPOLLIN;
+                if (flags & DBUS_WATCH_WRITABLE)
+                        events |= EPOLLOUT;
+        }
+        return events;
+}
+
+
+void EventLoop::handleEvent(int fd, uint32_t events)
+{
+        // take what's needed from the source, since the handlers may change the sources
+        FdHandler handler;
+        std::vector<DBusWatch *> watches;
+        DBusTimeout *timeout = nullptr;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                std::unordered_map<int, Source>::iterator it = _sources.find(fd);
+                if (it == _sources.end())
+                        return;
+                handler = it->second.handler;
+                watches = it->second.watches;
+                timeout = it->second.timeout;
+        }
+
+        // a DBus timeout has expired
+        if (timeout)
+        {
+                if (readTimer(fd))
+                        dbus_timeout_handle(timeout);
+                return;
+        }
+
+        // a DBus connection's socket is ready
+        if (!watches.empty())
+        {
+                unsigned int condition = 0;
+                if (events & EPOLLIN)
+                        condition |= DBUS_WATCH_READABLE;
+                if (events & EPOLLOUT)
+                        condition |= DBUS_WATCH_WRITABLE;
+                if (events & EPOLLHUP)
+                        condition |= DBUS_WATCH_HANGUP;
+                if (events & EPOLLERR)
+                        condition |= DBUS_WATCH_ERROR;
+                for (DBusWatch *watch : watches)
+                {
+                        // handling one watch may remove the others (e.g. when the connection has been closed)
+                        {
+                                std::lock_guard<std::mutex> lock(_mutex);
+                                std::unordered_map<int, Source>::iterator it = _sources.find(fd);
+                                if (it == _sources.end())
+                                        return;
+                                bool known = false;
+                                for (DBusWatch *current : it->second.watches)
+                                        known = known || (current == watch);
+                                if (!known)
+                                        continue;
+                        }
+                        if (!dbus_watch_get_enabled(watch))
+                                continue;
+                        unsigned int flags = dbus_watch_get_flags(watch) | DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR;
+                        if (condition & flags)
+                                dbus_watch_handle(watch, condition & flags);
+                }
+                return;
+        }
+
+        // anything else has a handler
+        if (handler)
+                handler(events);
+}
+
+
+int EventLoop::dispatchConnections()
+{
+        // a connection can't be dispatched again by a message handler which runs the loop
+        if (_dispatching)
+                return 0;
+        std::vector<DBusConnection *> connections;
+        {
+                std::lock_guard<std::mutex> lock(_mutex);
+                connections = _connections;
+        }
+
+        // the replies to asynchronous calls are consumed by their pending calls, everything else goes through the filters
+        _dispatching = true;
+        int dispatched = 0;
+        for (DBusConnection *connection : connections)
+        {
+                dbus_connection_ref(connection);
+                while (dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS)
+                {
+                        dbus_connection_dispatch(connection);
+                        dispatched++;
+                }
+                dbus_connection_unref(connection);
+        }
+        _dispatching = false;
+        return dispatched;
+}
+
+
+bool EventLoop::armTimer(int fd, int delay, int interval)
+{
+        // a negative delay disarms the timer, zero fires it right away
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (delay >= 0)
+        {
+                spec.it_value.tv_sec = delay / 1000;
+                spec.it_value.tv_nsec = (delay % 1000) * 1000000L;
+                if (delay == 0)
+                        spec.it_value.tv_nsec = 1;
+                if (interval > 0)
+                {
+                        spec.it_interval.tv_sec = interval / 1000;
+                        spec.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+                }
+        }
+        return (timerfd_settime(fd, 0, &spec, nullptr) == 0);
+}
+
+
+bool EventLoop::armClockWatch(int fd)
+{
+        // the timer itself never expires, it's only there to be cancelled
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = static_cast<time_t>(INT32_MAX);
+        return (timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, nullptr) == 0);
+}
+
+
+bool EventLoop::readTimer(int fd)
+{
+        // a timer may have been rearmed after it had become readable
+        uint64_t expirations = 0;
+        return (read(fd, &expirations, sizeof(expirations)) == static_cast<ssize_t>(sizeof(expirations)));
+}
+
+
+dbus_bool_t EventLoop::addWatch(DBusWatch *watch, void *data)
+{
+        EventLoop *loop = static_cast<EventLoop *>(data);
+        int fd = dbus_watch_get_unix_fd(watch);
+        std::lock_guard<std::mutex> lock(loop->_mutex);
+        Source &source = loop->_sources[fd];
+        source.fd = fd;
+        source.watches.push_back(watch);
+        source.events = watchEvents(source);
+        return loop->updateSource(source) ? TRUE : FALSE;
+}
+
+
+void EventLoop::removeWatch(DBusWatch *watch, void *data)
+{
+        EventLoop *loop = static_cast<EventLoop *>(data);
+        int fd = dbus_watch_get_unix_fd(watch);
+        std::lock_guard<std::mutex> lock(loop->_mutex);
+        std::unordered_map<int, Source>::iterator it = loop->_sources.find(fd);
+        if (it == loop->_sources.end())
+                return;
+        Source &source = it->second;
+        for (size_t i = 0; i < source.watches.size(); i++)
+        {
+                if (source.watches[i] == watch)
+                {
+                        source.watches.erase(source.watches.begin() + i);
+                        break;
+                }
+        }
+        if (source.watches.empty())
+        {
+                loop->dropSource(fd);
+                return;
+        }
+        source.events = watchEvents(source);
+        loop->updateSource(source);
+}
+
+
+void EventLoop::toggleWatch(DBusWatch *watch, void *data)
+{
+        EventLoop *loop = static_cast<EventLoop *>(data);
+        int fd = dbus_watch_get_unix_fd(watch);
+        std::lock_guard<std::mutex> lock(loop->_mutex);
+        std::unordered_map<int, Source>::iterator it = loop->_sources.find(fd);
+        if (it == loop->_sources.end())
+                return;
+        it->second.events = watchEvents(it->second);
+        loop->updateSource(it->second);
+}
+
+
+dbus_bool_t EventLoop::addTimeout(DBusTimeout *timeout, void *data)
+{
+        // DBus timeouts keep firing at their interval until they're disabled or removed
+        EventLoop *loop = static_cast<EventLoop *>(data);
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0)
+                return FALSE;
+        int interval = dbus_timeout_get_interval(timeout);
+        armTimer(fd, dbus_timeout_get_enabled(timeout) ? interval : -1, interval);
+        std::lock_guard<std::mutex> lock(loop->_mutex);
+        Source &source = loop->_sources[fd];
+        source.fd = fd;
+        source.events = EPOLLIN;
+        source.owned = true;
+        source.timeout = timeout;
+        if (!loop->updateSource(source))
+        {
+                loop->_sources.erase(fd);
+                close(fd);
+                return FALSE;
+        }
+        loop->_timeoutTimers[timeout] = fd;
+        return TRUE;
+}
+
+
+void EventLoop::removeTimeout(DBusTimeout *timeout, void *data)
+{
+        EventLoop *loop = static_cast<EventLoop *>(data);
+        std::lock_guard<std::mutex> lock(loop->_mutex);
+        std::unordered_map<DBusTimeout *, int>::iterator it = loop->_timeoutTimers.find(timeout);
+        if (it == loop->_timeoutTimers.end())
+                return;
+        loop->dropSource(it->second);
+        loop->_timeoutTimers.erase(it);
+}
+
+
+void EventLoop::toggleTimeout(DBusTimeout *timeout, void *data)
+{
+        EventLoop *loop = static_cast<EventLoop *>(data);
+        std::lock_guard<std::mutex> lock(loop->_mutex);
+        std::unordered_map<DBusTimeout *, int>::iterator it = loop->_timeoutTimers.find(timeout);
+        if (it == loop->_timeoutTimers.end())
+                return;
+        int interval = dbus_timeout_get_interval(timeout);
+        armTimer(it->second, dbus_timeout_get_enabled(timeout) ? interval : -1, interval);
+}
+
+
+void EventLoop::wakeupMain(void *data)
+{
+        // another thread has queued something for the connection
+        static_cast<EventLoop *>(data)->wakeup();
+}
+
+
+void EventLoop::dispatchStatusChanged(DBusConnection *connection, DBusDispatchStatus status, void *data)
+{
+        // this may be called by any thread which reads from the connection
+        (void)connection;
+        if (status == DBUS_DISPATCH_DATA_REMAINS)
+                static_cast<EventLoop *>(data)->wakeup();
+}
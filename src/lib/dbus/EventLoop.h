@@ -0,0 +1,119 @@
+/*
+ *
+ *  EventLoop - An epoll based reactor for DBus connections, timers, signals and sockets
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
+#include <dbus/dbus.h>
+
+
+
+class EventLoop
+{
+public:
+
+        typedef std::function<void(uint32_t events)> FdHandler;
+        typedef std::function<void()> TimerHandler;
+        typedef std::function<void(int signal)> SignalHandler;
+
+
+        EventLoop();
+        ~EventLoop();
+
+        bool isValid() const { return (_epollFd >= 0); }
+
+        bool addConnection(DBusConnection *connection);
+        void removeConnection(DBusConnection *connection);
+
+        bool addFd(int fd, uint32_t events, FdHandler handler);
+        void removeFd(int fd);
+
+        int addTimer(int delay, int interval, TimerHandler handler);
+        bool rearmTimer(int timer, int delay, int interval);
+        void removeTimer(int timer);
+        int watchClockChanges(TimerHandler handler);
+
+        bool watchSignals(const std::vector<int> &signals, SignalHandler handler);
+
+        void wakeup();
+        int runOnce(int timeout);
+        void run();
+        void quit();
+        bool quitting() const { return _quit; }
+
+private:
+
+        struct Source
+        {
+        public:
+                Source() : fd(-1), events(0), registered(false), owned(false), timeout(nullptr) {}
+                int fd;
+                uint32_t events;                    // requested from epoll
+                bool registered;                    // known to epoll
+                bool owned;                         // closed together with the source
+                FdHandler handler;                  // plain file descriptors, timers and signals
+                std::vector<DBusWatch *> watches;   // DBus watches sharing the file descriptor
+                DBusTimeout *timeout;               // DBus timeout backed by a timer
+        };
+
+        // the DBus callbacks may come from any thread which uses a connection, so the sources are guarded
+        // (libdbus takes the mutex with a connection locked, so no handler may run while it's held)
+        std::mutex _mutex;
+        int _epollFd;
+        int _wakeupFd;
+        int _signalFd;
+        std::atomic<bool> _quit;
+        bool _dispatching;
+        std::unordered_map<int, Source> _sources;                 // keyed by file descriptor
+        std::unordered_map<DBusTimeout *, int> _timeoutTimers;    // timer file descriptors of the DBus timeouts
+        std::vector<DBusConnection *> _connections;
+
+        bool addSource(int fd, uint32_t events, FdHandler handler, bool owned);
+        void dropSource(int fd);
+        bool updateSource(Source &source);
+        static uint32_t watchEvents(const Source &source);
+        void handleEvent(int fd, uint32_t events);
+        int dispatchConnections();
+
+        static bool armTimer(int fd, int delay, int interval);
+        static bool armClockWatch(int fd);
+        static bool readTimer(int fd);
+
+        static dbus_bool_t addWatch(DBusWatch *watch, void *data);
+        static void removeWatch(DBusWatch *watch, void *data);
+        static void toggleWatch(DBusWatch *watch, void *data);
+        static dbus_bool_t addTimeout(DBusTimeout *timeout, void *data);
+        static void removeTimeout(DBusTimeout *timeout, void *data);
+        static void toggleTimeout(DBusTimeout *timeout, void *data);
+        static void wakeupMain(void *data);
+        static void dispatchStatusChanged(DBusConnection *connection, DBusDispatchStatus status, void *data);
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,182 @@
+/*
+ *
+ *  GattNotificationStream - Buffers the notifications sent by a GATT characteristic
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "GattNotificationStream.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "Logger.h"
+
+
+
+#define RING_SLOTS         64
+#define MAX_PACKET_SIZE    512
+
+
+
+GattNotificationStream::GattNotificationStream(const char *charPath, int fd, int mtu)
+{
+        // initialize
+        _charPath = charPath ? charPath : "";
+        _fd = fd;
+        _open = true;
+        _head = 0;
+        _count = 0;
+        _dropped = 0;
+
+        // a notification's payload is three bytes shorter than the ATT MTU
+        _slotSize = (mtu > 3) ? (mtu - 3) : MAX_PACKET_SIZE;
+        if (_slotSize > MAX_PACKET_SIZE)
+                _slotSize = MAX_PACKET_SIZE;
+
+        // all buffers are allocated up front
+        _buffer = new uint8_t[RING_SLOTS * _slotSize];
+        _lengths = new int[RING_SLOTS];
+
+        // the socket must not block the daemon
+        if (_fd >= 0)
+        {
+                int flags = fcntl(_fd, F_GETFL, 0);
+                if ((flags < 0) || (fcntl(_fd, F_SETFL, flags | O_NONBLOCK) < 0))
+                        LOG_WARNING("Couldn't make the notification socket of %s non-blocking.", _charPath.c_str());
+        }
+}
+
+
+GattNotificationStream::~GattNotificationStream()
+{
+        close();
+        delete[] _buffer;
+        delete[] _lengths;
+}
+
+
+void GattNotificationStream::close()
+{
+        if (_fd >= 0)
+        {
+                ::close(_fd);
+                _fd = -1;
+        }
+        _open = false;
+}
+
+
+int GattNotificationStream::readPackets()
+{
+        // guard
+        if (!_open || (_fd < 0))
+                return -1;
+
+        // each read returns exactly one notification, which goes straight into the ring buffer
+        // (a dead socket is only marked as closed, its owner has to stop watching it before it's closed)
+        int packets = 0;
+        while (true)
+        {
+                ssize_t length = recv(_fd, nextSlot(), _slotSize, MSG_DONTWAIT);
+                if (length > 0)
+                {
+                        commitSlot(static_cast<int>(length));
+                        packets++;
+                        continue;
+                }
+                if (length == 0)
+                {
+                        LOG_DEBUG("Notification socket of %s has been closed.", _charPath.c_str());
+                        _open = false;
+                        break;
+                }
+                if (errno == EINTR)
+                        continue;
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                {
+                        LOG_ERROR("Couldn't read from notification socket of %s: %s", _charPath.c_str(), strerror(errno));
+                        _open = false;
+                }
+                break;
+        }
+        return packets;
+}
+
+
+bool GattNotificationStream::pushPacket(const uint8_t *data, int length)
+{
+        // guards
+        if (!_open || !data || (length < 0))
+                return false;
+        if (length > _slotSize)
+        {
+                LOG_WARNING("Truncated notification of %s from %d to %d bytes.", _charPath.c_str(), length, _slotSize);
+                length = _slotSize;
+        }
+
+        // copy the packet into the ring buffer
+        memcpy(nextSlot(), data, length);
+        commitSlot(length);
+        return true;
+}
+
+
+int GattNotificationStream::dispatchPackets()
+{
+        // hand the buffered packets to the handler (without a handler, they're discarded)
+        int dispatched = 0;
+        while (_count > 0)
+        {
+                if (_handler)
+                        _handler(_buffer + (_head * _slotSize), _lengths[_head]);
+                _head = (_head + 1) % RING_SLOTS;
+                _count--;
+                dispatched++;
+        }
+        return dispatched;
+}
+
+
+uint8_t *GattNotificationStream::nextSlot() const
+{
+        // if the ring is full, the oldest packet gets overwritten
+        int index = (_head + _count) % RING_SLOTS;
+        return _buffer + (index * _slotSize);
+}
+
+
+void GattNotificationStream::commitSlot(int length)
+{
+        int index = (_head + _count) % RING_SLOTS;
+        _lengths[index] = length;
+        if (_count < RING_SLOTS)
+                _count++;
+        else
+        {
+                _head = (_head + 1) % RING_SLOTS;
+                _dropped++;
+                if ((_dropped % RING_SLOTS) == 1)
+                        LOG_WARNING("Notification buffer of %s overflowed, %lu packets dropped so far.", _charPath.c_str(), _dropped);
+        }
+}
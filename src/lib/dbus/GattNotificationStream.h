@@ -0,0 +1,75 @@
+/*
+ *
+ *  GattNotificationStream - Buffers the notifications sent by a GATT characteristic
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef GATTNOTIFICATIONSTREAM_H
+#define GATTNOTIFICATIONSTREAM_H
+
+
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+
+
+class GattNotificationStream
+{
+public:
+
+        typedef std::function<void(const uint8_t *data, int length)> PacketHandler;
+
+
+        GattNotificationStream(const char *charPath, int fd, int mtu);
+        ~GattNotificationStream();
+
+        const char *charPath() const { return _charPath.c_str(); }
+        int fd() const { return _fd; }
+        bool acquired() const { return (_fd >= 0); }
+        bool isOpen() const { return _open; }
+        void close();
+
+        void setPacketHandler(PacketHandler handler) { _handler = handler; }
+
+        int readPackets();
+        bool pushPacket(const uint8_t *data, int length);
+        int dispatchPackets();
+        int pendingPackets() const { return _count; }
+        unsigned long droppedPackets() const { return _dropped; }
+
+private:
+
+        std::string _charPath;
+        int _fd;
+        bool _open;
+        int _slotSize;
+        uint8_t *_buffer;
+        int *_lengths;
+        int _head;
+        int _count;
+        unsigned long _dropped;
+        PacketHandler _handler;
+
+        uint8_t *nextSlot() const;
+        void commitSlot(int length);
+};
+
+#endif // GATTNOTIFICATIONSTREAM_H
@@ -0,0 +1,178 @@
+/*
+ *
+ *  GattWriteStream - Writes bulk data to a GATT characteristic through a socket
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "GattWriteStream.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "Logger.h"
+
+
+
+#define MAX_CHUNK_SIZE       512
+#define CHUNKS_PER_SYSCALL   16
+
+
+
+GattWriteStream::GattWriteStream(const char *charPath, int fd, int mtu)
+{
+        // initialize
+        _charPath = charPath ? charPath : "";
+        _fd = fd;
+        _bytesWritten = 0;
+
+        // every packet is one ATT write command, which is three bytes shorter than the MTU
+        _chunkSize = (mtu > 3) ? (mtu - 3) : 20;
+        if (_chunkSize > MAX_CHUNK_SIZE)
+                _chunkSize = MAX_CHUNK_SIZE;
+
+        // backpressure is handled by polling, so the socket must not block
+        if (_fd >= 0)
+        {
+                int flags = fcntl(_fd, F_GETFL, 0);
+                if ((flags < 0) || (fcntl(_fd, F_SETFL, flags | O_NONBLOCK) < 0))
+                        LOG_WARNING("Couldn't make the write socket of %s non-blocking.", _charPath.c_str());
+        }
+}
+
+
+GattWriteStream::~GattWriteStream()
+{
+        close();
+}
+
+
+void GattWriteStream::close()
+{
+        if (_fd >= 0)
+        {
+                ::close(_fd);
+                _fd = -1;
+        }
+}
+
+
+bool GattWriteStream::write(const uint8_t *buffer, int length, int timeout, int *written)
+{
+        // guards
+        if (written)
+                *written = 0;
+        if (_fd < 0)
+                return false;
+        if (!buffer || (length < 0))
+                return false;
+
+        // several chunks are handed to the kernel with a single call
+        int64_t start = monotonicMillis();
+        int64_t deadline = start + timeout;
+        struct iovec iovecs[CHUNKS_PER_SYSCALL];
+        struct mmsghdr messages[CHUNKS_PER_SYSCALL];
+        int offset = 0;
+        while (offset < length)
+        {
+                int count = 0;
+                for (int pos = offset; (pos < length) && (count < CHUNKS_PER_SYSCALL); pos += _chunkSize)
+                {
+                        int chunk = length - pos;
+                        if (chunk > _chunkSize)
+                                chunk = _chunkSize;
+                        iovecs[count].iov_base = const_cast<uint8_t *>(buffer + pos);
+                        iovecs[count].iov_len = chunk;
+                        memset(&messages[count], 0, sizeof(struct mmsghdr));
+                        messages[count].msg_hdr.msg_iov = &iovecs[count];
+                        messages[count].msg_hdr.msg_iovlen = 1;
+                        count++;
+                }
+                int sent = sendmmsg(_fd, messages, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (sent > 0)
+                {
+                        for (int i = 0; i < sent; i++)
+                                offset += static_cast<int>(iovecs[i].iov_len);
+                        if (written)
+                                *written = offset;
+                        continue;
+                }
+                if ((sent < 0) && (errno == EINTR))
+                        continue;
+
+                // the controller's buffers are full, wait until there's room again (a payload which has been cut off
+                // mustn't be continued by the next one, so the socket is closed and has to be acquired again)
+                if ((sent == 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+                {
+                        if (waitUntilWritable(deadline))
+                                continue;
+                        LOG_ERROR("Timed out while writing to %s after %d of %d bytes.", _charPath.c_str(), offset, length);
+                        _bytesWritten += offset;
+                        close();
+                        return false;
+                }
+                LOG_ERROR("Couldn't write to %s: %s", _charPath.c_str(), strerror(errno));
+                _bytesWritten += offset;
+                close();
+                return false;
+        }
+
+        // report the throughput
+        _bytesWritten += length;
+        int64_t elapsed = monotonicMillis() - start;
+        if (elapsed > 0)
+                LOG_DEBUG("Wrote %d bytes to %s in %d ms (%.1f kB/s).", length, _charPath.c_str(), static_cast<int>(elapsed), length / static_cast<double>(elapsed));
+        else
+                LOG_DEBUG("Wrote %d bytes to %s in less than 1 ms.", length, _charPath.c_str());
+        return true;
+}
+
+
+bool GattWriteStream::waitUntilWritable(int64_t deadline)
+{
+        while (true)
+        {
+                int64_t remaining = deadline - monotonicMillis();
+                if (remaining <= 0)
+                        return false;
+                struct pollfd pfd;
+                pfd.fd = _fd;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                int result = poll(&pfd, 1, static_cast<int>(remaining));
+                if ((result < 0) && (errno == EINTR))
+                        continue;
+                if (result <= 0)
+                        return false;
+                return ((pfd.revents & POLLOUT) != 0);
+        }
+}
+
+
+int64_t GattWriteStream::monotonicMillis()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,60 @@
+/*
+ *
+ *  GattWriteStream - Writes bulk data to a GATT characteristic through a socket
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef GATTWRITESTREAM_H
+#define GATTWRITESTREAM_H
+
+
+#include <stdint.h>
+#include <string>
+
+
+
+class GattWriteStream
+{
+public:
+
+        GattWriteStream(const char *charPath, int fd, int mtu);
+        ~GattWriteStream();
+
+        const char *charPath() const { return _charPath.c_str(); }
+        int fd() const { return _fd; }
+        int chunkSize() const { return _chunkSize; }
+        bool isOpen() const { return (_fd >= 0); }
+        void close();
+
+        bool write(const uint8_t *buffer, int length, int timeout, int *written = nullptr);
+        unsigned long long bytesWritten() const { return _bytesWritten; }
+
+private:
+
+        std::string _charPath;
+        int _fd;
+        int _chunkSize;
+        unsigned long long _bytesWritten;
+
+        bool waitUntilWritable(int64_t deadline);
+        static int64_t monotonicMillis();
+};
+
+#endif // GATTWRITESTREAM_H
@@ -0,0 +1,122 @@
+/*
+ *
+ *  MacAddress - A Bluetooth device address packed into 48 bits
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef MACADDRESS_H
+#define MACADDRESS_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+
+
+#define MAC_ADDRESS_LENGTH   17
+
+
+
+class MacAddress
+{
+public:
+
+        MacAddress() : _value(INVALID_VALUE) {}
+        explicit MacAddress(uint64_t value) : _value(value & 0xffffffffffffULL) {}
+
+        // parses "XX:XX:XX:XX:XX:XX" (the separator isn't checked), returns an invalid address on errors
+        static MacAddress parse(const char *text)
+        {
+                if (!text)
+                        return MacAddress();
+                uint64_t value = 0;
+                int i = 0;
+                for (; text[i] != 0; i++)
+                {
+                        if (i >= MAC_ADDRESS_LENGTH)
+                                return MacAddress();
+                        if ((i % 3) == 2)
+                                continue;
+                        int digit = hexValue(text[i]);
+                        if (digit < 0)
+                                return MacAddress();
+                        value = (value << 4) | static_cast<uint64_t>(digit);
+                }
+                if (i != MAC_ADDRESS_LENGTH)
+                        return MacAddress();
+                return MacAddress(value);
+        }
+
+        bool isValid() const { return (_value != INVALID_VALUE); }
+        uint64_t value() const { return _value; }
+
+        bool operator==(const MacAddress &other) const { return (_value == other._value); }
+        bool operator!=(const MacAddress &other) const { return (_value != other._value); }
+
+        size_t hash() const
+        {
+                // Fibonacci hashing spreads the vendor prefix and the serial part over the whole word
+                uint64_t value = _value * 0x9e3779b97f4a7c15ULL;
+                return static_cast<size_t>(value ^ (value >> 32));
+        }
+
+        // writes the address in upper case, the buffer must hold MAC_ADDRESS_LENGTH + 1 chars
+        void format(char *text) const
+        {
+                static const char digits[] = "0123456789ABCDEF";
+                int pos = 0;
+                for (int i = 5; i >= 0; i--)
+                {
+                        uint8_t byte = static_cast<uint8_t>(_value >> (i * 8));
+                        text[pos++] = digits[byte >> 4];
+                        text[pos++] = digits[byte & 0x0f];
+                        if (i > 0)
+                                text[pos++] = ':';
+                }
+                text[pos] = 0;
+        }
+
+        std::string toString() const
+        {
+                char text[MAC_ADDRESS_LENGTH + 1];
+                format(text);
+                return std::string(text);
+        }
+
+private:
+
+        static const uint64_t INVALID_VALUE = 0xffffffffffffffffULL;   // doesn't fit into 48 bits
+
+        static int hexValue(char c)
+        {
+                if ((c >= '0') && (c <= '9'))
+                        return c - '0';
+                if ((c >= 'a') && (c <= 'f'))
+                        return c - 'a' + 10;
+                if ((c >= 'A') && (c <= 'F'))
+                        return c - 'A' + 10;
+                return -1;
+        }
+
+        uint64_t _value;
+};
+
+#endif // MACADDRESS_H
@@ -0,0 +1,130 @@
+/*
+ *
+ *  Uuid - A binary 128 bit UUID
+ *
+ *  Copyright (C) 2021  Tim Taenny
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef UUID_H
+#define UUID_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+
+
+class Uuid
+{
+public:
+
+        constexpr Uuid() : _high(0), _low(0) {}
+        constexpr Uuid(uint64_t high, uint64_t low) : _high(high), _low(low) {}
+
+        // parses the canonical form ("0000180a-0000-1000-8000-00805f9b34fb") or a 16/32 bit short form ("180a"),
+        // returns a null UUID if the text isn't valid (constant texts are parsed by the compiler)
+        static constexpr Uuid parse(const char *text)
+        {
+                if (!text)
+                        return Uuid();
+                uint64_t words[2] = { 0, 0 };
+                int digits = 0;
+                int length = 0;
+                for (; text[length] != 0; length++)
+                {
+                        if (text[length] == '-')
+                        {
+                                if ((length != 8) && (length != 13) && (length != 18) && (length != 23))
+                                        return Uuid();
+                                continue;
+                        }
+                        int value = hexValue(text[length]);
+                        if ((value < 0) || (digits >= 32))
+                                return Uuid();
+                        words[digits / 16] = (words[digits / 16] << 4) | static_cast<uint64_t>(value);
+                        digits++;
+                }
+                if ((digits == 32) && (length == 36))
+                        return Uuid(words[0], words[1]);
+
+                // short UUIDs are relative to the Bluetooth base UUID
+                if (((digits == 4) || (digits == 8)) && (length == digits))
+                        return Uuid((words[0] << 32) | BASE_UUID_HIGH, BASE_UUID_LOW);
+                return Uuid();
+        }
+
+        constexpr bool isNull() const { return (_high == 0) && (_low == 0); }
+        constexpr uint64_t high() const { return _high; }
+        constexpr uint64_t low() const { return _low; }
+
+        constexpr bool operator==(const Uuid &other) const { return (_high == other._high) && (_low == other._low); }
+        constexpr bool operator!=(const Uuid &other) const { return !(*this == other); }
+        constexpr bool operator<(const Uuid &other) const { return (_high < other._high) || ((_high == other._high) && (_low < other._low)); }
+
+        size_t hash() const
+        {
+                // the 16 bit part of short UUIDs sits in the high word, so both words are mixed
+                uint64_t value = _high ^ (_low * 0x9e3779b97f4a7c15ULL);
+                value ^= value >> 29;
+                return static_cast<size_t>(value);
+        }
+
+        std::string toString() const
+        {
+                static const char digits[] = "0123456789abcdef";
+                char text[37];
+                int pos = 0;
+                for (int i = 0; i < 32; i++)
+                {
+                        if ((i == 8) || (i == 12) || (i == 16) || (i == 20))
+                                text[pos++] = '-';
+                        uint64_t word = (i < 16) ? _high : _low;
+                        text[pos++] = digits[(word >> (60 - ((i % 16) * 4))) & 0x0f];
+                }
+                text[pos] = 0;
+                return std::string(text);
+        }
+
+private:
+
+        static constexpr uint64_t BASE_UUID_HIGH = 0x0000000000001000ULL;
+        static constexpr uint64_t BASE_UUID_LOW = 0x800000805f9b34fbULL;
+
+        static constexpr int hexValue(char c)
+        {
+                return ((c >= '0') && (c <= '9')) ? (c - '0') :
+                       ((c >= 'a') && (c <= 'f')) ? (c - 'a' + 10) :
+                       ((c >= 'A') && (c <= 'F')) ? (c - 'A' + 10) : -1;
+        }
+
+        uint64_t _high;
+        uint64_t _low;
+};
+
+
+
+// allows UUIDs as keys of unordered containers
+struct UuidHash
+{
+public:
+        size_t operator()(const Uuid &uuid) const { return uuid.hash(); }
+};
+
+#endif // UUID_H
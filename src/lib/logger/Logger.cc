@@ -26,11 +26,15 @@
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
+#include <mutex>
 
 
 
 Logger::LogLevel Logger::_logLevel = Logger::Info;
 
+// log lines are written by several threads
+static std::mutex outputMutex;
+
 
 
 void Logger::setLogLevel(LogLevel logLevel)
@@ -44,11 +48,14 @@ void Logger::Log(const char *file, int line, const LogLevel level, const char *m
         // get current time
         time_t currentTime;
         time(&currentTime);
-        struct tm *timeInfo = localtime(&currentTime);
+        struct tm localTime;
+        struct tm *timeInfo = localtime_r(&currentTime, &localTime);
 
         va_list ap;
         if (_logLevel >= level)
         {
+                std::lock_guard<std::mutex> lock(outputMutex);
+
                 // output time and log level
                 fprintf(stderr, "%04d-%02d-%02d %02d:%02d:%02d",
                         timeInfo->tm_year + 1900,